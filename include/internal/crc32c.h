@@ -2,23 +2,89 @@
 #define __MTHPC_CRC32C_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
-inline uint32_t crc32c_u32(const uint32_t crc, const uint32_t v)
+/*
+ * CRC32C (Castagnoli) without the pre/post inversion, same as the x86 crc32
+ * instruction. The library isn't built with -msse4.2, so the hardware
+ * version is compiled for the target and the caller should check
+ * crc32c_hw_supported() before using it.
+ */
+
+#define MTHPC_CRC32C_POLY 0x82f63b78U
+
+static inline uint32_t crc32c_u8_sw(uint32_t crc, const uint8_t v)
+{
+    crc ^= v;
+    for (int i = 0; i < 8; i++)
+        crc = (crc >> 1) ^ (MTHPC_CRC32C_POLY & -(crc & 1));
+    return crc;
+}
+
+static inline uint32_t crc32c_u32_sw(uint32_t crc, const uint32_t v)
 {
+    for (int i = 0; i < 4; i++)
+        crc = crc32c_u8_sw(crc, (uint8_t)(v >> (i * 8)));
+    return crc;
+}
+
+static inline uint32_t crc32c_u64_sw(uint32_t crc, const uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        crc = crc32c_u8_sw(crc, (uint8_t)(v >> (i * 8)));
+    return crc;
+}
+
 #if defined(__x86_64__)
+
+#include <nmmintrin.h>
+
+static inline bool crc32c_hw_supported(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+__attribute__((target("sse4.2"))) static inline uint32_t
+crc32c_u32(const uint32_t crc, const uint32_t v)
+{
     return _mm_crc32_u32(crc, v);
-#elif defined(__aarch64__)
-    return __crc32cw(crc, v);
-#endif
 }
 
-inline uint32_t crc32c_u64(const uint32_t crc, const uint64_t v)
+__attribute__((target("sse4.2"))) static inline uint32_t
+crc32c_u64(const uint32_t crc, const uint64_t v)
 {
-#if defined(__x86_64__)
     return (uint32_t)_mm_crc32_u64(crc, v);
-#elif defined(__aarch64__)
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+#include <arm_acle.h>
+
+static inline bool crc32c_hw_supported(void)
+{
+    return true;
+}
+
+static inline uint32_t crc32c_u32(const uint32_t crc, const uint32_t v)
+{
+    return __crc32cw(crc, v);
+}
+
+static inline uint32_t crc32c_u64(const uint32_t crc, const uint64_t v)
+{
     return (uint32_t)__crc32cd(crc, v);
-#endif
 }
 
+#else
+
+static inline bool crc32c_hw_supported(void)
+{
+    return false;
+}
+
+#define crc32c_u32 crc32c_u32_sw
+#define crc32c_u64 crc32c_u64_sw
+
+#endif
+
 #endif /* __MTHPC_CRC32C_H__ */
@@ -6,7 +6,8 @@ struct mthpc_rcu_data;
 struct mthpc_rcu_node;
 
 #define MTHPC_RCU_USR 0x0001U
-#define MTHPC_RCU_TYPE_MASK (MTHPC_RCU_USER)
+#define MTHPC_RCU_QSBR 0x0002U
+#define MTHPC_RCU_TYPE_MASK (MTHPC_RCU_USR | MTHPC_RCU_QSBR)
 
 void mthpc_rcu_data_init(struct mthpc_rcu_data *data, unsigned int type);
 void mthpc_rcu_data_exit(struct mthpc_rcu_data *data);
@@ -18,4 +19,15 @@ void mthpc_rcu_read_lock_internal(struct mthpc_rcu_node *node);
 void mthpc_rcu_read_unlock_internal(struct mthpc_rcu_node *node);
 void mthpc_synchronize_rcu_internal(struct mthpc_rcu_data *data);
 
+/*
+ * Force the memory barrier on all the running threads with membarrier, or
+ * the full barrier if it isn't available. For the flavors whose read side
+ * only has the compiler barrier when mthpc_rcu_has_sys_membarrier is set.
+ */
+void mthpc_rcu_smp_mb_master_internal(void);
+
+/* Per-CPU flavor, see mthpc/rcu_percpu.h */
+void mthpc_rcu_percpu_init(void);
+void mthpc_rcu_percpu_exit(void);
+
 #endif /* __MTHPC_INTERNAL_RCU_H__ */
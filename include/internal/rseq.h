@@ -0,0 +1,95 @@
+#ifndef __MTHPC_INTERNAL_RSEQ_H__
+#define __MTHPC_INTERNAL_RSEQ_H__
+
+/*
+ * Restartable sequences (rseq)
+ *
+ * glibc (2.35+) registers the rseq area for every thread. The per-CPU
+ * operation runs in the rseq critical section. If the thread is preempted,
+ * migrated or signaled before the commit, the kernel restarts it at the
+ * abort handler. So the per-CPU data can be updated without the atomic
+ * instruction. Only x86-64 is supported. The debug build uses the fallback,
+ * the sanitizer can't see the stores in asm.
+ */
+
+#if defined(__x86_64__) && defined(__GLIBC__) && !defined(CONFIG_DEBUG)
+#if __has_include(<sys/rseq.h>)
+#define MTHPC_HAVE_RSEQ
+#endif
+#endif
+
+#ifdef MTHPC_HAVE_RSEQ
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/rseq.h>
+
+#include <mthpc/util.h>
+
+#define ___mthpc_rseq_str(x) #x
+#define __mthpc_rseq_str(x) ___mthpc_rseq_str(x)
+
+/* glibc didn't register the rseq area, e.g., glibc.pthread.rseq=0. */
+static __always_inline bool mthpc_rseq_available(void)
+{
+    return __rseq_size > 0;
+}
+
+/* Return (unsigned int)-1 if the area isn't registered. */
+static __always_inline unsigned int mthpc_rseq_cpu_id(void)
+{
+    struct rseq *rs = (struct rseq *)((uintptr_t)__builtin_thread_pointer() +
+                                      __rseq_offset);
+
+    return READ_ONCE(rs->cpu_id);
+}
+
+/*
+ * Add @count to *@v if we are still running on @cpu. Return 0 on success,
+ * or -1 if the sequence was aborted and the caller should retry with the
+ * new cpu id. asm goto can't have the output operand before GCC 11, so pass
+ * the address in the register and let the memory clobber cover the store.
+ */
+static __always_inline int mthpc_rseq_addv(unsigned long *v,
+                                           unsigned long count,
+                                           unsigned int cpu)
+{
+    __asm__ __volatile__ goto(
+        /* struct rseq_cs: version, flags, start, post_commit_offset, abort */
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        ".pushsection __rseq_cs_ptr_array, \"aw\"\n\t"
+        ".quad 3b\n\t"
+        ".popsection\n\t"
+        /* rseq->rseq_cs = &cs */
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %%fs:8(%[rseq_offset])\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %%fs:4(%[rseq_offset])\n\t"
+        "jnz 4f\n\t"
+        "addq %[count], (%[v])\n\t"
+        "2:\n\t"
+        /* The abort handler should be preceded by the signature. */
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " __mthpc_rseq_str(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu] "r"(cpu), [rseq_offset] "r"(__rseq_offset), [v] "r"(v),
+          [count] "er"(count)
+        : "memory", "cc", "rax"
+        : abort);
+    return 0;
+abort:
+    return -1;
+}
+
+#endif /* MTHPC_HAVE_RSEQ */
+
+#endif /* __MTHPC_INTERNAL_RSEQ_H__ */
@@ -0,0 +1,19 @@
+#ifndef __MTHPC_INTERNAL_SRCU_H__
+#define __MTHPC_INTERNAL_SRCU_H__
+
+#include <stdbool.h>
+
+#include <mthpc/srcu.h>
+
+/*
+ * The two-slot per-CPU counters of srcu, shared with the per-CPU rcu
+ * flavor which has its own read side. @nr is the number of the counters,
+ * and @mb is the full barrier of the updater pairing with the read side.
+ */
+void mthpc_srcu_init_internal(struct mthpc_srcu_struct *sp, unsigned int nr);
+bool mthpc_srcu_readers_done_internal(struct mthpc_srcu_struct *sp, int idx,
+                                      void (*mb)(void));
+void mthpc_synchronize_srcu_internal(struct mthpc_srcu_struct *sp,
+                                     void (*mb)(void));
+
+#endif /* __MTHPC_INTERNAL_SRCU_H__ */
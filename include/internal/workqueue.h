@@ -9,6 +9,6 @@ int mthpc_queue_thread_work(struct mthpc_work *work);
 
 /* Taskflow workqueue */
 
-int mthpc_schedule_taskflow_work_on(int cpu, struct mthpc_work *work);
+int mthpc_queue_taskflow_work_batch(struct mthpc_work **works, int n);
 
 #endif /* __MTHPC_INTERNAL_WORKQUEUE_H__ */
@@ -136,4 +136,83 @@ static inline void mthpc_list_splice_tail(struct mthpc_list_head *list,
     for (pos = mthpc_list_entry((head)->next, __typeof__(*pos), member); \
          &pos->member != (head); pos = mthpc_list_next_entry(pos, member))
 
+/*
+ * Hash list, the head only has one pointer so that the large bucket array
+ * costs half of the memory. The pprev points to the previous next pointer,
+ * so the node can be removed without knowing the head.
+ */
+
+struct mthpc_hlist_node {
+    struct mthpc_hlist_node *next;
+    struct mthpc_hlist_node **pprev;
+};
+
+struct mthpc_hlist_head {
+    struct mthpc_hlist_node *first;
+};
+
+#define mthpc_hlist_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define mthpc_hlist_entry_safe(ptr, type, member)          \
+    ({                                                     \
+        __typeof__(ptr) ____ptr = (ptr);                   \
+        ____ptr ? mthpc_hlist_entry(____ptr, type, member) \
+                : NULL;                                    \
+    })
+
+static inline void mthpc_hlist_init(struct mthpc_hlist_head *head)
+{
+    head->first = NULL;
+}
+
+static inline void mthpc_hlist_node_init(struct mthpc_hlist_node *node)
+{
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+static inline bool mthpc_hlist_empty(const struct mthpc_hlist_head *head)
+{
+    return !head->first;
+}
+
+static inline bool mthpc_hlist_unhashed(const struct mthpc_hlist_node *node)
+{
+    return !node->pprev;
+}
+
+static inline void mthpc_hlist_add_head(struct mthpc_hlist_node *node,
+                                        struct mthpc_hlist_head *head)
+{
+    struct mthpc_hlist_node *first = head->first;
+
+    node->next = first;
+    if (first)
+        first->pprev = &node->next;
+    head->first = node;
+    node->pprev = &head->first;
+}
+
+static inline void __mthpc_hlist_del(struct mthpc_hlist_node *node)
+{
+    struct mthpc_hlist_node *next = node->next;
+    struct mthpc_hlist_node **pprev = node->pprev;
+
+    *pprev = next;
+    if (next)
+        next->pprev = pprev;
+}
+
+static inline void mthpc_hlist_del(struct mthpc_hlist_node *node)
+{
+    __mthpc_hlist_del(node);
+    mthpc_hlist_node_init(node);
+}
+
+#define mthpc_hlist_for_each_entry(pos, head, member)                      \
+    for (pos = mthpc_hlist_entry_safe((head)->first, __typeof__(*pos),     \
+                                      member);                             \
+         pos; pos = mthpc_hlist_entry_safe(pos->member.next,               \
+                                           __typeof__(*pos), member))
+
 #endif /* __MTHPC_LIST_H__ */
@@ -1,6 +1,9 @@
 #ifndef __MTHPC_RCU_H__
 #define __MTHPC_RCU_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <stdatomic.h>
 
 #include <mthpc/spinlock.h>
@@ -27,30 +30,137 @@
  * than thread from user rcu_data.
  */
 
+struct mthpc_rcu_head {
+    struct mthpc_rcu_head *next;
+    union {
+        void (*func)(struct mthpc_rcu_head *head);
+        /* The object to free if mthpc_free_rcu() falls back to the head. */
+        void *ptr;
+    };
+};
+
+struct mthpc_rcu_bulk;
+struct mthpc_rcu_stats_data;
+
 struct mthpc_rcu_node {
     unsigned long id;
     atomic_ulong gp_seq;
-    struct mthpc_rcu_node *next;
+    /* NULL if the slot is free. */
     struct mthpc_rcu_data *data;
+    /* The index in the registry, see mthpc_rcu_data. */
+    unsigned int slot;
+    unsigned int next_free;
+    /* Tree mode: the leaf of the node and the position in it. */
+    unsigned int leaf;
+    unsigned int leaf_pos;
+    /* The thread id (gettid) of the owner, only set with the rcu stats. */
+    long tid;
+    /*
+     * The pending callbacks queued by the owner thread. It's the lock-free
+     * stack, the rcu gp thread will take the whole list at once.
+     */
+    _Atomic(struct mthpc_rcu_head *) cb_head;
+    /* The partial block of mthpc_free_rcu(), see rcu.c. */
+    _Atomic(struct mthpc_rcu_bulk *) bulk;
+    /* The marker of mthpc_rcu_barrier(), see rcu.c. */
+    struct mthpc_rcu_head barrier;
 } __mthpc_aligned__;
 
+/*
+ * The registry of the readers is the array of the per-thread slots (rcu node).
+ * It grows by chunk, chunk k has (MTHPC_RCU_SLOT_BASE << k) slots. So the
+ * registered node never moves and the slot index can be translated to the
+ * chunk in O(1). The free slots are linked by the index for O(1)
+ * register/unregister.
+ */
+#define MTHPC_RCU_SLOT_BASE_SHIFT 2
+#define MTHPC_RCU_SLOT_BASE (1U << MTHPC_RCU_SLOT_BASE_SHIFT)
+#define MTHPC_RCU_NR_CHUNK 24
+#define MTHPC_RCU_NO_SLOT (~0U)
+
 struct mthpc_rcu_data {
+    /* Serializes the gp leaders while they wait for the readers. */
     spinlock_t lock;
-    struct mthpc_rcu_node *head;
+    /*
+     * Protects the slots (chunk, nr_slot, free_slot, node->data and the
+     * blocked scratch). Register and unregister only take this one, and the
+     * gp leader only holds it for each pass over the readers. So the threads
+     * can come and go, and the gp thread can walk the nodes for the
+     * callbacks, during the grace period.
+     */
+    spinlock_t slot_lock;
+    struct mthpc_rcu_node *chunk[MTHPC_RCU_NR_CHUNK];
+    /* The scratch of the blocking nodes, grown with the chunks. */
+    struct mthpc_rcu_node **blocked;
+    /* The number of slots ever used, the scan stops here. */
+    unsigned int nr_slot;
+    unsigned int free_slot;
     unsigned int type;
     unsigned long gp_seq;
+    /*
+     * The updater sets futex to -1 before it sleeps on the long reader.
+     * The outermost read unlock wakes it up only if it's -1.
+     */
+    int32_t futex;
+    /*
+     * Grace-period sharing. gp_seq_nr counts the grace periods and the
+     * lowest bit is set while one is in flight. The callers snapshot it,
+     * one of them becomes the leader (gp_leader) and drives the grace
+     * period. The others sleep on gp_wait until their snapshot is covered.
+     */
+    atomic_ulong gp_seq_nr;
+    atomic_int gp_leader;
+    int32_t gp_wait;
+    atomic_int nr_gp_waiter;
 
+    /* Unique in the process, the key of the domain cache. */
+    unsigned long id;
+    /* The users which found it in the list, destroy waits for them. */
+    atomic_int nr_user;
+    /* NULL unless built with the rcu stats, see mthpc_rcu_stats. */
+    struct mthpc_rcu_stats_data *stats;
     struct mthpc_rcu_data *next;
 };
 
 extern __thread struct mthpc_rcu_node *mthpc_rcu_node_ptr;
 
+/*
+ * If the kernel supports membarrier, the updater forces the memory barrier
+ * on the CPUs running the readers. So the read side only needs the compiler
+ * barrier. Otherwise, fallback to the full memory barrier on read side.
+ */
+extern int mthpc_rcu_has_sys_membarrier;
+
+/*
+ * The signal flavor (built with rcu_signal=1) doesn't use membarrier. The
+ * updater sends the signal to the registered readers instead, so the read
+ * side always uses the compiler barrier. Define CONFIG_MTHPC_RCU_SIGNAL
+ * for the users too, or they fall back to the memory barrier.
+ */
+#ifdef CONFIG_MTHPC_RCU_SIGNAL
+#define mthpc_rcu_reader_cmb_only() 1
+#else
+#define mthpc_rcu_reader_cmb_only() mthpc_rcu_has_sys_membarrier
+#endif
+
+/*
+ * The membarrier (or the signal) orders the reader state for the updater,
+ * but TSan doesn't understand it. Release the state in the debug build so
+ * TSan can pair it with the acquire in the reader scan of the updater.
+ */
+#if defined(CONFIG_DEBUG) || defined(__SANITIZE_THREAD__)
+#define MTHPC_RCU_READER_ORDER memory_order_release
+#else
+#define MTHPC_RCU_READER_ORDER memory_order_relaxed
+#endif
+
 #define MTHPC_GP_COUNT (1UL << 0)
 #define MTHPC_GP_CTR_PHASE (1UL << (sizeof(unsigned long) << 2))
 #define MTHPC_GP_CTR_NEST_MASK (MTHPC_GP_CTR_PHASE - 1)
 
 void mthpc_rcu_thread_init(void);
 void mthpc_rcu_thread_exit(void);
+void mthpc_rcu_wake_up_gp(struct mthpc_rcu_node *node);
 
 static __always_inline void __allow_unused
 mthpc_rcu_read_lock_internal(struct mthpc_rcu_node *node)
@@ -62,8 +172,13 @@ mthpc_rcu_read_lock_internal(struct mthpc_rcu_node *node)
 
     node_gp = atomic_load_explicit(&node->gp_seq, memory_order_consume);
     if (likely(!(node_gp & MTHPC_GP_CTR_NEST_MASK))) {
-        atomic_store_explicit(&node->gp_seq, READ_ONCE(node->data->gp_seq),
-                              memory_order_seq_cst);
+        if (likely(mthpc_rcu_reader_cmb_only())) {
+            atomic_store_explicit(&node->gp_seq, READ_ONCE(node->data->gp_seq),
+                                  memory_order_relaxed);
+            mthpc_cmb();
+        } else
+            atomic_store_explicit(&node->gp_seq, READ_ONCE(node->data->gp_seq),
+                                  memory_order_seq_cst);
     } else
         atomic_fetch_add_explicit(&node->gp_seq, MTHPC_GP_COUNT,
                                   memory_order_relaxed);
@@ -78,13 +193,111 @@ mthpc_rcu_read_unlock_internal(struct mthpc_rcu_node *node)
     mthpc_cmb();
     node_gp = atomic_load_explicit(&node->gp_seq, memory_order_consume);
     if (likely((node_gp & MTHPC_GP_CTR_NEST_MASK) == MTHPC_GP_COUNT)) {
-        atomic_fetch_add_explicit(&node->gp_seq, -MTHPC_GP_COUNT,
-                                  memory_order_seq_cst);
+        if (likely(mthpc_rcu_reader_cmb_only())) {
+            atomic_store_explicit(&node->gp_seq, node_gp - MTHPC_GP_COUNT,
+                                  MTHPC_RCU_READER_ORDER);
+            mthpc_cmb();
+        } else
+            atomic_fetch_add_explicit(&node->gp_seq, -MTHPC_GP_COUNT,
+                                      memory_order_seq_cst);
+        if (unlikely(atomic_load_explicit(
+                         (volatile _Atomic int32_t *)&node->data->futex,
+                         memory_order_seq_cst) == -1))
+            mthpc_rcu_wake_up_gp(node);
     } else
         atomic_fetch_add_explicit(&node->gp_seq, -MTHPC_GP_COUNT,
                                   memory_order_relaxed);
 }
 
+/*
+ * QSBR (quiescent-state-based) flavor
+ *
+ * The thread reports the quiescent state by itself, so the read side
+ * critical section is free. The node's gp_seq is the snapshot of the
+ * QSBR gp_seq at the last quiescent state, or zero if the thread is
+ * offline.
+ */
+
+#define MTHPC_GP_QSBR_ONLINE MTHPC_GP_COUNT
+#define MTHPC_GP_QSBR_CTR (MTHPC_GP_COUNT << 1)
+
+extern __thread struct mthpc_rcu_node *mthpc_rcu_qsbr_node_ptr;
+
+void mthpc_rcu_qsbr_thread_init(void);
+void mthpc_rcu_qsbr_thread_exit(void);
+void mthpc_synchronize_rcu_qsbr(void);
+
+static __always_inline void
+mthpc_rcu_qsbr_wake_up_gp(struct mthpc_rcu_node *node)
+{
+    if (unlikely(atomic_load_explicit(
+                     (volatile _Atomic int32_t *)&node->data->futex,
+                     memory_order_relaxed) == -1))
+        mthpc_rcu_wake_up_gp(node);
+}
+
+static __always_inline void mthpc_rcu_quiescent_state(void)
+{
+    struct mthpc_rcu_node *node = mthpc_rcu_qsbr_node_ptr;
+    unsigned long gp_seq;
+
+    MTHPC_WARN_ON(!node, "rcu qsbr node == NULL");
+    gp_seq = READ_ONCE(node->data->gp_seq);
+    if (gp_seq == atomic_load_explicit(&node->gp_seq, memory_order_relaxed))
+        return;
+    /* Finish the previous reads before reporting. */
+    smp_mb();
+    atomic_store_explicit(&node->gp_seq, gp_seq, MTHPC_RCU_READER_ORDER);
+    /* Write gp_seq before reading the futex. */
+    smp_mb();
+    mthpc_rcu_qsbr_wake_up_gp(node);
+}
+
+static __always_inline void mthpc_rcu_thread_offline(void)
+{
+    struct mthpc_rcu_node *node = mthpc_rcu_qsbr_node_ptr;
+
+    MTHPC_WARN_ON(!node, "rcu qsbr node == NULL");
+    smp_mb();
+    atomic_store_explicit(&node->gp_seq, 0, MTHPC_RCU_READER_ORDER);
+    smp_mb();
+    mthpc_rcu_qsbr_wake_up_gp(node);
+}
+
+static __always_inline void mthpc_rcu_thread_online(void)
+{
+    struct mthpc_rcu_node *node;
+
+    if (unlikely(!mthpc_rcu_qsbr_node_ptr))
+        mthpc_rcu_qsbr_thread_init();
+    node = mthpc_rcu_qsbr_node_ptr;
+    atomic_store_explicit(&node->gp_seq, READ_ONCE(node->data->gp_seq),
+                          memory_order_relaxed);
+    smp_mb();
+}
+
+void mthpc_synchronize_rcu(void);
+
+/*
+ * Define CONFIG_MTHPC_RCU_QSBR before including this header to switch the
+ * rcu APIs of the translation unit to the QSBR flavor.
+ */
+#ifdef CONFIG_MTHPC_RCU_QSBR
+
+static __always_inline void mthpc_rcu_read_lock(void)
+{
+}
+
+static __always_inline void mthpc_rcu_read_unlock(void)
+{
+}
+
+#define mthpc_rcu_thread_init mthpc_rcu_qsbr_thread_init
+#define mthpc_rcu_thread_exit mthpc_rcu_qsbr_thread_exit
+#define mthpc_synchronize_rcu mthpc_synchronize_rcu_qsbr
+
+#else /* !CONFIG_MTHPC_RCU_QSBR */
+
 static __always_inline void mthpc_rcu_read_lock(void)
 {
     if (unlikely(!mthpc_rcu_node_ptr))
@@ -97,14 +310,70 @@ static __always_inline void mthpc_rcu_read_unlock(void)
     mthpc_rcu_read_unlock_internal(mthpc_rcu_node_ptr);
 }
 
-void mthpc_synchronize_rcu(void);
+#endif /* CONFIG_MTHPC_RCU_QSBR */
+
+/*
+ * Domain
+ *
+ * The rcu domain has its own readers and grace period, so the long readers
+ * of one domain don't delay the updaters of the others. The thread
+ * registers to the domain at the first read lock and unregisters when it
+ * exits. The per-thread node is found by the direct-mapped cache indexed
+ * by the domain id.
+ */
+
+#define MTHPC_RCU_DOMAIN_CACHE 8
+
+struct mthpc_rcu_domain_cache {
+    unsigned long id;
+    struct mthpc_rcu_node *node;
+};
+
+extern __thread struct mthpc_rcu_domain_cache
+    mthpc_rcu_domain_cache[MTHPC_RCU_DOMAIN_CACHE];
+
+struct mthpc_rcu_data *mthpc_rcu_domain_create(void);
+void mthpc_rcu_domain_destroy(struct mthpc_rcu_data *domain);
+void mthpc_synchronize_rcu_domain(struct mthpc_rcu_data *domain);
+struct mthpc_rcu_node *
+mthpc_rcu_domain_node_slow(struct mthpc_rcu_data *domain);
+
+static __always_inline struct mthpc_rcu_node *
+mthpc_rcu_domain_node(struct mthpc_rcu_data *domain)
+{
+    struct mthpc_rcu_domain_cache *cache =
+        &mthpc_rcu_domain_cache[domain->id & (MTHPC_RCU_DOMAIN_CACHE - 1)];
+
+    if (likely(cache->id == domain->id))
+        return cache->node;
+    return mthpc_rcu_domain_node_slow(domain);
+}
+
+static __always_inline void
+mthpc_rcu_domain_read_lock(struct mthpc_rcu_data *domain)
+{
+    mthpc_rcu_read_lock_internal(mthpc_rcu_domain_node(domain));
+}
+
+static __always_inline void
+mthpc_rcu_domain_read_unlock(struct mthpc_rcu_data *domain)
+{
+    mthpc_rcu_read_unlock_internal(mthpc_rcu_domain_node(domain));
+}
 
 #define mthpc_rcu_replace_pointer(p, new)                                     \
     ({                                                                        \
         atomic_exchange_explicit((volatile _Atomic __typeof__(p) *)&p, (new), \
-                                 memory_order_release);                       \
+                                 memory_order_acq_rel);                       \
     })
 
+/* Publish the pointer, the cheaper replace_pointer without the old value. */
+#define mthpc_rcu_assign_pointer(p, new)                                   \
+    do {                                                                   \
+        atomic_store_explicit((volatile _Atomic __typeof__(p) *)&p, (new), \
+                              memory_order_release);                       \
+    } while (0)
+
 #define mthpc_rcu_dereference(p)                                   \
     ({                                                             \
         atomic_load_explicit((volatile _Atomic __typeof__(p) *)&p, \
@@ -113,9 +382,80 @@ void mthpc_synchronize_rcu(void);
 
 void mthpc_synchronize_rcu_all(void);
 
-struct mthpc_rcu_head;
+/*
+ * The grace-period statistics, only recorded if the library is built with
+ * rcu_stats=1 (CONFIG_MTHPC_RCU_STATS). gp_hist[i] counts the grace periods
+ * took [2^(i-1), 2^i) us, gp_hist[0] is for less than 1 us.
+ */
+#define MTHPC_RCU_STATS_NR_HIST 32
 
+struct mthpc_rcu_stats {
+    unsigned long nr_gp;
+    unsigned long gp_total_ns;
+    unsigned long gp_max_ns;
+    unsigned long gp_hist[MTHPC_RCU_STATS_NR_HIST];
+    /* The readers scanned, and the blocking ones the updater waited for. */
+    unsigned long nr_scanned;
+    unsigned long nr_blocked;
+    /* How long the updater waited for each blocking reader. */
+    unsigned long wait_total_ns;
+    unsigned long wait_max_ns;
+    /* The thread id (gettid) of the reader took wait_max_ns. */
+    long slowest_tid;
+    /* The number of the waits which exceeded the stall threshold. */
+    unsigned long nr_stall;
+};
+
+/*
+ * Copy the statistics of the domain, NULL for the global rcu. Return -1 if
+ * the stats isn't enabled.
+ */
+int mthpc_rcu_stats_snapshot(struct mthpc_rcu_data *domain,
+                             struct mthpc_rcu_stats *stats);
+
+/* The callbacks wait for the default flavor only. */
+#ifndef CONFIG_MTHPC_RCU_QSBR
 void mthpc_call_rcu(struct mthpc_rcu_head *head,
                     void (*func)(struct mthpc_rcu_head *));
 
+/*
+ * Free the object after a grace period, the field is the struct
+ * mthpc_rcu_head in it. Only the pointer is recorded in the per-thread
+ * page-sized block, and the whole block is freed at once without invoking
+ * the callback per object. The head is used only if the block allocation
+ * fails.
+ */
+#define MTHPC_RCU_BULK_SIZE 4096
+
+void __mthpc_free_rcu(void *ptr, struct mthpc_rcu_head *head);
+
+#define mthpc_free_rcu(ptr, field)                \
+    do {                                          \
+        __typeof__(ptr) ___p = (ptr);             \
+        if (___p)                                 \
+            __mthpc_free_rcu(___p, &___p->field); \
+    } while (0)
+
+/*
+ * Wait for all the callbacks and mthpc_free_rcu() queued before it to be
+ * invoked. Don't call it from the callback.
+ */
+void mthpc_rcu_barrier(void);
+
+/*
+ * Lower latency than mthpc_synchronize_rcu() at the cost of forcing the
+ * memory barrier on all the reader threads.
+ */
+void mthpc_synchronize_rcu_expedited(void);
+
+/*
+ * Polled grace period: take a cookie, then check or wait for the end of the
+ * grace period it stands for. start_poll also asks the gp thread to run one.
+ */
+unsigned long mthpc_get_state_synchronize_rcu(void);
+unsigned long mthpc_start_poll_synchronize_rcu(void);
+bool mthpc_poll_state_synchronize_rcu(unsigned long cookie);
+void mthpc_cond_synchronize_rcu(unsigned long cookie);
+#endif
+
 #endif /* __MTHPC_RCU_H__ */
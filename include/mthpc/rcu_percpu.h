@@ -0,0 +1,25 @@
+#ifndef __MTHPC_RCU_PERCPU_H__
+#define __MTHPC_RCU_PERCPU_H__
+
+/*
+ * Per-CPU RCU flavor
+ *
+ * The readers don't register the thread. They count themselves in the
+ * per-CPU counters, so the read side costs the same for the short-lived
+ * threads and the grace period only scans the CPUs instead of the threads.
+ * The counters are increased in the restartable sequence (rseq) if the
+ * kernel and libc support it, otherwise with the atomic operations. Same
+ * as SRCU, the updater flips the index and waits for the lock and unlock
+ * counters of the old one to be balanced.
+ *
+ * The read-side critical section can be nested, but it shouldn't block.
+ * It's independent of the other rcu flavors, use the synchronize function
+ * below to wait for its readers.
+ */
+
+void mthpc_rcu_percpu_read_lock(void);
+void mthpc_rcu_percpu_read_unlock(void);
+
+void mthpc_synchronize_rcu_percpu(void);
+
+#endif /* __MTHPC_RCU_PERCPU_H__ */
@@ -0,0 +1,68 @@
+#ifndef __MTHPC_RCULFHASH_H__
+#define __MTHPC_RCULFHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <mthpc/rcu.h>
+#include <mthpc/util.h>
+
+/*
+ * Lock-free resizable RCU hash table
+ *
+ * All the nodes are in one list sorted by the bit-reversed hash (split
+ * order), and the bucket is the dummy node pointing into the list. So the
+ * table grows by inserting the new dummy nodes one by one, the nodes never
+ * move and the readers are never stalled. The doubling is split into
+ * chunks, which the later adds insert, so no single add pays for the whole
+ * level. The table keeps the old size until the last chunk is done.
+ *
+ * The lookup, add and del should be called in the rcu read-side critical
+ * section (mthpc_rcu_read_lock()). The node removed by mthpc_lfht_del()
+ * can be freed after a grace period, e.g., with mthpc_call_rcu().
+ */
+
+struct mthpc_lfht_node {
+    /* The lowest bit marks the node as removed. */
+    atomic_uintptr_t next;
+    uint64_t reverse_hash;
+};
+
+struct mthpc_lfht;
+
+/* Return non-zero if the node has the key. */
+typedef int (*mthpc_lfht_match_fn)(struct mthpc_lfht_node *node,
+                                   const void *key);
+
+struct mthpc_lfht *mthpc_lfht_create(unsigned long init_size);
+/* The table should be empty and no one is using it. */
+void mthpc_lfht_destroy(struct mthpc_lfht *ht);
+
+struct mthpc_lfht_node *mthpc_lfht_lookup(struct mthpc_lfht *ht,
+                                          uint64_t hash,
+                                          mthpc_lfht_match_fn match,
+                                          const void *key);
+/*
+ * Add the node if there is no node matched the key. Return the node in the
+ * table, which is not the new one if the key already exists.
+ */
+struct mthpc_lfht_node *mthpc_lfht_add_unique(struct mthpc_lfht *ht,
+                                              uint64_t hash,
+                                              mthpc_lfht_match_fn match,
+                                              const void *key,
+                                              struct mthpc_lfht_node *node);
+/* Return 0 on success, -1 if the node has been removed by the others. */
+int mthpc_lfht_del(struct mthpc_lfht *ht, struct mthpc_lfht_node *node);
+
+/* Approximate, the concurrent updates might not be counted. */
+long mthpc_lfht_count(struct mthpc_lfht *ht);
+unsigned long mthpc_lfht_size(struct mthpc_lfht *ht);
+
+/* Hash with the CRC32C, use the hardware instruction if the CPU supports. */
+uint64_t mthpc_lfht_hash_u64(uint64_t key);
+uint64_t mthpc_lfht_hash(const void *buf, size_t len);
+
+#define mthpc_lfht_entry(ptr, type, member) container_of(ptr, type, member)
+
+#endif /* __MTHPC_RCULFHASH_H__ */
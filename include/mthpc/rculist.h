@@ -17,6 +17,18 @@
          pos =                                                               \
              mthpc_list_entry_rcu(pos->member.next, __typeof__(*pos), member))
 
+/*
+ * Prefetch the next node while the current one is being processed, it helps
+ * the long chain. The prefetch never faults, so it's safe even if the next
+ * node is being removed and freed.
+ */
+#define mthpc_list_for_each_entry_rcu_prefetch(pos, head, member)            \
+    for (pos = mthpc_list_entry_rcu((head)->next, __typeof__(*pos), member); \
+         &pos->member != (head) &&                                           \
+         (mthpc_prefetch(READ_ONCE(pos->member.next)), 1);                   \
+         pos =                                                               \
+             mthpc_list_entry_rcu(pos->member.next, __typeof__(*pos), member))
+
 static inline void __mthpc_list_add_rcu(struct mthpc_list_head *new,
                                         struct mthpc_list_head *prev,
                                         struct mthpc_list_head *next)
@@ -54,4 +66,136 @@ static inline void mthpc_list_del_rcu(struct mthpc_list_head *node)
     node->prev = NULL;
 }
 
+/* The old node can be freed after a grace period. */
+static inline void mthpc_list_replace_rcu(struct mthpc_list_head *old,
+                                          struct mthpc_list_head *new)
+{
+    new->next = old->next;
+    new->prev = old->prev;
+    mthpc_rcu_assign_pointer(new->prev->next, new);
+    new->next->prev = new;
+    old->prev = NULL;
+}
+
+static inline void __mthpc_list_splice_init_rcu(struct mthpc_list_head *list,
+                                                struct mthpc_list_head *prev,
+                                                struct mthpc_list_head *next,
+                                                void (*sync)(void))
+{
+    struct mthpc_list_head *first = list->next;
+    struct mthpc_list_head *last = list->prev;
+
+    /*
+     * The readers still traversing the old list would follow the last node
+     * into the new list and never meet the old head again. So empty the old
+     * list and wait for them to leave before linking the last node.
+     */
+    WRITE_ONCE(list->next, list);
+    list->prev = list;
+    sync();
+
+    last->next = next;
+    first->prev = prev;
+    /* Publish the whole chain with one store. */
+    mthpc_rcu_assign_pointer(prev->next, first);
+    next->prev = last;
+}
+
+/*
+ * Move all the nodes of the list to the head and reinitialize the list.
+ * The sync function, e.g., mthpc_synchronize_rcu, is called once if the list
+ * isn't empty. The list should not be updated concurrently, but both lists
+ * can be read.
+ */
+static inline void mthpc_list_splice_init_rcu(struct mthpc_list_head *list,
+                                              struct mthpc_list_head *head,
+                                              void (*sync)(void))
+{
+    if (!mthpc_list_empty(list))
+        __mthpc_list_splice_init_rcu(list, head, head->next, sync);
+}
+
+static inline void
+mthpc_list_splice_tail_init_rcu(struct mthpc_list_head *list,
+                                struct mthpc_list_head *head,
+                                void (*sync)(void))
+{
+    if (!mthpc_list_empty(list))
+        __mthpc_list_splice_init_rcu(list, head->prev, head, sync);
+}
+
+/* hlist */
+
+#define mthpc_hlist_for_each_entry_rcu(pos, head, member)                   \
+    for (pos = mthpc_hlist_entry_safe(READ_ONCE((head)->first),             \
+                                      __typeof__(*pos), member);            \
+         pos; pos = mthpc_hlist_entry_safe(READ_ONCE(pos->member.next),     \
+                                           __typeof__(*pos), member))
+
+#define mthpc_hlist_for_each_entry_rcu_prefetch(pos, head, member)          \
+    for (pos = mthpc_hlist_entry_safe(READ_ONCE((head)->first),             \
+                                      __typeof__(*pos), member);            \
+         pos && (mthpc_prefetch(READ_ONCE(pos->member.next)), 1);           \
+         pos = mthpc_hlist_entry_safe(READ_ONCE(pos->member.next),          \
+                                      __typeof__(*pos), member))
+
+static inline void mthpc_hlist_add_head_rcu(struct mthpc_hlist_node *node,
+                                            struct mthpc_hlist_head *head)
+{
+    struct mthpc_hlist_node *first = head->first;
+
+    node->next = first;
+    node->pprev = &head->first;
+    mthpc_rcu_assign_pointer(head->first, node);
+    if (first)
+        first->pprev = &node->next;
+}
+
+static inline void mthpc_hlist_add_before_rcu(struct mthpc_hlist_node *node,
+                                              struct mthpc_hlist_node *next)
+{
+    node->pprev = next->pprev;
+    node->next = next;
+    mthpc_rcu_assign_pointer(*node->pprev, node);
+    next->pprev = &node->next;
+}
+
+static inline void mthpc_hlist_add_behind_rcu(struct mthpc_hlist_node *node,
+                                              struct mthpc_hlist_node *prev)
+{
+    node->next = prev->next;
+    node->pprev = &prev->next;
+    mthpc_rcu_assign_pointer(prev->next, node);
+    if (node->next)
+        node->next->pprev = &node->next;
+}
+
+/*
+ * Keep the next pointer for the readers still on the node. The next node may
+ * be new to the readers coming from pprev, so publish it with release.
+ */
+static inline void mthpc_hlist_del_rcu(struct mthpc_hlist_node *node)
+{
+    struct mthpc_hlist_node *next = node->next;
+    struct mthpc_hlist_node **pprev = node->pprev;
+
+    mthpc_rcu_assign_pointer(*pprev, next);
+    if (next)
+        next->pprev = pprev;
+    node->pprev = NULL;
+}
+
+static inline void mthpc_hlist_replace_rcu(struct mthpc_hlist_node *old,
+                                           struct mthpc_hlist_node *new)
+{
+    struct mthpc_hlist_node *next = old->next;
+
+    new->next = next;
+    new->pprev = old->pprev;
+    mthpc_rcu_assign_pointer(*new->pprev, new);
+    if (next)
+        next->pprev = &new->next;
+    old->pprev = NULL;
+}
+
 #endif /* __MTHPC_RCULIST_H__ */
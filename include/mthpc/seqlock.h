@@ -0,0 +1,118 @@
+#ifndef __MTHPC_SEQLOCK_H__
+#define __MTHPC_SEQLOCK_H__
+
+#include <stdbool.h>
+
+#include <mthpc/spinlock.h>
+#include <mthpc/util.h>
+
+/*
+ * Sequence lock
+ *
+ * For the tiny read-mostly data, e.g., the timestamp or the pair of the
+ * counters, copying and replacing it with rcu costs more than the data
+ * itself. The writer makes the sequence odd while it's updating the data.
+ * The reader snapshots the sequence, reads the data, and retries if the
+ * sequence has changed. So the reader never writes the shared memory and
+ * scales with the number of the readers. But it might see the torn data
+ * before the retry, so only read the data with READ_ONCE() and don't
+ * follow the pointers in it.
+ *
+ * mthpc_seqcount_t doesn't serialize the writers, the user should do it.
+ * mthpc_seqlock_t has the spinlock for the writers.
+ */
+
+typedef struct {
+    unsigned int sequence;
+} mthpc_seqcount_t;
+
+#define MTHPC_SEQCOUNT_INIT \
+    {                       \
+        .sequence = 0       \
+    }
+
+static __always_inline void mthpc_seqcount_init(mthpc_seqcount_t *s)
+{
+    s->sequence = 0;
+}
+
+/* Wait for the writer in progress and return the snapshot. */
+static __always_inline unsigned int
+mthpc_read_seqcount_begin(mthpc_seqcount_t *s)
+{
+    unsigned int seq;
+
+    while (unlikely((seq = READ_ONCE(s->sequence)) & 0x1))
+        mthpc_cmb();
+    /* Read the sequence before the data. */
+    smp_rmb();
+
+    return seq;
+}
+
+/* Return true if the writer has changed the data after the snapshot. */
+static __always_inline bool mthpc_read_seqcount_retry(mthpc_seqcount_t *s,
+                                                      unsigned int start)
+{
+    /* Read the data before checking the sequence again. */
+    smp_rmb();
+
+    return unlikely(READ_ONCE(s->sequence) != start);
+}
+
+static __always_inline void mthpc_write_seqcount_begin(mthpc_seqcount_t *s)
+{
+    WRITE_ONCE(s->sequence, s->sequence + 1);
+    /* Make the sequence odd before writing the data. */
+    smp_wmb();
+}
+
+static __always_inline void mthpc_write_seqcount_end(mthpc_seqcount_t *s)
+{
+    /* Write the data before making the sequence even. */
+    smp_wmb();
+    WRITE_ONCE(s->sequence, s->sequence + 1);
+}
+
+typedef struct {
+    mthpc_seqcount_t seqcount;
+    spinlock_t lock;
+} mthpc_seqlock_t;
+
+#define MTHPC_SEQLOCK_INIT                                      \
+    {                                                           \
+        .seqcount = MTHPC_SEQCOUNT_INIT, .lock = SPINLOCK_INIT, \
+    }
+
+#define MTHPC_DEFINE_SEQLOCK(name) mthpc_seqlock_t name = MTHPC_SEQLOCK_INIT
+
+static __always_inline void mthpc_seqlock_init(mthpc_seqlock_t *sl)
+{
+    mthpc_seqcount_init(&sl->seqcount);
+    spin_lock_init(&sl->lock);
+}
+
+static __always_inline unsigned int mthpc_read_seqbegin(mthpc_seqlock_t *sl)
+{
+    return mthpc_read_seqcount_begin(&sl->seqcount);
+}
+
+static __always_inline bool mthpc_read_seqretry(mthpc_seqlock_t *sl,
+                                                unsigned int start)
+{
+    return mthpc_read_seqcount_retry(&sl->seqcount, start);
+}
+
+static __always_inline void mthpc_write_seqlock(mthpc_seqlock_t *sl)
+{
+    spin_lock(&sl->lock);
+    mthpc_write_seqcount_begin(&sl->seqcount);
+}
+
+static __always_inline void mthpc_write_sequnlock(mthpc_seqlock_t *sl)
+{
+    mthpc_write_seqcount_end(&sl->seqcount);
+    spin_unlock(&sl->lock);
+}
+
+#endif /* __MTHPC_SEQLOCK_H__ */
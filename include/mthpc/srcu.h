@@ -0,0 +1,43 @@
+#ifndef __MTHPC_SRCU_H__
+#define __MTHPC_SRCU_H__
+
+#include <stdatomic.h>
+
+#include <mthpc/spinlock.h>
+#include <mthpc/util.h>
+
+/*
+ * Sleepable RCU (SRCU)
+ *
+ * The reader can block in the critical section. Each srcu_struct is the
+ * independent domain, the grace period of it only waits for its own
+ * readers. The readers don't have to register the thread. They count
+ * themselves in the per-CPU counters of the index returned by read_lock,
+ * and the updater flips the index and waits for the counters of the old
+ * one to be balanced.
+ */
+
+struct mthpc_srcu_cpu {
+    atomic_ulong lock_count[2];
+    atomic_ulong unlock_count[2];
+} __mthpc_aligned__;
+
+struct mthpc_srcu_struct {
+    struct mthpc_srcu_cpu *cpu;
+    unsigned int nr_cpu;
+    /* The lowest bit is the index for the new readers. */
+    atomic_ulong idx;
+    /* Grace-period sharing, same as mthpc_rcu_data::gp_seq_nr. */
+    atomic_ulong gp_seq_nr;
+    spinlock_t lock;
+};
+
+void mthpc_srcu_init(struct mthpc_srcu_struct *sp);
+void mthpc_srcu_cleanup(struct mthpc_srcu_struct *sp);
+
+int mthpc_srcu_read_lock(struct mthpc_srcu_struct *sp);
+void mthpc_srcu_read_unlock(struct mthpc_srcu_struct *sp, int idx);
+
+void mthpc_synchronize_srcu(struct mthpc_srcu_struct *sp);
+
+#endif /* __MTHPC_SRCU_H__ */
@@ -27,6 +27,11 @@
     })
 #endif
 
+/* Never faults, so it's fine to prefetch the pointer may be freed. */
+#ifndef mthpc_prefetch
+#define mthpc_prefetch(x) __builtin_prefetch(x)
+#endif
+
 #ifndef __always_inline
 #define __always_inline inline __attribute__((__always_inline__))
 #endif
@@ -1,6 +1,8 @@
 #ifndef __MTHPC_WORKQUEUE_H__
 #define __MTHPC_WORKQUEUE_H__
 
+#include <stdbool.h>
+
 #include <mthpc/list.h>
 
 struct mthpc_workqueue;
@@ -10,7 +12,10 @@ struct mthpc_work {
     void (*func)(struct mthpc_work *);
     void *private;
     unsigned long long padding;
-    struct mthpc_list_head node;
+    /* The intrusive link of the workqueue, see mthpc_wq_push(). */
+    struct mthpc_work *next;
+    /* Set when it's queued, the pinned work isn't stolen by other workers. */
+    bool pinned;
     struct mthpc_workqueue *wq;
 };
 
@@ -34,6 +39,49 @@ struct mthpc_work {
 
 int mthpc_queue_work(struct mthpc_work *work);
 int mthpc_schedule_work_on(int cpu, struct mthpc_work *work);
+int mthpc_queue_work_batch(struct mthpc_work **works, int n);
+int mthpc_schedule_work_batch_on(int cpu, struct mthpc_work **works, int n);
 void mthpc_dump_work(struct mthpc_work *work);
 
+/*
+ * Delayed work, the work is queued after the delay by the timer wheel of the
+ * workpool. See mthpc_wq_timer in workqueue.c.
+ */
+struct mthpc_delayed_work {
+    struct mthpc_work work;
+    /* The slot of the timer wheel, unhashed if it's not pending. */
+    struct mthpc_hlist_node node;
+    unsigned int idx;
+};
+
+#define MTHPC_INIT_DELAYED_WORK(dwork, _name, _func, _private)   \
+    do {                                                         \
+        MTHPC_INIT_WORK(&(dwork)->work, _name, _func, _private); \
+        mthpc_hlist_node_init(&(dwork)->node);                   \
+        (dwork)->idx = 0;                                        \
+    } while (0)
+
+#define MTHPC_DECLARE_DELAYED_WORK(_name, _func, _private) \
+    struct mthpc_delayed_work _name = {                    \
+        .work = {                                          \
+            .name = #_name,                                \
+            .func = _func,                                 \
+            .private = _private,                           \
+            .padding = 0,                                  \
+            .wq = NULL,                                    \
+        },                                                 \
+        .node = { .next = NULL, .pprev = NULL },           \
+        .idx = 0,                                          \
+    }
+
+static inline struct mthpc_delayed_work *
+mthpc_to_delayed_work(struct mthpc_work *work)
+{
+    return container_of(work, struct mthpc_delayed_work, work);
+}
+
+int mthpc_queue_delayed_work(struct mthpc_delayed_work *dwork,
+                             unsigned long delay_ns);
+bool mthpc_cancel_delayed_work(struct mthpc_delayed_work *dwork);
+
 #endif /* __MTHPC_WORKQUEUE_H__ */
@@ -12,10 +12,20 @@ int futex(int32_t *uaddr, int op, int32_t val,
                         const struct timespec *timeout, int32_t *uaddr2,
                         int32_t val3)
 {
+    struct timespec abstime;
     int lret;
     int ret = 0;
 
-    MTHPC_BUG_ON(timeout, "futex timeout");
+    /* The timeout of FUTEX_WAIT is relative. */
+    if (timeout) {
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout->tv_sec;
+        abstime.tv_nsec += timeout->tv_nsec;
+        if (abstime.tv_nsec >= 1000000000L) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000L;
+        }
+    }
     MTHPC_BUG_ON(uaddr2, "futex uaddr2");
     MTHPC_BUG_ON(val3, "futex val3");
 
@@ -25,8 +35,17 @@ int futex(int32_t *uaddr, int op, int32_t val,
 
     switch (op) {
     case FUTEX_WAIT:
-        while (READ_ONCE(*uaddr) == val)
-            pthread_cond_wait(&mthpc_futex_cond, &mthpc_futex_mutex);
+        while (READ_ONCE(*uaddr) == val) {
+            if (!timeout) {
+                pthread_cond_wait(&mthpc_futex_cond, &mthpc_futex_mutex);
+            } else if (pthread_cond_timedwait(&mthpc_futex_cond,
+                                              &mthpc_futex_mutex,
+                                              &abstime) == ETIMEDOUT) {
+                errno = ETIMEDOUT;
+                ret = -1;
+                break;
+            }
+        }
         break;
     case FUTEX_WAKE:
         pthread_cond_broadcast(&mthpc_futex_cond);
@@ -1,128 +1,2146 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#if defined(__x86_64__) && !defined(CONFIG_DEBUG) && \
+    !defined(__SANITIZE_THREAD__)
+#include <immintrin.h>
+#define MTHPC_RCU_SCAN_AVX2
+#endif
 
 #include <mthpc/rcu.h>
 #include <mthpc/spinlock.h>
 #include <mthpc/debug.h>
 #include <mthpc/util.h>
+#include <mthpc/futex.h>
+#include <mthpc/list.h>
+
+#include <internal/rcu.h>
+
+#include <internal/feature.h>
+#undef _MTHPC_FEATURE
+#define _MTHPC_FEATURE rcu
+
+/* User (global) rcu data */
+
+__thread struct mthpc_rcu_node *mthpc_rcu_node_ptr = NULL;
+static struct mthpc_rcu_data mthpc_rcu_data;
+
+/* QSBR rcu data */
+
+__thread struct mthpc_rcu_node *mthpc_rcu_qsbr_node_ptr = NULL;
+static struct mthpc_rcu_data mthpc_rcu_qsbr_data;
+
+/*
+ * Maintain all of the rcu data.
+ * But let the other feature control (write) their own
+ * constructor and destructor of rcu_data in rcu_init/rcu_exit
+ */
+struct mthpc_rcu_meta {
+    struct mthpc_rcu_data *head;
+    spinlock_t lock;
+    /* The id of the last rcu data, never reused. */
+    unsigned long last_id;
+    /* Unregister the thread from the domains when it exits. */
+    pthread_key_t domain_key;
+};
+static struct mthpc_rcu_meta mthpc_rcu_meta;
+
+/* Memory barrier */
+
+int mthpc_rcu_has_sys_membarrier = 0;
+
+static __always_inline int membarrier(int cmd, unsigned int flags, int cpu_id)
+{
+    return syscall(__NR_membarrier, cmd, flags, cpu_id);
+}
+
+/* It forces all the running threads of this process to execute the barrier. */
+static __always_inline void mthpc_rcu_sys_membarrier(void)
+{
+    if (likely(mthpc_rcu_has_sys_membarrier)) {
+        if (membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0))
+            MTHPC_BUG_ON(1, "membarrier failed");
+    } else
+        smp_mb();
+}
+
+#ifdef CONFIG_MTHPC_RCU_SIGNAL
+
+/*
+ * Signal flavor
+ *
+ * Same as urcu-signal, it doesn't need the kernel support of membarrier.
+ * The thread registered to the user rcu data (or domain) joins the reader
+ * list. The updater sends the signal to each of them and waits for the
+ * handler to execute the memory barrier. The reader shouldn't block
+ * MTHPC_RCU_SIGNAL, otherwise the grace period never ends.
+ */
+
+#ifndef MTHPC_RCU_SIGNAL
+#define MTHPC_RCU_SIGNAL SIGUSR1
+#endif
+
+struct mthpc_rcu_signal_reader {
+    pthread_t thread;
+    /* Set by the updater, cleared by the signal handler. */
+    atomic_int need_mb;
+    bool registered;
+    struct mthpc_list_head node;
+};
+
+struct mthpc_rcu_signal {
+    /* Serialize the updaters. */
+    spinlock_t gp_lock;
+    /* Protect the reader list. */
+    spinlock_t lock;
+    struct mthpc_list_head readers;
+    unsigned int nr_reader;
+    /*
+     * The updater copies the reader list here, then sends the signals and
+     * waits without holding the lock. Only used under gp_lock.
+     */
+    struct mthpc_rcu_signal_reader **snap;
+    unsigned int snap_cap;
+    /* The readers haven't acked yet. The updater sleeps on it. */
+    int32_t pending;
+    /* Set while the updater sends the signals, see the unregister. */
+    int32_t sending;
+    /* Unregister the thread from the reader list when it exits. */
+    pthread_key_t key;
+};
+static struct mthpc_rcu_signal mthpc_rcu_signal = {
+    .gp_lock = SPINLOCK_INIT,
+    .lock = SPINLOCK_INIT,
+};
+
+static __thread struct mthpc_rcu_signal_reader mthpc_rcu_signal_self;
+
+/* The last reader to ack wakes up the updater. */
+static __always_inline void mthpc_rcu_signal_ack(void)
+{
+    if (atomic_fetch_sub_explicit(
+            (volatile _Atomic int32_t *)&mthpc_rcu_signal.pending, 1,
+            memory_order_acq_rel) == 1)
+        futex(&mthpc_rcu_signal.pending, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* futex is async-signal-safe. */
+static void mthpc_rcu_signal_handler(int signo, siginfo_t *info, void *context)
+{
+    int saved_errno = errno;
+
+    smp_mb();
+    if (atomic_exchange_explicit(&mthpc_rcu_signal_self.need_mb, 0,
+                                 memory_order_acq_rel))
+        mthpc_rcu_signal_ack();
+    errno = saved_errno;
+}
+
+static void mthpc_rcu_signal_unregister(void *arg)
+{
+    struct mthpc_rcu_signal_reader *reader = arg;
+    int32_t sending;
+
+    spin_lock(&mthpc_rcu_signal.lock);
+    mthpc_list_del(&reader->node);
+    mthpc_rcu_signal.nr_reader--;
+    spin_unlock(&mthpc_rcu_signal.lock);
+
+    /* We won't read anymore, ack for ourselves if the updater is waiting. */
+    smp_mb();
+    if (atomic_exchange_explicit(&reader->need_mb, 0, memory_order_acq_rel))
+        mthpc_rcu_signal_ack();
+    /* The updater might still send the signal to us, don't exit before it. */
+    while ((sending = atomic_load_explicit(
+                (volatile _Atomic int32_t *)&mthpc_rcu_signal.sending,
+                memory_order_acquire)))
+        futex(&mthpc_rcu_signal.sending, FUTEX_WAIT, sending, NULL, NULL, 0);
+    reader->registered = false;
+}
+
+/* Called by the thread itself, don't hold the data lock. */
+static void mthpc_rcu_signal_register(void)
+{
+    struct mthpc_rcu_signal_reader *reader = &mthpc_rcu_signal_self;
+
+    if (reader->registered)
+        return;
+    reader->thread = pthread_self();
+    atomic_init(&reader->need_mb, 0);
+    reader->registered = true;
+    spin_lock(&mthpc_rcu_signal.lock);
+    mthpc_list_add_tail(&reader->node, &mthpc_rcu_signal.readers);
+    mthpc_rcu_signal.nr_reader++;
+    spin_unlock(&mthpc_rcu_signal.lock);
+    MTHPC_WARN_ON(pthread_setspecific(mthpc_rcu_signal.key, reader),
+                  "set rcu signal key failed");
+}
+
+/*
+ * Snapshot the readers under the lock, then signal them and sleep until
+ * they all ack. So the thread registering or exiting only waits for the
+ * signals to be sent, not for the round trip.
+ */
+static void mthpc_rcu_signal_force_mb(void)
+{
+    struct mthpc_rcu_signal *sig = &mthpc_rcu_signal;
+    volatile _Atomic int32_t *pending =
+        (volatile _Atomic int32_t *)&sig->pending;
+    volatile _Atomic int32_t *sending =
+        (volatile _Atomic int32_t *)&sig->sending;
+    struct mthpc_rcu_signal_reader *reader;
+    unsigned int nr = 0;
+    int32_t left;
+
+    smp_mb();
+    spin_lock(&sig->gp_lock);
+    spin_lock(&sig->lock);
+    if (sig->nr_reader > sig->snap_cap) {
+        sig->snap_cap = sig->nr_reader * 2;
+        sig->snap = realloc(sig->snap, sizeof(*sig->snap) * sig->snap_cap);
+        MTHPC_BUG_ON(!sig->snap, "allocation failed");
+    }
+    mthpc_list_for_each_entry (reader, &sig->readers, node) {
+        if (reader != &mthpc_rcu_signal_self) {
+            atomic_store_explicit(&reader->need_mb, 1, memory_order_relaxed);
+            sig->snap[nr++] = reader;
+        }
+    }
+    if (nr) {
+        atomic_store_explicit(pending, nr, memory_order_relaxed);
+        atomic_store_explicit(sending, 1, memory_order_relaxed);
+    }
+    spin_unlock(&sig->lock);
+    if (!nr)
+        goto unlock;
+
+    smp_mb();
+    for (unsigned int i = 0; i < nr; i++)
+        MTHPC_BUG_ON(pthread_kill(sig->snap[i]->thread, MTHPC_RCU_SIGNAL),
+                     "send rcu signal failed");
+    atomic_store_explicit(sending, 0, memory_order_release);
+    futex(&sig->sending, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+
+    /* Sleep instead of spinning, let the readers run the handler. */
+    while ((left = atomic_load_explicit(pending, memory_order_acquire)))
+        futex(&sig->pending, FUTEX_WAIT, left, NULL, NULL, 0);
+unlock:
+    spin_unlock(&sig->gp_lock);
+    smp_mb();
+}
+
+static void mthpc_rcu_signal_init(void)
+{
+    struct sigaction act = { 0 };
+
+    mthpc_list_init(&mthpc_rcu_signal.readers);
+    MTHPC_BUG_ON(pthread_key_create(&mthpc_rcu_signal.key,
+                                    mthpc_rcu_signal_unregister),
+                 "create rcu signal key failed");
+    act.sa_sigaction = mthpc_rcu_signal_handler;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    MTHPC_BUG_ON(sigaction(MTHPC_RCU_SIGNAL, &act, NULL),
+                 "install rcu signal handler failed");
+}
+
+#else /* !CONFIG_MTHPC_RCU_SIGNAL */
+
+static __always_inline void mthpc_rcu_signal_register(void)
+{
+}
+
+static __always_inline void mthpc_rcu_signal_init(void)
+{
+}
+
+#endif /* CONFIG_MTHPC_RCU_SIGNAL */
+
+/*
+ * Pair with the compiler barrier on read side, see
+ * mthpc_rcu_reader_cmb_only().
+ */
+static __always_inline void mthpc_rcu_smp_mb_master(void)
+{
+#ifdef CONFIG_MTHPC_RCU_SIGNAL
+    mthpc_rcu_signal_force_mb();
+#else
+    mthpc_rcu_sys_membarrier();
+#endif
+}
+
+/*
+ * For the other flavors, see include/internal/rcu.h. Their readers don't
+ * join the signal reader list, so always use membarrier here.
+ */
+void mthpc_rcu_smp_mb_master_internal(void)
+{
+    mthpc_rcu_sys_membarrier();
+}
+
+static void mthpc_rcu_membarrier_init(void)
+{
+#if !defined(CONFIG_MTHPC_RCU_MB) && !defined(CONFIG_MTHPC_RCU_SIGNAL)
+    int mask;
+
+    mask = membarrier(MEMBARRIER_CMD_QUERY, 0, 0);
+    if (mask < 0 || !(mask & MEMBARRIER_CMD_PRIVATE_EXPEDITED))
+        return;
+    if (membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0))
+        return;
+    mthpc_rcu_has_sys_membarrier = 1;
+#endif
+}
+
+/* Registry */
+
+static __always_inline unsigned int mthpc_rcu_slot_chunk(unsigned int slot)
+{
+    return (31 - __builtin_clz(slot + MTHPC_RCU_SLOT_BASE)) -
+           MTHPC_RCU_SLOT_BASE_SHIFT;
+}
+
+static __always_inline unsigned int mthpc_rcu_chunk_start(unsigned int chunk)
+{
+    return (MTHPC_RCU_SLOT_BASE << chunk) - MTHPC_RCU_SLOT_BASE;
+}
+
+static __always_inline struct mthpc_rcu_node *
+mthpc_rcu_slot_node(struct mthpc_rcu_data *data, unsigned int slot)
+{
+    unsigned int chunk = mthpc_rcu_slot_chunk(slot);
+
+    return &data->chunk[chunk][slot - mthpc_rcu_chunk_start(chunk)];
+}
+
+/* The number of used slots in the chunk. */
+static __always_inline unsigned int
+mthpc_rcu_chunk_nr(struct mthpc_rcu_data *data, unsigned int chunk)
+{
+    unsigned int start = mthpc_rcu_chunk_start(chunk);
+    unsigned int size = MTHPC_RCU_SLOT_BASE << chunk;
+
+    if (chunk >= MTHPC_RCU_NR_CHUNK || data->nr_slot <= start)
+        return 0;
+    return (data->nr_slot - start < size) ? data->nr_slot - start : size;
+}
+
+/* Should be called with holding data->slot_lock. */
+#define mthpc_rcu_for_each_chunk(data, chunk, nr)                     \
+    for (chunk = 0; (nr = mthpc_rcu_chunk_nr(data, chunk)) != 0; \
+         chunk++)
+
+/* Grace period */
+
+static __always_inline bool mthpc_rcu_node_blocking(unsigned long node_gp,
+                                                    unsigned long gp_seq,
+                                                    bool qsbr)
+{
+    /* QSBR: The node is online and it hasn't reported the gp_seq. */
+    if (qsbr)
+        return node_gp && node_gp != gp_seq;
+    /* The node is active and it's in the current gp_seq. */
+    return (node_gp & MTHPC_GP_CTR_NEST_MASK) &&
+           !((node_gp ^ gp_seq) & MTHPC_GP_CTR_PHASE);
+}
+
+#define MTHPC_RCU_SCAN_WINDOW 64
+
+/*
+ * The smp_mb() after the scan orders the reader state, but TSan doesn't
+ * understand the fence. Acquire it in the debug build so TSan can see the
+ * reader has left before the updater frees the data.
+ */
+#if defined(CONFIG_DEBUG) || defined(__SANITIZE_THREAD__)
+#define MTHPC_RCU_SCAN_ORDER memory_order_acquire
+#else
+#define MTHPC_RCU_SCAN_ORDER memory_order_relaxed
+#endif
+
+/*
+ * Scan at most MTHPC_RCU_SCAN_WINDOW nodes without branching on each of them
+ * and return the mask of the blocking nodes. The nodes are cache aligned to
+ * avoid the false sharing on read side, so we gather them.
+ */
+static uint64_t mthpc_rcu_scan_window(struct mthpc_rcu_node *base,
+                                      unsigned int nr, unsigned long gp_seq,
+                                      bool qsbr)
+{
+    uint64_t pending = 0;
+    unsigned long node_gp;
+
+    for (unsigned int i = 0; i < nr; i++) {
+        node_gp = atomic_load_explicit(&base[i].gp_seq, MTHPC_RCU_SCAN_ORDER);
+        pending |= (uint64_t)mthpc_rcu_node_blocking(node_gp, gp_seq, qsbr)
+                   << i;
+    }
+
+    return pending;
+}
+
+#ifdef MTHPC_RCU_SCAN_AVX2
+static bool mthpc_rcu_has_avx2;
+
+__attribute__((target("avx2"))) static uint64_t
+mthpc_rcu_scan_window_avx2(struct mthpc_rcu_node *base, unsigned int nr,
+                           unsigned long gp_seq, bool qsbr)
+{
+    const long long stride = sizeof(struct mthpc_rcu_node);
+    const __m256i vindex =
+        _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+    const __m256i nest_mask = _mm256_set1_epi64x(MTHPC_GP_CTR_NEST_MASK);
+    const __m256i phase_mask = _mm256_set1_epi64x(MTHPC_GP_CTR_PHASE);
+    const __m256i gp = _mm256_set1_epi64x(gp_seq);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t pending = 0;
+    unsigned int i;
+
+    for (i = 0; i + 4 <= nr; i += 4) {
+        __m256i node_gp = _mm256_i64gather_epi64(
+            (const long long *)&base[i].gp_seq, vindex, 1);
+        __m256i idle, blocking;
+
+        if (qsbr) {
+            idle = _mm256_or_si256(_mm256_cmpeq_epi64(node_gp, zero),
+                                   _mm256_cmpeq_epi64(node_gp, gp));
+            blocking = _mm256_andnot_si256(idle, _mm256_cmpeq_epi64(gp, gp));
+        } else {
+            idle = _mm256_cmpeq_epi64(_mm256_and_si256(node_gp, nest_mask),
+                                      zero);
+            blocking = _mm256_andnot_si256(
+                idle, _mm256_cmpeq_epi64(
+                          _mm256_and_si256(_mm256_xor_si256(node_gp, gp),
+                                           phase_mask),
+                          zero));
+        }
+
+        pending |=
+            (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(blocking)) << i;
+    }
+    if (i < nr)
+        pending |= mthpc_rcu_scan_window(&base[i], nr - i, gp_seq, qsbr)
+                   << i;
+
+    return pending;
+}
+#endif /* MTHPC_RCU_SCAN_AVX2 */
+
+static __always_inline uint64_t mthpc_rcu_scan(struct mthpc_rcu_node *base,
+                                               unsigned int nr,
+                                               unsigned long gp_seq, bool qsbr)
+{
+#ifdef MTHPC_RCU_SCAN_AVX2
+    if (mthpc_rcu_has_avx2)
+        return mthpc_rcu_scan_window_avx2(base, nr, gp_seq, qsbr);
+#endif
+    return mthpc_rcu_scan_window(base, nr, gp_seq, qsbr);
+}
+
+/*
+ * Statistics
+ *
+ * Built with rcu_stats=1 (CONFIG_MTHPC_RCU_STATS). The updater records the
+ * duration of the grace period and how long it waited for each blocking
+ * reader. The waits are accumulated in mthpc_rcu_stats_wait and merged into
+ * the rcu data once the readers are gone. While sleeping on the readers, the
+ * updater wakes up every stall threshold (MTHPC_RCU_STALL_MS) to report the
+ * readers blocking the grace period.
+ */
+struct mthpc_rcu_stats_wait {
+    unsigned long start;
+    unsigned long now;
+    unsigned long last_warn;
+    unsigned long nr_blocked;
+    unsigned long wait_total;
+    unsigned long wait_max;
+    long slowest_tid;
+    bool stalled;
+};
+
+#ifdef CONFIG_MTHPC_RCU_STATS
+
+#ifndef MTHPC_RCU_STALL_MS
+#define MTHPC_RCU_STALL_MS 1000
+#endif
+
+struct mthpc_rcu_stats_data {
+    spinlock_t lock;
+    struct mthpc_rcu_stats stats;
+};
+
+static const struct timespec mthpc_rcu_stall_timeout = {
+    .tv_sec = MTHPC_RCU_STALL_MS / 1000,
+    .tv_nsec = (MTHPC_RCU_STALL_MS % 1000) * 1000000L,
+};
+
+static __always_inline unsigned long mthpc_rcu_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void mthpc_rcu_stats_init(struct mthpc_rcu_data *data)
+{
+    data->stats = malloc(sizeof(struct mthpc_rcu_stats_data));
+    if (MTHPC_WARN_ON(!data->stats, "allocation failed"))
+        return;
+    spin_lock_init(&data->stats->lock);
+    memset(&data->stats->stats, 0, sizeof(struct mthpc_rcu_stats));
+}
+
+static void mthpc_rcu_stats_exit(struct mthpc_rcu_data *data)
+{
+    if (!data->stats)
+        return;
+    spin_lock_destroy(&data->stats->lock);
+    free(data->stats);
+    data->stats = NULL;
+}
+
+static __always_inline void
+mthpc_rcu_stats_node_init(struct mthpc_rcu_node *node)
+{
+    node->tid = syscall(SYS_gettid);
+}
+
+static void mthpc_rcu_stats_gp(struct mthpc_rcu_data *data,
+                               unsigned long start)
+{
+    struct mthpc_rcu_stats *stats;
+    unsigned long delta, us;
+    unsigned int hist = 0;
+
+    if (!data->stats)
+        return;
+    stats = &data->stats->stats;
+
+    delta = mthpc_rcu_stats_now() - start;
+    for (us = delta / 1000; us && hist < MTHPC_RCU_STATS_NR_HIST - 1; us >>= 1)
+        hist++;
+
+    spin_lock(&data->stats->lock);
+    stats->nr_gp++;
+    stats->gp_total_ns += delta;
+    if (delta > stats->gp_max_ns)
+        stats->gp_max_ns = delta;
+    stats->gp_hist[hist]++;
+    spin_unlock(&data->stats->lock);
+}
+
+static __always_inline void
+mthpc_rcu_stats_wait_start(struct mthpc_rcu_stats_wait *ws)
+{
+    memset(ws, 0, sizeof(struct mthpc_rcu_stats_wait));
+    ws->start = mthpc_rcu_stats_now();
+    ws->last_warn = ws->start;
+}
+
+/* The reader has left, the clock is read once per recheck. */
+static __always_inline void
+mthpc_rcu_stats_reader_left(struct mthpc_rcu_stats_wait *ws,
+                            struct mthpc_rcu_node *node)
+{
+    unsigned long wait;
+
+    if (!ws->now)
+        ws->now = mthpc_rcu_stats_now();
+    wait = ws->now - ws->start;
+    ws->nr_blocked++;
+    ws->wait_total += wait;
+    if (wait > ws->wait_max) {
+        ws->wait_max = wait;
+        ws->slowest_tid = node->tid;
+    }
+}
+
+static __always_inline void
+mthpc_rcu_stats_recheck_done(struct mthpc_rcu_stats_wait *ws)
+{
+    ws->now = 0;
+}
+
+static void mthpc_rcu_stats_wait_end(struct mthpc_rcu_data *data,
+                                     struct mthpc_rcu_stats_wait *ws,
+                                     unsigned int nr_scanned)
+{
+    struct mthpc_rcu_stats *stats;
+
+    if (!data->stats)
+        return;
+    stats = &data->stats->stats;
+
+    spin_lock(&data->stats->lock);
+    stats->nr_scanned += nr_scanned;
+    stats->nr_blocked += ws->nr_blocked;
+    stats->wait_total_ns += ws->wait_total;
+    if (ws->wait_max > stats->wait_max_ns) {
+        stats->wait_max_ns = ws->wait_max;
+        stats->slowest_tid = ws->slowest_tid;
+    }
+    stats->nr_stall += ws->stalled;
+    spin_unlock(&data->stats->lock);
+}
+
+static void mthpc_rcu_stats_stall(struct mthpc_rcu_stats_wait *ws,
+                                  struct mthpc_rcu_node **blocked,
+                                  unsigned int nr)
+{
+    unsigned long now = mthpc_rcu_stats_now();
+
+    if (now - ws->last_warn < MTHPC_RCU_STALL_MS * 1000000UL)
+        return;
+    ws->last_warn = now;
+    ws->stalled = true;
+    mthpc_pr_err("rcu stall: waited %lu ms for %u reader(s), tid %ld\n",
+                 (now - ws->start) / 1000000, nr,
+                 blocked ? blocked[0]->tid : -1L);
+}
+
+int mthpc_rcu_stats_snapshot(struct mthpc_rcu_data *domain,
+                             struct mthpc_rcu_stats *stats)
+{
+    struct mthpc_rcu_data *data = domain ? domain : &mthpc_rcu_data;
+
+    if (!data->stats)
+        return -1;
+    spin_lock(&data->stats->lock);
+    *stats = data->stats->stats;
+    spin_unlock(&data->stats->lock);
+
+    return 0;
+}
+
+#define mthpc_rcu_stats_timeout() (&mthpc_rcu_stall_timeout)
+
+#else /* !CONFIG_MTHPC_RCU_STATS */
+
+static __always_inline unsigned long mthpc_rcu_stats_now(void)
+{
+    return 0;
+}
+
+static __always_inline void mthpc_rcu_stats_init(struct mthpc_rcu_data *data)
+{
+    data->stats = NULL;
+}
+
+static __always_inline void mthpc_rcu_stats_exit(struct mthpc_rcu_data *data)
+{
+}
+
+static __always_inline void
+mthpc_rcu_stats_node_init(struct mthpc_rcu_node *node)
+{
+}
+
+static __always_inline void mthpc_rcu_stats_gp(struct mthpc_rcu_data *data,
+                                               unsigned long start)
+{
+}
+
+static __always_inline void
+mthpc_rcu_stats_wait_start(struct mthpc_rcu_stats_wait *ws)
+{
+}
+
+static __always_inline void
+mthpc_rcu_stats_reader_left(struct mthpc_rcu_stats_wait *ws,
+                            struct mthpc_rcu_node *node)
+{
+}
+
+static __always_inline void
+mthpc_rcu_stats_recheck_done(struct mthpc_rcu_stats_wait *ws)
+{
+}
+
+static __always_inline void
+mthpc_rcu_stats_wait_end(struct mthpc_rcu_data *data,
+                         struct mthpc_rcu_stats_wait *ws,
+                         unsigned int nr_scanned)
+{
+}
+
+static __always_inline void
+mthpc_rcu_stats_stall(struct mthpc_rcu_stats_wait *ws,
+                      struct mthpc_rcu_node **blocked, unsigned int nr)
+{
+}
+
+int mthpc_rcu_stats_snapshot(struct mthpc_rcu_data *domain,
+                             struct mthpc_rcu_stats *stats)
+{
+    return -1;
+}
+
+#define mthpc_rcu_stats_timeout() ((const struct timespec *)NULL)
+
+#endif /* CONFIG_MTHPC_RCU_STATS */
+
+/*
+ * Collect the blocking nodes to @blocked. If @blocked is NULL, only count
+ * them. Should be called with holding data->slot_lock.
+ */
+static unsigned int mthpc_rcu_collect_blocking(struct mthpc_rcu_data *data,
+                                               unsigned long gp_seq,
+                                               struct mthpc_rcu_node **blocked)
+{
+    struct mthpc_rcu_node *base;
+    unsigned int chunk, nr, n, i, cnt = 0;
+    bool qsbr = data->type & MTHPC_RCU_QSBR;
+    uint64_t pending;
+
+    mthpc_rcu_for_each_chunk (data, chunk, nr) {
+        for (i = 0; i < nr; i += MTHPC_RCU_SCAN_WINDOW) {
+            base = &data->chunk[chunk][i];
+            n = (nr - i < MTHPC_RCU_SCAN_WINDOW) ? nr - i :
+                                                   MTHPC_RCU_SCAN_WINDOW;
+            pending = mthpc_rcu_scan(base, n, gp_seq, qsbr);
+            if (!blocked) {
+                cnt += __builtin_popcountll(pending);
+                continue;
+            }
+            while (pending) {
+                blocked[cnt++] = &base[__builtin_ctzll(pending)];
+                pending &= pending - 1;
+            }
+        }
+    }
+
+    return cnt;
+}
+
+/*
+ * Drop the nodes which have left the critical section. Should be called with
+ * holding the lock of @blocked, the scratch might move with the registry.
+ */
+static unsigned int mthpc_rcu_recheck_blocking(struct mthpc_rcu_data *data,
+                                               unsigned long gp_seq,
+                                               struct mthpc_rcu_node **blocked,
+                                               unsigned int nr,
+                                               struct mthpc_rcu_stats_wait *ws)
+{
+    unsigned int i, cnt = 0;
+    bool qsbr = data->type & MTHPC_RCU_QSBR;
+
+    for (i = 0; i < nr; i++) {
+        if (mthpc_rcu_node_blocking(atomic_load_explicit(&blocked[i]->gp_seq,
+                                                         memory_order_consume),
+                                    gp_seq, qsbr))
+            blocked[cnt++] = blocked[i];
+        else
+            mthpc_rcu_stats_reader_left(ws, blocked[i]);
+    }
+    mthpc_rcu_stats_recheck_done(ws);
+    if (cnt)
+        mthpc_rcu_stats_stall(ws, blocked, cnt);
+
+    return cnt;
+}
+
+/*
+ * Sleep until the reader wakes us up. With the rcu stats, wake up every
+ * stall threshold, the recheck reports the blocking readers.
+ */
+static __always_inline void mthpc_rcu_wait_sleep(int32_t *uaddr)
+{
+    if (READ_ONCE(*uaddr) == -1)
+        futex(uaddr, FUTEX_WAIT, -1, mthpc_rcu_stats_timeout(), NULL, 0);
+}
+
+#define MTHPC_RCU_WAIT_SPIN 1000
+
+static __always_inline unsigned int
+mthpc_wait_recheck(struct mthpc_rcu_data *data, unsigned long gp_seq,
+                   unsigned int nr, struct mthpc_rcu_stats_wait *ws)
+{
+    spin_lock(&data->slot_lock);
+    nr = mthpc_rcu_recheck_blocking(data, gp_seq, data->blocked, nr, ws);
+    spin_unlock(&data->slot_lock);
+
+    return nr;
+}
+
+/*
+ * Spin on the blocking readers for a while. After that, set the futex and
+ * sleep until the reader leaves the critical section.
+ *
+ * We only hold data->slot_lock while we go through the readers, so the
+ * threads can register and unregister while we are waiting. The thread
+ * registered after the scan starts its critical section after the grace
+ * period, we don't have to wait for it. The unregistered node is idle, and
+ * if it's reused meanwhile, the new owner's reader only holds us a bit
+ * longer. The scratch might move if the registry grows, but the blocking
+ * nodes are kept in it.
+ */
+static void mthpc_wait_for_readers(struct mthpc_rcu_data *data,
+                                   unsigned long gp_seq)
+{
+    struct mthpc_rcu_stats_wait ws;
+    unsigned int nr, nr_slot, attempts = 0;
+
+    mthpc_rcu_stats_wait_start(&ws);
+    spin_lock(&data->slot_lock);
+    nr_slot = data->nr_slot;
+    nr = mthpc_rcu_collect_blocking(data, gp_seq, data->blocked);
+    spin_unlock(&data->slot_lock);
+    while (nr) {
+        if (attempts < MTHPC_RCU_WAIT_SPIN) {
+            attempts++;
+            mthpc_cmb();
+        } else {
+            atomic_store_explicit((volatile _Atomic int32_t *)&data->futex, -1,
+                                  memory_order_seq_cst);
+            /* Write futex before reading the readers. */
+            mthpc_rcu_smp_mb_master();
+            nr = mthpc_wait_recheck(data, gp_seq, nr, &ws);
+            if (!nr) {
+                WRITE_ONCE(data->futex, 0);
+                break;
+            }
+            mthpc_rcu_wait_sleep(&data->futex);
+        }
+        nr = mthpc_wait_recheck(data, gp_seq, nr, &ws);
+    }
+
+    mthpc_rcu_stats_wait_end(data, &ws, nr_slot);
+}
+
+/*
+ * Tree mode
+ *
+ * With many readers, one updater scanning all of the rcu nodes pulls every
+ * reader's cache line to its CPU. In tree mode, the readers of the global
+ * rcu data are grouped into the leaves by the CPU they registered on. Each
+ * leaf has the scanner thread pinned to the CPUs of the leaf, which waits
+ * for the readers of the leaf. The scanners report to the combining tree
+ * and the last one reaching the root wakes the updater up. So the updater
+ * only touches the tree and the readers are scanned by the nearby CPU.
+ */
+#ifdef CONFIG_MTHPC_RCU_TREE
+
+#ifndef MTHPC_RCU_LEAF_CPUS
+#define MTHPC_RCU_LEAF_CPUS 16
+#endif
+#ifndef MTHPC_RCU_TREE_FANOUT
+#define MTHPC_RCU_TREE_FANOUT 4
+#endif
+
+struct mthpc_rcu_leaf {
+    /*
+     * Protects node, blocked, nr and cap. The scanner only holds it while
+     * it goes through the readers, like data->slot_lock.
+     */
+    spinlock_t lock;
+    /* The rcu nodes registered on the CPUs of the leaf. */
+    struct mthpc_rcu_node **node;
+    struct mthpc_rcu_node **blocked;
+    unsigned int nr;
+    unsigned int cap;
+    unsigned int first_cpu;
+    /* Same as mthpc_rcu_data::futex, but for the scanner of the leaf. */
+    int32_t futex;
+    pthread_t tid;
+} __mthpc_aligned__;
+
+struct mthpc_rcu_tree_node {
+    /* The number of the children haven't reported in this round. */
+    atomic_int pending;
+    int nr_child;
+    int parent;
+} __mthpc_aligned__;
+
+struct mthpc_rcu_tree {
+    /* NULL if the tree mode is off. */
+    struct mthpc_rcu_data *data;
+    struct mthpc_rcu_leaf *leaf;
+    unsigned int nr_leaf;
+    /* The leaves first, the root is the last one. */
+    struct mthpc_rcu_tree_node *node;
+    unsigned int nr_node;
+    unsigned long gp_seq;
+    /* The round requested by the updater and the last one finished. */
+    int32_t req;
+    int32_t done;
+    atomic_int stop;
+};
+static struct mthpc_rcu_tree mthpc_rcu_tree;
+
+static __always_inline bool mthpc_rcu_tree_mode(struct mthpc_rcu_data *data)
+{
+    return data == mthpc_rcu_tree.data;
+}
+
+static __always_inline unsigned int
+mthpc_rcu_leaf_recheck(struct mthpc_rcu_leaf *leaf, struct mthpc_rcu_data *data,
+                       unsigned long gp_seq, unsigned int nr,
+                       struct mthpc_rcu_stats_wait *ws)
+{
+    spin_lock(&leaf->lock);
+    nr = mthpc_rcu_recheck_blocking(data, gp_seq, leaf->blocked, nr, ws);
+    spin_unlock(&leaf->lock);
+
+    return nr;
+}
+
+static void mthpc_rcu_leaf_wait(struct mthpc_rcu_leaf *leaf,
+                                struct mthpc_rcu_data *data,
+                                unsigned long gp_seq)
+{
+    struct mthpc_rcu_stats_wait ws;
+    unsigned int i, nr = 0, nr_node, attempts = 0;
+
+    mthpc_rcu_stats_wait_start(&ws);
+    spin_lock(&leaf->lock);
+    nr_node = leaf->nr;
+    for (i = 0; i < leaf->nr; i++) {
+        if (mthpc_rcu_node_blocking(atomic_load_explicit(&leaf->node[i]->gp_seq,
+                                                         memory_order_consume),
+                                    gp_seq, false))
+            leaf->blocked[nr++] = leaf->node[i];
+    }
+    spin_unlock(&leaf->lock);
+
+    while (nr) {
+        if (attempts < MTHPC_RCU_WAIT_SPIN) {
+            attempts++;
+            mthpc_cmb();
+        } else {
+            atomic_store_explicit((volatile _Atomic int32_t *)&leaf->futex, -1,
+                                  memory_order_seq_cst);
+            /* Let the readers take the slow path, see mthpc_rcu_wake_up_gp. */
+            atomic_store_explicit((volatile _Atomic int32_t *)&data->futex, -1,
+                                  memory_order_seq_cst);
+            mthpc_rcu_smp_mb_master();
+            nr = mthpc_rcu_leaf_recheck(leaf, data, gp_seq, nr, &ws);
+            if (!nr) {
+                WRITE_ONCE(leaf->futex, 0);
+                break;
+            }
+            mthpc_rcu_wait_sleep(&leaf->futex);
+        }
+        nr = mthpc_rcu_leaf_recheck(leaf, data, gp_seq, nr, &ws);
+    }
+    mthpc_rcu_stats_wait_end(data, &ws, nr_node);
+}
+
+static void mthpc_rcu_leaf_wake(struct mthpc_rcu_leaf *leaf)
+{
+    if (atomic_load_explicit((volatile _Atomic int32_t *)&leaf->futex,
+                             memory_order_seq_cst) == -1) {
+        WRITE_ONCE(leaf->futex, 0);
+        futex(&leaf->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Propagate the quiescence of the leaf up to the root. */
+static void mthpc_rcu_tree_report(unsigned int idx, int32_t req)
+{
+    struct mthpc_rcu_tree_node *node;
+
+    while (1) {
+        node = &mthpc_rcu_tree.node[idx];
+        if (atomic_fetch_sub_explicit(&node->pending, 1,
+                                      memory_order_acq_rel) != 1)
+            return;
+        if (node->parent < 0)
+            break;
+        idx = node->parent;
+    }
+
+    atomic_store_explicit((volatile _Atomic int32_t *)&mthpc_rcu_tree.done,
+                          req, memory_order_seq_cst);
+    futex(&mthpc_rcu_tree.done, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void *mthpc_rcu_tree_scanner(void *arg)
+{
+    struct mthpc_rcu_leaf *leaf = arg;
+    int32_t seq = 0, req;
+    cpu_set_t set;
+
+    /* Best effort, the leaf still works if we can't run there. */
+    CPU_ZERO(&set);
+    for (unsigned int i = 0; i < MTHPC_RCU_LEAF_CPUS; i++)
+        CPU_SET(leaf->first_cpu + i, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    while (1) {
+        req = atomic_load_explicit(
+            (volatile _Atomic int32_t *)&mthpc_rcu_tree.req,
+            memory_order_seq_cst);
+        if (req == seq) {
+            futex(&mthpc_rcu_tree.req, FUTEX_WAIT, seq, NULL, NULL, 0);
+            continue;
+        }
+        seq = req;
+        if (atomic_load_explicit(&mthpc_rcu_tree.stop, memory_order_acquire))
+            break;
+
+        mthpc_rcu_leaf_wait(leaf, mthpc_rcu_tree.data,
+                            READ_ONCE(mthpc_rcu_tree.gp_seq));
+        mthpc_rcu_tree_report(leaf - mthpc_rcu_tree.leaf, seq);
+    }
+
+    return NULL;
+}
+
+/* Should be called with holding data->lock. */
+static void mthpc_rcu_tree_wait(struct mthpc_rcu_data *data,
+                                unsigned long gp_seq)
+{
+    struct mthpc_rcu_tree_node *node;
+    unsigned int attempts = 0;
+    int32_t req, done;
+
+    for (unsigned int i = 0; i < mthpc_rcu_tree.nr_node; i++) {
+        node = &mthpc_rcu_tree.node[i];
+        atomic_store_explicit(&node->pending,
+                              node->nr_child ? node->nr_child : 1,
+                              memory_order_relaxed);
+    }
+    WRITE_ONCE(mthpc_rcu_tree.gp_seq, gp_seq);
+
+    /* Start the round, one syscall wakes up all the scanners. */
+    req = mthpc_rcu_tree.req + 1;
+    atomic_store_explicit((volatile _Atomic int32_t *)&mthpc_rcu_tree.req, req,
+                          memory_order_seq_cst);
+    futex(&mthpc_rcu_tree.req, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    while ((done = atomic_load_explicit(
+                (volatile _Atomic int32_t *)&mthpc_rcu_tree.done,
+                memory_order_acquire)) != req) {
+        if (attempts < MTHPC_RCU_WAIT_SPIN) {
+            attempts++;
+            mthpc_cmb();
+            continue;
+        }
+        futex(&mthpc_rcu_tree.done, FUTEX_WAIT, done, NULL, NULL, 0);
+    }
+
+    /* All the scanners are done, the readers can take the fast path. */
+    WRITE_ONCE(data->futex, 0);
+}
+
+/* Should be called with holding data->slot_lock. */
+static int mthpc_rcu_tree_add(struct mthpc_rcu_node *node)
+{
+    struct mthpc_rcu_leaf *leaf;
+    struct mthpc_rcu_node **tmp;
+    unsigned int idx, cap;
+    int cpu;
+
+    cpu = sched_getcpu();
+    idx = (cpu < 0) ? 0 : (unsigned int)cpu / MTHPC_RCU_LEAF_CPUS;
+    if (idx >= mthpc_rcu_tree.nr_leaf)
+        idx = mthpc_rcu_tree.nr_leaf - 1;
+    leaf = &mthpc_rcu_tree.leaf[idx];
+
+    spin_lock(&leaf->lock);
+    if (leaf->nr == leaf->cap) {
+        cap = leaf->cap ? leaf->cap << 1 : MTHPC_RCU_SLOT_BASE;
+        tmp = realloc(leaf->node, sizeof(struct mthpc_rcu_node *) * cap);
+        if (!tmp)
+            goto fail;
+        leaf->node = tmp;
+        tmp = realloc(leaf->blocked, sizeof(struct mthpc_rcu_node *) * cap);
+        if (!tmp)
+            goto fail;
+        leaf->blocked = tmp;
+        leaf->cap = cap;
+    }
+
+    node->leaf = idx;
+    node->leaf_pos = leaf->nr;
+    leaf->node[leaf->nr++] = node;
+    spin_unlock(&leaf->lock);
+
+    return 0;
+
+fail:
+    spin_unlock(&leaf->lock);
+    return -1;
+}
+
+/* Should be called with holding data->slot_lock. */
+static void mthpc_rcu_tree_del(struct mthpc_rcu_node *node)
+{
+    struct mthpc_rcu_leaf *leaf = &mthpc_rcu_tree.leaf[node->leaf];
+    struct mthpc_rcu_node *last;
+
+    spin_lock(&leaf->lock);
+    last = leaf->node[--leaf->nr];
+    leaf->node[node->leaf_pos] = last;
+    last->leaf_pos = node->leaf_pos;
+    spin_unlock(&leaf->lock);
+}
+
+static void mthpc_rcu_tree_init(struct mthpc_rcu_data *data)
+{
+    struct mthpc_rcu_tree *tree = &mthpc_rcu_tree;
+    unsigned int nr_cpu, start, cnt, next, i;
+    long ret;
+
+    ret = sysconf(_SC_NPROCESSORS_CONF);
+    nr_cpu = (ret < 1) ? 1 : ret;
+    tree->nr_leaf = (nr_cpu + MTHPC_RCU_LEAF_CPUS - 1) / MTHPC_RCU_LEAF_CPUS;
+    tree->nr_node = tree->nr_leaf;
+    for (cnt = tree->nr_leaf; cnt > 1;) {
+        cnt = (cnt + MTHPC_RCU_TREE_FANOUT - 1) / MTHPC_RCU_TREE_FANOUT;
+        tree->nr_node += cnt;
+    }
+
+    tree->leaf = aligned_alloc(MTHPC_COHERENCE_SIZE,
+                               sizeof(struct mthpc_rcu_leaf) * tree->nr_leaf);
+    tree->node = aligned_alloc(MTHPC_COHERENCE_SIZE,
+                               sizeof(struct mthpc_rcu_tree_node) *
+                                   tree->nr_node);
+    if (!tree->leaf || !tree->node) {
+        MTHPC_WARN_ON(1, "allocation failed, fallback to flat mode");
+        free(tree->leaf);
+        free(tree->node);
+        return;
+    }
+
+    for (i = 0; i < tree->nr_node; i++) {
+        atomic_init(&tree->node[i].pending, 0);
+        tree->node[i].nr_child = 0;
+        tree->node[i].parent = -1;
+    }
+    /* Build the tree level by level. */
+    for (start = 0, cnt = tree->nr_leaf; cnt > 1; start = next) {
+        next = start + cnt;
+        for (i = 0; i < cnt; i++) {
+            tree->node[start + i].parent = next + i / MTHPC_RCU_TREE_FANOUT;
+            tree->node[next + i / MTHPC_RCU_TREE_FANOUT].nr_child++;
+        }
+        cnt = (cnt + MTHPC_RCU_TREE_FANOUT - 1) / MTHPC_RCU_TREE_FANOUT;
+    }
+
+    tree->req = 0;
+    tree->done = 0;
+    atomic_init(&tree->stop, 0);
+    tree->data = data;
+    for (i = 0; i < tree->nr_leaf; i++) {
+        struct mthpc_rcu_leaf *leaf = &tree->leaf[i];
+
+        spin_lock_init(&leaf->lock);
+        leaf->node = NULL;
+        leaf->blocked = NULL;
+        leaf->nr = 0;
+        leaf->cap = 0;
+        leaf->first_cpu = i * MTHPC_RCU_LEAF_CPUS;
+        leaf->futex = 0;
+        ret = pthread_create(&leaf->tid, NULL, mthpc_rcu_tree_scanner, leaf);
+        MTHPC_BUG_ON(ret, "create rcu scanner thread failed (%ld)", ret);
+    }
+}
+
+static void mthpc_rcu_tree_exit(void)
+{
+    struct mthpc_rcu_tree *tree = &mthpc_rcu_tree;
+    struct mthpc_rcu_data *data = tree->data;
+
+    if (!data)
+        return;
+
+    /* The scanners only run while the gp leader holds the lock. */
+    spin_lock(&data->lock);
+    atomic_store_explicit(&tree->stop, 1, memory_order_release);
+    atomic_store_explicit((volatile _Atomic int32_t *)&tree->req,
+                          tree->req + 1, memory_order_seq_cst);
+    futex(&tree->req, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    for (unsigned int i = 0; i < tree->nr_leaf; i++) {
+        pthread_join(tree->leaf[i].tid, NULL);
+        spin_lock_destroy(&tree->leaf[i].lock);
+        free(tree->leaf[i].node);
+        free(tree->leaf[i].blocked);
+    }
+    tree->data = NULL;
+    spin_unlock(&data->lock);
+
+    free(tree->leaf);
+    free(tree->node);
+}
+
+#else /* !CONFIG_MTHPC_RCU_TREE */
+
+static __always_inline bool mthpc_rcu_tree_mode(struct mthpc_rcu_data *data)
+{
+    return false;
+}
+
+static __always_inline void mthpc_rcu_tree_wait(struct mthpc_rcu_data *data,
+                                                unsigned long gp_seq)
+{
+}
+
+static __always_inline int mthpc_rcu_tree_add(struct mthpc_rcu_node *node)
+{
+    return 0;
+}
+
+static __always_inline void mthpc_rcu_tree_del(struct mthpc_rcu_node *node)
+{
+}
+
+static __always_inline void mthpc_rcu_tree_init(struct mthpc_rcu_data *data)
+{
+}
+
+static __always_inline void mthpc_rcu_tree_exit(void)
+{
+}
+
+#endif /* CONFIG_MTHPC_RCU_TREE */
+
+static __always_inline void mthpc_rcu_wait(struct mthpc_rcu_data *data,
+                                           unsigned long gp_seq)
+{
+    if (mthpc_rcu_tree_mode(data))
+        mthpc_rcu_tree_wait(data, gp_seq);
+    else
+        mthpc_wait_for_readers(data, gp_seq);
+}
+
+#define MTHPC_RCU_SEQ_STATE_MASK 0x1UL
+
+/* The gp_seq_nr after which a full grace period has elapsed. */
+static __always_inline unsigned long
+mthpc_rcu_seq_snap(struct mthpc_rcu_data *data)
+{
+    unsigned long s;
+
+    s = atomic_load_explicit(&data->gp_seq_nr, memory_order_acquire);
+    return (s + 2 * MTHPC_RCU_SEQ_STATE_MASK + 1) & ~MTHPC_RCU_SEQ_STATE_MASK;
+}
+
+static __always_inline bool mthpc_rcu_seq_done(struct mthpc_rcu_data *data,
+                                               unsigned long snap)
+{
+    unsigned long s;
+
+    s = atomic_load_explicit(&data->gp_seq_nr, memory_order_acquire);
+    return (long)(s - snap) >= 0;
+}
+
+/*
+ * The grace periods driven together, see mthpc_rcu_gp_batch(). The caller
+ * should be the gp leader of the data if run is set.
+ */
+struct mthpc_rcu_gp_batch {
+    struct mthpc_rcu_data *data;
+    unsigned long snap;
+    unsigned long gp_seq;
+    bool run;
+};
+
+/*
+ * data->lock serializes the gp leaders of the data. The registry is only
+ * locked for each pass over the readers (see mthpc_wait_for_readers()), so
+ * the threads can register and unregister while we are waiting.
+ */
+static __always_inline void mthpc_rcu_gp_wait(struct mthpc_rcu_data *data,
+                                              unsigned long gp_seq)
+{
+    spin_lock(&data->lock);
+    mthpc_rcu_wait(data, gp_seq);
+    spin_unlock(&data->lock);
+}
+
+/*
+ * Drive the grace periods of the batch phase by phase. The forced memory
+ * barrier on the readers is shared, and the readers of all the rcu data
+ * leave their critical sections in parallel while we wait for one of them.
+ * So the batch takes about as long as the slowest grace period instead of
+ * the sum of them.
+ *
+ * QSBR: Advance the gp_seq and wait for every online thread to report it.
+ */
+static void mthpc_rcu_gp_batch(struct mthpc_rcu_gp_batch *batch,
+                               unsigned int nr)
+{
+    unsigned long start = mthpc_rcu_stats_now();
+    struct mthpc_rcu_data *data;
+    bool usr = false;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        if (!batch[i].run)
+            continue;
+        data = batch[i].data;
+        /* Mark the grace period in flight. */
+        atomic_fetch_add_explicit(&data->gp_seq_nr, 1, memory_order_seq_cst);
+        usr |= !(data->type & MTHPC_RCU_QSBR);
+    }
+
+    /*
+     * All the readers should see the new data after they read the
+     * gp_seq. Also, the reader's unlock should be visible to us.
+     */
+    if (usr)
+        mthpc_rcu_smp_mb_master();
+    else
+        smp_mb();
+
+    for (i = 0; i < nr; i++) {
+        data = batch[i].data;
+        if (!batch[i].run || data->type & MTHPC_RCU_QSBR)
+            continue;
+        batch[i].gp_seq = READ_ONCE(data->gp_seq);
+        mthpc_rcu_gp_wait(data, batch[i].gp_seq);
+    }
+
+    smp_mb();
+    for (i = 0; i < nr; i++) {
+        data = batch[i].data;
+        if (!batch[i].run)
+            continue;
+        if (data->type & MTHPC_RCU_QSBR) {
+            batch[i].gp_seq = data->gp_seq + MTHPC_GP_QSBR_CTR;
+            WRITE_ONCE(data->gp_seq, batch[i].gp_seq);
+        } else {
+            /* Go to next gp. 0 -> 1; 1 -> 0 */
+            WRITE_ONCE(data->gp_seq, data->gp_seq ^ MTHPC_GP_CTR_PHASE);
+        }
+    }
+    smp_mb();
+
+    for (i = 0; i < nr; i++) {
+        if (batch[i].run)
+            mthpc_rcu_gp_wait(batch[i].data, batch[i].gp_seq);
+    }
+
+    /* Finish waiting for readers before the reclamation. */
+    if (usr)
+        mthpc_rcu_smp_mb_master();
+    else
+        smp_mb();
+
+    for (i = 0; i < nr; i++) {
+        if (!batch[i].run)
+            continue;
+        atomic_fetch_add_explicit(&batch[i].data->gp_seq_nr, 1,
+                                  memory_order_seq_cst);
+        mthpc_rcu_stats_gp(batch[i].data, start);
+    }
+}
+
+/* Only the gp leader can call this. */
+static void mthpc_rcu_gp(struct mthpc_rcu_data *data)
+{
+    struct mthpc_rcu_gp_batch batch = { .data = data, .run = true };
+
+    mthpc_rcu_gp_batch(&batch, 1);
+}
+
+static __always_inline bool mthpc_rcu_gp_try_lead(struct mthpc_rcu_data *data)
+{
+    int expected = 0;
+
+    return atomic_compare_exchange_strong_explicit(&data->gp_leader,
+                                                   &expected, 1,
+                                                   memory_order_seq_cst,
+                                                   memory_order_relaxed);
+}
+
+static __always_inline void mthpc_rcu_gp_unlead(struct mthpc_rcu_data *data)
+{
+    atomic_store_explicit(&data->gp_leader, 0, memory_order_seq_cst);
+    atomic_fetch_add_explicit((volatile _Atomic int32_t *)&data->gp_wait, 1,
+                              memory_order_seq_cst);
+    if (atomic_load_explicit(&data->nr_gp_waiter, memory_order_seq_cst))
+        futex(&data->gp_wait, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * The caller takes the snapshot of gp_seq_nr. If there is no leader, it
+ * drives the grace period by itself. Otherwise, it sleeps until the leader
+ * finishes and checks the snapshot again. So the concurrent callers share
+ * the same grace period.
+ */
+static void mthpc_rcu_wait_seq(struct mthpc_rcu_data *data, unsigned long snap)
+{
+    int32_t wait;
+
+    while (!mthpc_rcu_seq_done(data, snap)) {
+        if (mthpc_rcu_gp_try_lead(data)) {
+            if (!mthpc_rcu_seq_done(data, snap))
+                mthpc_rcu_gp(data);
+            mthpc_rcu_gp_unlead(data);
+            break;
+        }
+
+        wait = atomic_load_explicit((volatile _Atomic int32_t *)&data->gp_wait,
+                                    memory_order_seq_cst);
+        if (mthpc_rcu_seq_done(data, snap))
+            break;
+        /* The leader just left, try to lead. */
+        if (!atomic_load_explicit(&data->gp_leader, memory_order_seq_cst))
+            continue;
+
+        atomic_fetch_add_explicit(&data->nr_gp_waiter, 1,
+                                  memory_order_seq_cst);
+        futex(&data->gp_wait, FUTEX_WAIT, wait, NULL, NULL, 0);
+        atomic_fetch_sub_explicit(&data->nr_gp_waiter, 1,
+                                  memory_order_relaxed);
+    }
+}
+
+void mthpc_synchronize_rcu_internal(struct mthpc_rcu_data *data)
+{
+    smp_mb();
+    mthpc_rcu_wait_seq(data, mthpc_rcu_seq_snap(data));
+    smp_mb();
+}
+
+void mthpc_synchronize_rcu(void)
+{
+    mthpc_synchronize_rcu_internal(&mthpc_rcu_data);
+}
+
+/*
+ * Force the memory barrier on all the readers and check whether any of them
+ * is in the critical section. If none, the readers coming later will see
+ * the update, so we don't have to flip the phase and wait. Otherwise, fall
+ * back to the normal grace period.
+ */
+void mthpc_synchronize_rcu_expedited(void)
+{
+    struct mthpc_rcu_data *data = &mthpc_rcu_data;
+    unsigned long gp_seq;
+    unsigned int nr;
+
+    smp_mb();
+
+    spin_lock(&data->lock);
+    mthpc_rcu_smp_mb_master();
+    gp_seq = READ_ONCE(data->gp_seq);
+    spin_lock(&data->slot_lock);
+    nr = mthpc_rcu_collect_blocking(data, gp_seq, NULL) +
+         mthpc_rcu_collect_blocking(data, gp_seq ^ MTHPC_GP_CTR_PHASE, NULL);
+    spin_unlock(&data->slot_lock);
+    /* Order the readers' unlock before the reclamation. */
+    if (!nr)
+        mthpc_rcu_smp_mb_master();
+    spin_unlock(&data->lock);
+
+    if (nr)
+        mthpc_synchronize_rcu_internal(data);
+    else
+        smp_mb();
+}
+
+void mthpc_synchronize_rcu_qsbr(void)
+{
+    struct mthpc_rcu_node *node = mthpc_rcu_qsbr_node_ptr;
+    bool online;
+
+    /* Don't wait for ourself. */
+    online = node && atomic_load_explicit(&node->gp_seq, memory_order_relaxed);
+    if (online)
+        mthpc_rcu_thread_offline();
+    mthpc_synchronize_rcu_internal(&mthpc_rcu_qsbr_data);
+    if (online)
+        mthpc_rcu_thread_online();
+}
+
+/*
+ * Take the snapshots of all the rcu data and drive the grace periods we
+ * can lead together. The rest are led by the others, wait for them after.
+ * The QSBR data is one of them, so go offline like
+ * mthpc_synchronize_rcu_qsbr() does.
+ */
+void mthpc_synchronize_rcu_all(void)
+{
+    struct mthpc_rcu_node *node = mthpc_rcu_qsbr_node_ptr;
+    struct mthpc_rcu_gp_batch *batch;
+    struct mthpc_rcu_data *data;
+    unsigned int nr = 0, i;
+    bool online;
+
+    /* Don't wait for ourself. */
+    online = node && atomic_load_explicit(&node->gp_seq, memory_order_relaxed);
+    if (online)
+        mthpc_rcu_thread_offline();
+    else
+        smp_mb();
+
+    spin_lock(&mthpc_rcu_meta.lock);
+    for (data = mthpc_rcu_meta.head; data; data = data->next)
+        nr++;
+    batch = malloc(sizeof(struct mthpc_rcu_gp_batch) * nr);
+    if (!batch) {
+        /* Fallback to one by one. */
+        for (data = mthpc_rcu_meta.head; data; data = data->next)
+            mthpc_synchronize_rcu_internal(data);
+        spin_unlock(&mthpc_rcu_meta.lock);
+        goto out;
+    }
+    for (i = 0, data = mthpc_rcu_meta.head; data; data = data->next, i++) {
+        /* Pin the data, the destroy waits for us. */
+        atomic_fetch_add_explicit(&data->nr_user, 1, memory_order_relaxed);
+        batch[i].data = data;
+        batch[i].snap = mthpc_rcu_seq_snap(data);
+        batch[i].run = mthpc_rcu_gp_try_lead(data);
+        if (batch[i].run && mthpc_rcu_seq_done(data, batch[i].snap)) {
+            mthpc_rcu_gp_unlead(data);
+            batch[i].run = false;
+        }
+    }
+    spin_unlock(&mthpc_rcu_meta.lock);
+
+    mthpc_rcu_gp_batch(batch, nr);
+
+    for (i = 0; i < nr; i++) {
+        data = batch[i].data;
+        if (batch[i].run)
+            mthpc_rcu_gp_unlead(data);
+        else
+            mthpc_rcu_wait_seq(data, batch[i].snap);
+        atomic_fetch_sub_explicit(&data->nr_user, 1, memory_order_release);
+    }
+    free(batch);
+
+out:
+    if (online)
+        mthpc_rcu_thread_online();
+    else
+        smp_mb();
+}
+
+/* Asynchronous callback */
+
+/*
+ * The callbacks are queued in the per-thread (rcu node) lock-free stack.
+ * The gp thread takes all the stacks, runs one grace period for the whole
+ * batch and invokes the callbacks. So the updater only pays for the push.
+ */
+struct mthpc_rcu_gp_thread {
+    pthread_t tid;
+    /*
+     * Following futex values represent the state of gp thread:
+     * - -1: going to sleep, call_rcu() should wake it up
+     * - 0: running
+     */
+    int32_t futex;
+    atomic_int stop;
+    /* The callbacks left by the exited threads. */
+    _Atomic(struct mthpc_rcu_head *) orphan;
+    /* The heads of mthpc_free_rcu() which failed to get the block. */
+    _Atomic(struct mthpc_rcu_head *) free_head;
+    /* The newest cookie from start_poll_synchronize_rcu(). */
+    atomic_ulong gp_req;
+    /* The number of the partial blocks of mthpc_free_rcu(). */
+    atomic_int nr_bulk;
+};
+static struct mthpc_rcu_gp_thread mthpc_rcu_gp_thread;
+
+static __always_inline void
+mthpc_rcu_cb_push(_Atomic(struct mthpc_rcu_head *) *stack,
+                  struct mthpc_rcu_head *first, struct mthpc_rcu_head *last)
+{
+    struct mthpc_rcu_head *old;
 
-#include <internal/rcu.h>
+    old = atomic_load_explicit(stack, memory_order_relaxed);
 
-#include <internal/feature.h>
-#undef _MTHPC_FEATURE
-#define _MTHPC_FEATURE rcu
+    do {
+        last->next = old;
+    } while (!atomic_compare_exchange_weak_explicit(
+        stack, &old, first, memory_order_seq_cst, memory_order_relaxed));
+}
 
-// TODO: use futex in rcu thread worker
+/* Detach the stack and append it to @list with the queued (FIFO) order. */
+static struct mthpc_rcu_head **
+mthpc_rcu_cb_splice(_Atomic(struct mthpc_rcu_head *) *stack,
+                    struct mthpc_rcu_head **tail)
+{
+    struct mthpc_rcu_head *head, *next, *rev = NULL, *last;
 
-/* User (global) rcu data */
+    if (!atomic_load_explicit(stack, memory_order_relaxed))
+        return tail;
+    head = atomic_exchange_explicit(stack, NULL, memory_order_acquire);
+    last = head;
+    while (head) {
+        next = head->next;
+        head->next = rev;
+        rev = head;
+        head = next;
+    }
+    if (rev) {
+        *tail = rev;
+        tail = &last->next;
+    }
 
-__thread struct mthpc_rcu_node *mthpc_rcu_node_ptr = NULL;
-static struct mthpc_rcu_data mthpc_rcu_data;
+    return tail;
+}
+
+static struct mthpc_rcu_head *mthpc_rcu_cb_collect(void)
+{
+    struct mthpc_rcu_head *list = NULL, **tail = &list;
+    unsigned int chunk, nr;
+
+    tail = mthpc_rcu_cb_splice(&mthpc_rcu_gp_thread.orphan, tail);
+    spin_lock(&mthpc_rcu_data.slot_lock);
+    mthpc_rcu_for_each_chunk (&mthpc_rcu_data, chunk, nr) {
+        for (unsigned int i = 0; i < nr; i++)
+            tail = mthpc_rcu_cb_splice(&mthpc_rcu_data.chunk[chunk][i].cb_head,
+                                       tail);
+    }
+    spin_unlock(&mthpc_rcu_data.slot_lock);
+
+    return list;
+}
 
 /*
- * Maintain all of the rcu data.
- * But let the other feature control (write) their own
- * constructor and destructor of rcu_data in rcu_init/rcu_exit
+ * Take the heads of mthpc_free_rcu() after the callbacks, so the barrier
+ * markers queued after them won't complete before they're freed.
  */
-struct mthpc_rcu_meta {
-    struct mthpc_rcu_data *head;
-    spinlock_t lock;
+static __always_inline struct mthpc_rcu_head *mthpc_rcu_free_collect(void)
+{
+    if (!atomic_load_explicit(&mthpc_rcu_gp_thread.free_head,
+                              memory_order_relaxed))
+        return NULL;
+    return atomic_exchange_explicit(&mthpc_rcu_gp_thread.free_head, NULL,
+                                    memory_order_acquire);
+}
+
+static void mthpc_rcu_cb_invoke(struct mthpc_rcu_head *list)
+{
+    struct mthpc_rcu_head *next;
+
+    while (list) {
+        next = list->next;
+        list->func(list);
+        list = next;
+    }
+}
+
+/* The head of mthpc_free_rcu() records the object instead of the func. */
+static void mthpc_rcu_free_invoke(struct mthpc_rcu_head *list)
+{
+    struct mthpc_rcu_head *next;
+
+    while (list) {
+        next = list->next;
+        free(list->ptr);
+        list = next;
+    }
+}
+
+/*
+ * Bulk free
+ *
+ * mthpc_free_rcu() appends the pointer to the block of its rcu node. The full
+ * block is queued as one callback, which wakes the gp thread up. The partial
+ * blocks are taken by the gp thread on every grace period it runs, and when
+ * it has been idle for a while, so the frees won't be held for long.
+ */
+struct mthpc_rcu_bulk {
+    struct mthpc_rcu_head head;
+    unsigned long nr;
+    void *ptr[];
 };
-static struct mthpc_rcu_meta mthpc_rcu_meta;
 
-static void mthpc_wait_for_readers(struct mthpc_rcu_data *data,
-                                   unsigned long gp_seq)
+#define MTHPC_RCU_BULK_NR                                          \
+    ((MTHPC_RCU_BULK_SIZE - offsetof(struct mthpc_rcu_bulk, ptr)) / \
+     sizeof(void *))
+#define MTHPC_RCU_BULK_DRAIN_NS (20 * 1000 * 1000)
+
+static void mthpc_rcu_bulk_free(struct mthpc_rcu_head *head)
 {
-    struct mthpc_rcu_node *node;
-    unsigned long node_gp;
+    struct mthpc_rcu_bulk *bulk =
+        container_of(head, struct mthpc_rcu_bulk, head);
 
-    for (node = data->head; node; node = node->next) {
-        while (1) {
-            node_gp = atomic_load_explicit(&node->gp_seq, memory_order_consume);
-            /* Check node is active or not. */
-            if (!(node_gp & MTHPC_GP_CTR_NEST_MASK))
-                break;
-            /* Check current gp_seq. */
-            if ((node_gp ^ gp_seq) & MTHPC_GP_CTR_PHASE)
+    for (unsigned long i = 0; i < bulk->nr; i++)
+        free(bulk->ptr[i]);
+    free(bulk);
+}
+
+/*
+ * Take the partial block of the node and append it to @tail. The owner
+ * might still be appending to it in the read-side critical section. The
+ * block is freed after a grace period started after we take it, which also
+ * covers the owner, so it's safe.
+ */
+static struct mthpc_rcu_head **mthpc_rcu_bulk_take(struct mthpc_rcu_node *node,
+                                                   struct mthpc_rcu_head **tail)
+{
+    struct mthpc_rcu_bulk *bulk;
+
+    if (!atomic_load_explicit(&node->bulk, memory_order_relaxed))
+        return tail;
+    bulk = atomic_exchange_explicit(&node->bulk, NULL, memory_order_acquire);
+    if (!bulk)
+        return tail;
+    atomic_fetch_sub_explicit(&mthpc_rcu_gp_thread.nr_bulk, 1,
+                              memory_order_relaxed);
+    bulk->head.func = mthpc_rcu_bulk_free;
+    bulk->head.next = NULL;
+    *tail = &bulk->head;
+
+    return &bulk->head.next;
+}
+
+/* Take the partial blocks from all the threads. */
+static struct mthpc_rcu_head *mthpc_rcu_bulk_collect(void)
+{
+    struct mthpc_rcu_head *list = NULL, **tail = &list;
+    unsigned int chunk, nr;
+
+    if (!atomic_load_explicit(&mthpc_rcu_gp_thread.nr_bulk,
+                              memory_order_relaxed))
+        return NULL;
+
+    spin_lock(&mthpc_rcu_data.slot_lock);
+    mthpc_rcu_for_each_chunk (&mthpc_rcu_data, chunk, nr) {
+        for (unsigned int i = 0; i < nr; i++)
+            tail = mthpc_rcu_bulk_take(&mthpc_rcu_data.chunk[chunk][i], tail);
+    }
+    spin_unlock(&mthpc_rcu_data.slot_lock);
+
+    return list;
+}
+
+/*
+ * Put the partial blocks on the orphan list, so the callbacks queued after
+ * it are invoked after the blocks are freed.
+ */
+static void mthpc_rcu_bulk_flush(void)
+{
+    struct mthpc_rcu_head *first, *last;
+
+    first = mthpc_rcu_bulk_collect();
+    if (!first)
+        return;
+    for (last = first; last->next; last = last->next)
+        ;
+    mthpc_rcu_cb_push(&mthpc_rcu_gp_thread.orphan, first, last);
+}
+
+/* Hand the pending callbacks of the leaving node to the gp thread. */
+static void mthpc_rcu_cb_orphan(struct mthpc_rcu_node *node)
+{
+    struct mthpc_rcu_head *head, *last;
+    struct mthpc_rcu_bulk *bulk;
+
+    /* The owner is leaving, so no one is appending to the block. */
+    bulk = atomic_exchange_explicit(&node->bulk, NULL, memory_order_acquire);
+    if (bulk) {
+        atomic_fetch_sub_explicit(&mthpc_rcu_gp_thread.nr_bulk, 1,
+                                  memory_order_relaxed);
+        bulk->head.func = mthpc_rcu_bulk_free;
+        mthpc_rcu_cb_push(&mthpc_rcu_gp_thread.orphan, &bulk->head,
+                          &bulk->head);
+    }
+
+    head = atomic_exchange_explicit(&node->cb_head, NULL, memory_order_acquire);
+    if (!head)
+        return;
+    for (last = head; last->next; last = last->next)
+        ;
+    mthpc_rcu_cb_push(&mthpc_rcu_gp_thread.orphan, head, last);
+}
+
+void mthpc_rcu_wake_up_gp(struct mthpc_rcu_node *node)
+{
+    struct mthpc_rcu_data *data = node->data;
+
+#ifdef CONFIG_MTHPC_RCU_TREE
+    /* Only the scanner of our leaf waits for us. */
+    if (mthpc_rcu_tree_mode(data)) {
+        mthpc_rcu_leaf_wake(&mthpc_rcu_tree.leaf[node->leaf]);
+        return;
+    }
+#endif
+    WRITE_ONCE(data->futex, 0);
+    futex(&data->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static __always_inline void mthpc_rcu_gp_thread_wake(void)
+{
+    if (atomic_load_explicit((_Atomic int32_t *)&mthpc_rcu_gp_thread.futex,
+                             memory_order_seq_cst) == -1) {
+        WRITE_ONCE(mthpc_rcu_gp_thread.futex, 0);
+        futex(&mthpc_rcu_gp_thread.futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+static __always_inline bool mthpc_rcu_gp_req_done(void)
+{
+    unsigned long req;
+
+    req = atomic_load_explicit(&mthpc_rcu_gp_thread.gp_req,
+                               memory_order_seq_cst);
+    return mthpc_rcu_seq_done(&mthpc_rcu_data, req);
+}
+
+/*
+ * Sleep until someone wakes us up. If there are the partial blocks, wake
+ * up after a while to drain them, so the frees won't be held forever.
+ * Return true if it's the time to drain.
+ */
+static bool mthpc_rcu_gp_thread_sleep(void)
+{
+    const struct timespec timeout = {
+        .tv_sec = 0,
+        .tv_nsec = MTHPC_RCU_BULK_DRAIN_NS,
+    };
+    const struct timespec *tp = NULL;
+
+    /* Pair with the first block of __mthpc_free_rcu(). */
+    if (atomic_load_explicit(&mthpc_rcu_gp_thread.nr_bulk,
+                             memory_order_seq_cst))
+        tp = &timeout;
+
+    while (READ_ONCE(mthpc_rcu_gp_thread.futex) == -1) {
+        if (futex(&mthpc_rcu_gp_thread.futex, FUTEX_WAIT, -1, tp, NULL, 0) &&
+            errno == ETIMEDOUT)
+            return true;
+    }
+
+    return false;
+}
+
+static void *mthpc_rcu_gp_worker(void *unused)
+{
+    struct mthpc_rcu_head *list, *free_list, *bulk;
+
+    while (1) {
+        /* Tell call_rcu() we might sleep, then check the queues again. */
+        atomic_store_explicit((_Atomic int32_t *)&mthpc_rcu_gp_thread.futex,
+                              -1, memory_order_seq_cst);
+        list = mthpc_rcu_cb_collect();
+        free_list = mthpc_rcu_free_collect();
+        if (!list && !free_list && mthpc_rcu_gp_req_done()) {
+            if (atomic_load_explicit(&mthpc_rcu_gp_thread.stop,
+                                     memory_order_acquire))
                 break;
+            if (!mthpc_rcu_gp_thread_sleep())
+                continue;
         }
+        WRITE_ONCE(mthpc_rcu_gp_thread.futex, 0);
+        /* Drain the partial blocks with every grace period we run. */
+        bulk = mthpc_rcu_bulk_collect();
+
+        /* One grace period for the whole batch. */
+        mthpc_synchronize_rcu();
+        mthpc_rcu_free_invoke(free_list);
+        mthpc_rcu_cb_invoke(bulk);
+        mthpc_rcu_cb_invoke(list);
     }
+
+    mthpc_rcu_thread_exit();
+
+    return NULL;
 }
 
-void mthpc_synchronize_rcu_internal(struct mthpc_rcu_data *data)
+void mthpc_call_rcu(struct mthpc_rcu_head *head,
+                    void (*func)(struct mthpc_rcu_head *))
+{
+    if (unlikely(!mthpc_rcu_node_ptr))
+        mthpc_rcu_thread_init();
+
+    head->func = func;
+    mthpc_rcu_cb_push(&mthpc_rcu_node_ptr->cb_head, head, head);
+    mthpc_rcu_gp_thread_wake();
+}
+
+void __mthpc_free_rcu(void *ptr, struct mthpc_rcu_head *head)
 {
-    unsigned long curr_gp;
+    struct mthpc_rcu_node *node;
+    struct mthpc_rcu_bulk *bulk, *full = NULL;
+
+    if (unlikely(!mthpc_rcu_node_ptr))
+        mthpc_rcu_thread_init();
+    node = mthpc_rcu_node_ptr;
 
+    /*
+     * The gp thread takes the partial block and waits for the grace period
+     * before touching it, so append in the read-side critical section
+     * instead of the atomic operation.
+     */
+    mthpc_rcu_read_lock();
+    bulk = atomic_load_explicit(&node->bulk, memory_order_relaxed);
+    if (likely(bulk && bulk->nr < MTHPC_RCU_BULK_NR)) {
+        bulk->ptr[bulk->nr++] = ptr;
+        mthpc_rcu_read_unlock();
+        return;
+    }
+
+    /* The block is full, detach it unless the gp thread has taken it. */
+    if (bulk && atomic_compare_exchange_strong_explicit(
+                    &node->bulk, &bulk, NULL, memory_order_relaxed,
+                    memory_order_relaxed))
+        full = bulk;
+    mthpc_rcu_read_unlock();
+
+    if (full) {
+        atomic_fetch_sub_explicit(&mthpc_rcu_gp_thread.nr_bulk, 1,
+                                  memory_order_relaxed);
+        mthpc_call_rcu(&full->head, mthpc_rcu_bulk_free);
+    }
+
+    /*
+     * Only we install the block, so it's still NULL after we allocate the
+     * new one outside the critical section.
+     */
+    bulk = aligned_alloc(MTHPC_RCU_BULK_SIZE, MTHPC_RCU_BULK_SIZE);
+    if (unlikely(!bulk)) {
+        head->ptr = ptr;
+        mthpc_rcu_cb_push(&mthpc_rcu_gp_thread.free_head, head, head);
+        mthpc_rcu_gp_thread_wake();
+        return;
+    }
+    bulk->nr = 1;
+    bulk->ptr[0] = ptr;
+    atomic_store_explicit(&node->bulk, bulk, memory_order_release);
+    /* The first partial block, let the idle gp thread set the drain timer. */
+    if (!atomic_fetch_add_explicit(&mthpc_rcu_gp_thread.nr_bulk, 1,
+                                   memory_order_seq_cst))
+        mthpc_rcu_gp_thread_wake();
+}
+
+/* Polled grace period */
+
+unsigned long mthpc_get_state_synchronize_rcu(void)
+{
+    /* Order the prior updates before taking the cookie. */
     smp_mb();
+    return mthpc_rcu_seq_snap(&mthpc_rcu_data);
+}
 
-    spin_lock(&data->lock);
+unsigned long mthpc_start_poll_synchronize_rcu(void)
+{
+    unsigned long cookie, req;
+
+    cookie = mthpc_get_state_synchronize_rcu();
 
-    curr_gp = data->gp_seq;
+    /* Keep the newest request, the gp thread will cover the older ones. */
+    req = atomic_load_explicit(&mthpc_rcu_gp_thread.gp_req,
+                               memory_order_relaxed);
+    do {
+        if ((long)(req - cookie) >= 0)
+            break;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &mthpc_rcu_gp_thread.gp_req, &req, cookie, memory_order_seq_cst,
+        memory_order_relaxed));
+    mthpc_rcu_gp_thread_wake();
+
+    return cookie;
+}
 
-    mthpc_wait_for_readers(data, curr_gp);
+bool mthpc_poll_state_synchronize_rcu(unsigned long cookie)
+{
+    bool ret;
 
+    ret = mthpc_rcu_seq_done(&mthpc_rcu_data, cookie);
+    /* Order the grace period before the following accesses. */
     smp_mb();
-    /* Go to next gp. 0 -> 1; 1 -> 0 */
-    WRITE_ONCE(data->gp_seq, data->gp_seq ^ MTHPC_GP_CTR_PHASE);
+
+    return ret;
+}
+
+void mthpc_cond_synchronize_rcu(unsigned long cookie)
+{
+    /* Share the grace period with whoever is driving it. */
+    mthpc_rcu_wait_seq(&mthpc_rcu_data, cookie);
     smp_mb();
+}
 
-    mthpc_wait_for_readers(data, curr_gp);
+/* rcu barrier */
 
-    spin_unlock(&data->lock);
+/*
+ * The barriers are serialized, so each rcu node embeds its marker and the
+ * barrier never allocates.
+ */
+struct mthpc_rcu_barrier_state {
+    spinlock_t lock;
+    /* The marker of the orphan list. */
+    struct mthpc_rcu_head orphan;
+    /* The markers haven't run, the last one wakes up the waiter. */
+    int32_t pending;
+};
+static struct mthpc_rcu_barrier_state mthpc_rcu_barrier_state = {
+    .lock = SPINLOCK_INIT,
+};
 
-    smp_mb();
+static void mthpc_rcu_barrier_func(struct mthpc_rcu_head *head)
+{
+    if (atomic_fetch_sub_explicit(
+            (volatile _Atomic int32_t *)&mthpc_rcu_barrier_state.pending, 1,
+            memory_order_acq_rel) == 1)
+        futex(&mthpc_rcu_barrier_state.pending, FUTEX_WAKE, 1, NULL, NULL, 0);
 }
 
-void mthpc_synchronize_rcu(void)
+/*
+ * Queue the marker after the pending callbacks of every thread and the
+ * orphan list. The callbacks of each queue are invoked in order, so all of
+ * them have run once the last marker completes. The marker of the exiting
+ * thread moves to the orphan list with its callbacks.
+ */
+void mthpc_rcu_barrier(void)
 {
-    mthpc_synchronize_rcu_internal(&mthpc_rcu_data);
+    struct mthpc_rcu_barrier_state *barrier = &mthpc_rcu_barrier_state;
+    volatile _Atomic int32_t *pending =
+        (volatile _Atomic int32_t *)&barrier->pending;
+    struct mthpc_rcu_node *node;
+    unsigned int chunk, nr, i, cnt = 1;
+    int32_t left;
+
+    spin_lock(&barrier->lock);
+    mthpc_rcu_bulk_flush();
+
+    spin_lock(&mthpc_rcu_data.slot_lock);
+    mthpc_rcu_for_each_chunk (&mthpc_rcu_data, chunk, nr) {
+        for (i = 0; i < nr; i++)
+            cnt += !!mthpc_rcu_data.chunk[chunk][i].data;
+    }
+    atomic_store_explicit(pending, cnt, memory_order_relaxed);
+
+    barrier->orphan.func = mthpc_rcu_barrier_func;
+    mthpc_rcu_cb_push(&mthpc_rcu_gp_thread.orphan, &barrier->orphan,
+                      &barrier->orphan);
+    mthpc_rcu_for_each_chunk (&mthpc_rcu_data, chunk, nr) {
+        for (i = 0; i < nr; i++) {
+            node = &mthpc_rcu_data.chunk[chunk][i];
+            if (!node->data)
+                continue;
+            node->barrier.func = mthpc_rcu_barrier_func;
+            mthpc_rcu_cb_push(&node->cb_head, &node->barrier, &node->barrier);
+        }
+    }
+    spin_unlock(&mthpc_rcu_data.slot_lock);
+
+    mthpc_rcu_gp_thread_wake();
+    /* It takes a grace period at least, sleep instead of spinning. */
+    while ((left = atomic_load_explicit(pending, memory_order_acquire)))
+        futex(&barrier->pending, FUTEX_WAIT, left, NULL, NULL, 0);
+    spin_unlock(&barrier->lock);
 }
 
-void mthpc_synchronize_rcu_all(void)
+static void mthpc_rcu_gp_thread_init(void)
 {
-    struct mthpc_rcu_data *data;
-    spin_lock(&mthpc_rcu_meta.lock);
-    data = mthpc_rcu_meta.head;
-    while (data) {
-        mthpc_synchronize_rcu_internal(data);
-        data = data->next;
+    int ret;
+
+    mthpc_rcu_gp_thread.futex = 0;
+    atomic_init(&mthpc_rcu_gp_thread.stop, 0);
+    atomic_init(&mthpc_rcu_gp_thread.orphan, NULL);
+    atomic_init(&mthpc_rcu_gp_thread.free_head, NULL);
+    atomic_init(&mthpc_rcu_gp_thread.gp_req, 0);
+    atomic_init(&mthpc_rcu_gp_thread.nr_bulk, 0);
+    ret = pthread_create(&mthpc_rcu_gp_thread.tid, NULL, mthpc_rcu_gp_worker,
+                         NULL);
+    MTHPC_BUG_ON(ret, "create rcu gp thread failed (%d)", ret);
+}
+
+static void mthpc_rcu_gp_thread_exit(void)
+{
+    struct mthpc_rcu_head *list, *free_list;
+
+    atomic_store_explicit(&mthpc_rcu_gp_thread.stop, 1, memory_order_release);
+    WRITE_ONCE(mthpc_rcu_gp_thread.futex, 0);
+    futex(&mthpc_rcu_gp_thread.futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+    pthread_join(mthpc_rcu_gp_thread.tid, NULL);
+
+    /* Flush the callbacks queued after the gp thread stopped. */
+    mthpc_rcu_bulk_flush();
+    while (1) {
+        list = mthpc_rcu_cb_collect();
+        free_list = mthpc_rcu_free_collect();
+        if (!list && !free_list)
+            break;
+        mthpc_synchronize_rcu();
+        mthpc_rcu_free_invoke(free_list);
+        mthpc_rcu_cb_invoke(list);
     }
-    spin_unlock(&mthpc_rcu_meta.lock);
 }
 
 /* init/exit function */
 
+/* Should be called with holding data->slot_lock. */
+static struct mthpc_rcu_node *mthpc_rcu_slot_alloc(struct mthpc_rcu_data *data)
+{
+    struct mthpc_rcu_node *node, **blocked;
+    unsigned int slot, chunk;
+
+    if (data->free_slot != MTHPC_RCU_NO_SLOT) {
+        node = mthpc_rcu_slot_node(data, data->free_slot);
+        data->free_slot = node->next_free;
+        return node;
+    }
+
+    slot = data->nr_slot;
+    chunk = mthpc_rcu_slot_chunk(slot);
+    if (chunk >= MTHPC_RCU_NR_CHUNK)
+        return NULL;
+    if (!data->chunk[chunk]) {
+        /* The gp leader reuses it instead of allocating per grace period. */
+        blocked = realloc(data->blocked, sizeof(struct mthpc_rcu_node *) *
+                                             mthpc_rcu_chunk_start(chunk + 1));
+        if (!blocked)
+            return NULL;
+        data->blocked = blocked;
+        data->chunk[chunk] = aligned_alloc(
+            MTHPC_COHERENCE_SIZE,
+            sizeof(struct mthpc_rcu_node) * (MTHPC_RCU_SLOT_BASE << chunk));
+        if (!data->chunk[chunk])
+            return NULL;
+    }
+    node = mthpc_rcu_slot_node(data, slot);
+    node->slot = slot;
+    atomic_init(&node->gp_seq, 0);
+    atomic_init(&node->cb_head, NULL);
+    atomic_init(&node->bulk, NULL);
+    data->nr_slot++;
+
+    return node;
+}
+
 void mthpc_rcu_add(struct mthpc_rcu_data *data, unsigned int id,
                    struct mthpc_rcu_node **rev)
 {
-    struct mthpc_rcu_node **indirect = &data->head;
     struct mthpc_rcu_node *node;
 
-    node = malloc(sizeof(struct mthpc_rcu_node));
+    spin_lock(&data->slot_lock);
+    node = mthpc_rcu_slot_alloc(data);
     if (!node) {
+        spin_unlock(&data->slot_lock);
+        MTHPC_WARN_ON(1, "allocation failed");
+        return;
+    }
+    if (mthpc_rcu_tree_mode(data) && mthpc_rcu_tree_add(node)) {
+        node->next_free = data->free_slot;
+        data->free_slot = node->slot;
+        spin_unlock(&data->slot_lock);
         MTHPC_WARN_ON(1, "allocation failed");
         return;
     }
-
     node->id = id;
-    atomic_init(&node->gp_seq, 0);
-    node->next = NULL;
+    mthpc_rcu_stats_node_init(node);
+    node->next_free = MTHPC_RCU_NO_SLOT;
+    /* The freed slot is idle, mthpc_rcu_del() cleared gp_seq. */
     node->data = data;
+    spin_unlock(&data->slot_lock);
 
-    spin_lock(&data->lock);
-    while (*indirect) {
-        if ((*indirect)->id == id) {
-            spin_unlock(&data->lock);
-            free(node);
-            MTHPC_WARN_ON(1, "already existed (%6u)", id);
-            *rev = *indirect;
-            return;
-        }
-        indirect = &(*indirect)->next;
-    }
-    *indirect = node;
-    spin_unlock(&data->lock);
+    if (!(data->type & MTHPC_RCU_QSBR))
+        mthpc_rcu_signal_register();
 
     *rev = node;
 }
@@ -130,26 +2148,42 @@ void mthpc_rcu_add(struct mthpc_rcu_data *data, unsigned int id,
 void mthpc_rcu_del(struct mthpc_rcu_data *data, unsigned int id,
                    struct mthpc_rcu_node *node)
 {
-    struct mthpc_rcu_node **indirect = &data->head;
-    struct mthpc_rcu_node *target;
+    unsigned int chunk, nr;
 
-    spin_lock(&data->lock);
-    while (*indirect) {
-        if ((*indirect)->id == id) {
-            MTHPC_WARN_ON(node && *indirect != node,
-                          "not the same node(%p, %p)", *indirect, node);
-            target = *indirect;
-            *indirect = (*indirect)->next;
-            spin_unlock(&data->lock);
-            free(target);
-            return;
+    spin_lock(&data->slot_lock);
+    if (!node) {
+        mthpc_rcu_for_each_chunk (data, chunk, nr) {
+            for (unsigned int i = 0; i < nr; i++) {
+                struct mthpc_rcu_node *tmp = &data->chunk[chunk][i];
+
+                if (tmp->data == data && tmp->id == id) {
+                    node = tmp;
+                    goto found;
+                }
+            }
         }
-        indirect = &(*indirect)->next;
+        spin_unlock(&data->slot_lock);
+        MTHPC_WARN_ON(1, "target node(id=%u) not found", id);
+        return;
     }
-    spin_unlock(&data->lock);
 
-    MTHPC_WARN_ON(1, "target node(id=%u) not found", id);
+found:
+    MTHPC_WARN_ON(node->data != data || node->id != id,
+                  "not the same node(id=%lu, %u)", node->id, id);
+    MTHPC_WARN_ON(atomic_load_explicit(&node->gp_seq, memory_order_relaxed) &
+                      MTHPC_GP_CTR_NEST_MASK,
+                  "unregister node(id=%u) in read-side critical section", id);
+    mthpc_rcu_cb_orphan(node);
+    if (mthpc_rcu_tree_mode(data))
+        mthpc_rcu_tree_del(node);
+    /* The usr node might keep the phase bit, it's idle either way. */
+    atomic_store_explicit(&node->gp_seq, 0, memory_order_relaxed);
+    node->data = NULL;
+    node->next_free = data->free_slot;
+    data->free_slot = node->slot;
+    spin_unlock(&data->slot_lock);
 }
+
 void mthpc_rcu_thread_init(void)
 {
     if (mthpc_rcu_node_ptr)
@@ -167,14 +2201,46 @@ void mthpc_rcu_thread_exit(void)
     mthpc_rcu_node_ptr = NULL;
 }
 
+void mthpc_rcu_qsbr_thread_init(void)
+{
+    if (mthpc_rcu_qsbr_node_ptr)
+        return;
+    mthpc_rcu_add(&mthpc_rcu_qsbr_data, (unsigned long)pthread_self(),
+                  &mthpc_rcu_qsbr_node_ptr);
+    mthpc_rcu_thread_online();
+}
+
+void mthpc_rcu_qsbr_thread_exit(void)
+{
+    if (!mthpc_rcu_qsbr_node_ptr)
+        return;
+    mthpc_rcu_thread_offline();
+    mthpc_rcu_del(&mthpc_rcu_qsbr_data, (unsigned long)pthread_self(),
+                  mthpc_rcu_qsbr_node_ptr);
+    mthpc_rcu_qsbr_node_ptr = NULL;
+}
+
 void mthpc_rcu_data_init(struct mthpc_rcu_data *data, unsigned int type)
 {
-    data->head = NULL;
+    for (int i = 0; i < MTHPC_RCU_NR_CHUNK; i++)
+        data->chunk[i] = NULL;
+    data->blocked = NULL;
+    data->nr_slot = 0;
+    data->free_slot = MTHPC_RCU_NO_SLOT;
     data->type = type;
     data->gp_seq = MTHPC_GP_COUNT;
+    data->futex = 0;
+    atomic_init(&data->gp_seq_nr, 0);
+    atomic_init(&data->gp_leader, 0);
+    data->gp_wait = 0;
+    atomic_init(&data->nr_gp_waiter, 0);
+    atomic_init(&data->nr_user, 0);
     spin_lock_init(&data->lock);
+    spin_lock_init(&data->slot_lock);
+    mthpc_rcu_stats_init(data);
 
     spin_lock(&mthpc_rcu_meta.lock);
+    data->id = ++mthpc_rcu_meta.last_id;
     data->next = mthpc_rcu_meta.head;
     mthpc_rcu_meta.head = data;
     spin_unlock(&mthpc_rcu_meta.lock);
@@ -182,20 +2248,10 @@ void mthpc_rcu_data_init(struct mthpc_rcu_data *data, unsigned int type)
 
 static void __mthpc_rcu_data_exit(struct mthpc_rcu_data *data, int is_static)
 {
-    struct mthpc_rcu_node *node, *tmp;
     struct mthpc_rcu_data **indirect;
+    unsigned int chunk, nr;
 
-    spin_lock(&data->lock);
-    node = data->head;
-    while (node) {
-        tmp = node->next;
-        free(node);
-        node = tmp;
-    }
-    data->head = NULL;
-    spin_unlock(&data->lock);
-    spin_lock_destroy(&data->lock);
-
+    /* Unlink first, so no one can find and pin it after. */
     spin_lock(&mthpc_rcu_meta.lock);
     indirect = &mthpc_rcu_meta.head;
     while (*indirect) {
@@ -206,6 +2262,28 @@ static void __mthpc_rcu_data_exit(struct mthpc_rcu_data *data, int is_static)
         indirect = &(*indirect)->next;
     }
     spin_unlock(&mthpc_rcu_meta.lock);
+    while (atomic_load_explicit(&data->nr_user, memory_order_acquire))
+        sched_yield();
+
+    spin_lock(&data->lock);
+    spin_lock(&data->slot_lock);
+    mthpc_rcu_for_each_chunk (data, chunk, nr) {
+        for (unsigned int i = 0; i < nr; i++)
+            mthpc_rcu_cb_orphan(&data->chunk[chunk][i]);
+    }
+    for (chunk = 0; chunk < MTHPC_RCU_NR_CHUNK; chunk++) {
+        free(data->chunk[chunk]);
+        data->chunk[chunk] = NULL;
+    }
+    free(data->blocked);
+    data->blocked = NULL;
+    data->nr_slot = 0;
+    data->free_slot = MTHPC_RCU_NO_SLOT;
+    spin_unlock(&data->slot_lock);
+    spin_unlock(&data->lock);
+    spin_lock_destroy(&data->slot_lock);
+    spin_lock_destroy(&data->lock);
+    mthpc_rcu_stats_exit(data);
 
     if (!is_static)
         free(data);
@@ -218,20 +2296,135 @@ void mthpc_rcu_data_exit(struct mthpc_rcu_data *data)
 
 /* Provide the API to let the other feature can create their own rcu data. */
 
+/* Domain */
+
+/*
+ * The rcu nodes of the thread in all the domains it has used. The
+ * direct-mapped cache in front of it is indexed by the domain id.
+ */
+struct mthpc_rcu_domain_ref {
+    unsigned long id;
+    struct mthpc_rcu_node *node;
+    struct mthpc_rcu_domain_ref *next;
+};
+
+__thread struct mthpc_rcu_domain_cache
+    mthpc_rcu_domain_cache[MTHPC_RCU_DOMAIN_CACHE];
+static __thread struct mthpc_rcu_domain_ref *mthpc_rcu_domain_refs = NULL;
+
+struct mthpc_rcu_node *mthpc_rcu_domain_node_slow(struct mthpc_rcu_data *domain)
+{
+    struct mthpc_rcu_domain_cache *cache;
+    struct mthpc_rcu_domain_ref *ref;
+
+    for (ref = mthpc_rcu_domain_refs; ref; ref = ref->next) {
+        if (ref->id == domain->id)
+            goto found;
+    }
+
+    ref = malloc(sizeof(struct mthpc_rcu_domain_ref));
+    MTHPC_BUG_ON(!ref, "allocation failed");
+    ref->id = domain->id;
+    ref->node = NULL;
+    mthpc_rcu_add(domain, (unsigned long)pthread_self(), &ref->node);
+    MTHPC_BUG_ON(!ref->node, "register to rcu domain failed");
+    ref->next = mthpc_rcu_domain_refs;
+    mthpc_rcu_domain_refs = ref;
+    /* Any non-NULL value lets the destructor run at thread exit. */
+    pthread_setspecific(mthpc_rcu_meta.domain_key, ref);
+
+found:
+    cache = &mthpc_rcu_domain_cache[domain->id & (MTHPC_RCU_DOMAIN_CACHE - 1)];
+    cache->id = ref->id;
+    cache->node = ref->node;
+
+    return ref->node;
+}
+
+/* Skip the domains which have been destroyed. */
+static void mthpc_rcu_domain_thread_exit(void *unused)
+{
+    struct mthpc_rcu_domain_ref *ref, *next;
+    struct mthpc_rcu_data *data;
+
+    for (ref = mthpc_rcu_domain_refs; ref; ref = next) {
+        next = ref->next;
+
+        spin_lock(&mthpc_rcu_meta.lock);
+        for (data = mthpc_rcu_meta.head; data; data = data->next) {
+            if (data->id == ref->id) {
+                atomic_fetch_add_explicit(&data->nr_user, 1,
+                                          memory_order_relaxed);
+                break;
+            }
+        }
+        spin_unlock(&mthpc_rcu_meta.lock);
+
+        if (data) {
+            mthpc_rcu_del(data, (unsigned long)pthread_self(), ref->node);
+            atomic_fetch_sub_explicit(&data->nr_user, 1, memory_order_release);
+        }
+        free(ref);
+    }
+    mthpc_rcu_domain_refs = NULL;
+    memset(mthpc_rcu_domain_cache, 0, sizeof(mthpc_rcu_domain_cache));
+}
+
+struct mthpc_rcu_data *mthpc_rcu_domain_create(void)
+{
+    struct mthpc_rcu_data *domain;
+
+    domain = malloc(sizeof(struct mthpc_rcu_data));
+    if (!domain)
+        return NULL;
+    mthpc_rcu_data_init(domain, MTHPC_RCU_USR);
+
+    return domain;
+}
+
+void mthpc_rcu_domain_destroy(struct mthpc_rcu_data *domain)
+{
+    mthpc_rcu_data_exit(domain);
+}
+
+void mthpc_synchronize_rcu_domain(struct mthpc_rcu_data *domain)
+{
+    mthpc_synchronize_rcu_internal(domain);
+}
+
 static void __mthpc_init mthpc_rcu_init(void)
 {
     mthpc_init_feature();
+    mthpc_rcu_membarrier_init();
+    mthpc_rcu_signal_init();
+#ifdef MTHPC_RCU_SCAN_AVX2
+    mthpc_rcu_has_avx2 = __builtin_cpu_supports("avx2");
+#endif
     mthpc_rcu_meta.head = NULL;
+    mthpc_rcu_meta.last_id = 0;
     spin_lock_init(&mthpc_rcu_meta.lock);
+    MTHPC_BUG_ON(pthread_key_create(&mthpc_rcu_meta.domain_key,
+                                    mthpc_rcu_domain_thread_exit),
+                 "create rcu domain key failed");
     mthpc_rcu_data_init(&mthpc_rcu_data, MTHPC_RCU_USR);
+    mthpc_rcu_data_init(&mthpc_rcu_qsbr_data, MTHPC_RCU_QSBR);
+    mthpc_rcu_tree_init(&mthpc_rcu_data);
+    mthpc_rcu_gp_thread_init();
+    mthpc_rcu_percpu_init();
     mthpc_init_ok();
 }
 
 static void __mthpc_exit mthpc_rcu_exit(void)
 {
     mthpc_exit_feature();
+    mthpc_rcu_barrier();
+    mthpc_rcu_gp_thread_exit();
     mthpc_synchronize_rcu_all();
+    mthpc_rcu_tree_exit();
+    mthpc_rcu_percpu_exit();
+    __mthpc_rcu_data_exit(&mthpc_rcu_qsbr_data, 1);
     __mthpc_rcu_data_exit(&mthpc_rcu_data, 1);
+    pthread_key_delete(mthpc_rcu_meta.domain_key);
     spin_lock_destroy(&mthpc_rcu_meta.lock);
     mthpc_exit_ok();
 }
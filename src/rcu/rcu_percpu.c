@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <mthpc/rcu_percpu.h>
+#include <mthpc/rcu.h>
+#include <mthpc/spinlock.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+
+#include <internal/rcu.h>
+#include <internal/srcu.h>
+#include <internal/rseq.h>
+
+/*
+ * The readers are counted in the per-CPU counters of srcu, and the update
+ * side is the same as srcu except the barrier, see internal/srcu.h.
+ */
+struct mthpc_rcu_percpu_data {
+    /* sp.cpu[nr_cpu] is for the reader we can't get the cpu id. */
+    struct mthpc_srcu_struct sp;
+    unsigned int nr_cpu;
+    bool use_rseq;
+};
+static struct mthpc_rcu_percpu_data mthpc_rcu_percpu;
+
+/*
+ * TSan doesn't understand the fences around the counters. The debug build
+ * never uses rseq, so release the unlock counter, which the scan acquires.
+ */
+#ifdef CONFIG_DEBUG
+#define MTHPC_RCU_PERCPU_INC_ORDER memory_order_release
+#else
+#define MTHPC_RCU_PERCPU_INC_ORDER memory_order_relaxed
+#endif
+
+static __thread unsigned int mthpc_rcu_percpu_nesting;
+static __thread int mthpc_rcu_percpu_idx;
+
+/* Read side */
+
+static __always_inline atomic_ulong *
+mthpc_rcu_percpu_counter(unsigned int cpu, bool unlock, int idx)
+{
+    struct mthpc_srcu_cpu *pcpu = &mthpc_rcu_percpu.sp.cpu[cpu];
+
+    return unlock ? &pcpu->unlock_count[idx] : &pcpu->lock_count[idx];
+}
+
+/*
+ * Only the threads running on the CPU increase its counter in the rseq, so
+ * the plain add is enough. The updater only cares about the sum of the
+ * counters, so it's fine to migrate between the lock and the unlock.
+ */
+static __always_inline void mthpc_rcu_percpu_inc(bool unlock, int idx)
+{
+    unsigned int cpu;
+    int ret;
+
+#ifdef MTHPC_HAVE_RSEQ
+    if (likely(mthpc_rcu_percpu.use_rseq)) {
+        for (;;) {
+            cpu = mthpc_rseq_cpu_id();
+            if (unlikely(cpu >= mthpc_rcu_percpu.nr_cpu))
+                break;
+            if (likely(!mthpc_rseq_addv(
+                    (unsigned long *)mthpc_rcu_percpu_counter(cpu, unlock, idx),
+                    1, cpu)))
+                return;
+        }
+        atomic_fetch_add_explicit(
+            mthpc_rcu_percpu_counter(mthpc_rcu_percpu.nr_cpu, unlock, idx), 1,
+            memory_order_relaxed);
+        return;
+    }
+#endif
+
+    ret = sched_getcpu();
+    cpu = (ret < 0) ? mthpc_rcu_percpu.nr_cpu :
+                      (unsigned int)ret % mthpc_rcu_percpu.nr_cpu;
+    atomic_fetch_add_explicit(mthpc_rcu_percpu_counter(cpu, unlock, idx), 1,
+                              MTHPC_RCU_PERCPU_INC_ORDER);
+}
+
+/* Pair with mthpc_rcu_smp_mb_master_internal() on the update side. */
+static __always_inline void mthpc_rcu_percpu_mb(void)
+{
+    if (likely(mthpc_rcu_has_sys_membarrier))
+        mthpc_cmb();
+    else
+        smp_mb();
+}
+
+void mthpc_rcu_percpu_read_lock(void)
+{
+    int idx;
+
+    if (mthpc_rcu_percpu_nesting++)
+        return;
+
+    idx = atomic_load_explicit(&mthpc_rcu_percpu.sp.idx,
+                               memory_order_relaxed) &
+          0x1;
+    mthpc_rcu_percpu_idx = idx;
+    mthpc_rcu_percpu_inc(false, idx);
+    /* Order the counter before the critical section. */
+    mthpc_rcu_percpu_mb();
+}
+
+void mthpc_rcu_percpu_read_unlock(void)
+{
+    MTHPC_WARN_ON(!mthpc_rcu_percpu_nesting, "unbalanced percpu unlock");
+    if (--mthpc_rcu_percpu_nesting)
+        return;
+
+    /* Order the critical section before the counter. */
+    mthpc_rcu_percpu_mb();
+    mthpc_rcu_percpu_inc(true, mthpc_rcu_percpu_idx);
+}
+
+/* Grace period */
+
+/* The readers only have the compiler barrier if we have membarrier. */
+void mthpc_synchronize_rcu_percpu(void)
+{
+    mthpc_synchronize_srcu_internal(&mthpc_rcu_percpu.sp,
+                                    mthpc_rcu_smp_mb_master_internal);
+}
+
+/* init/exit, called by the rcu feature */
+
+void mthpc_rcu_percpu_init(void)
+{
+    long nr_cpu;
+
+    nr_cpu = sysconf(_SC_NPROCESSORS_CONF);
+    mthpc_rcu_percpu.nr_cpu = (nr_cpu < 1) ? 1 : nr_cpu;
+    mthpc_srcu_init_internal(&mthpc_rcu_percpu.sp,
+                             mthpc_rcu_percpu.nr_cpu + 1);
+#ifdef MTHPC_HAVE_RSEQ
+    mthpc_rcu_percpu.use_rseq = mthpc_rseq_available();
+#else
+    mthpc_rcu_percpu.use_rseq = false;
+#endif
+}
+
+void mthpc_rcu_percpu_exit(void)
+{
+    struct mthpc_srcu_struct *sp = &mthpc_rcu_percpu.sp;
+
+    MTHPC_WARN_ON(!mthpc_srcu_readers_done_internal(
+                      sp, 0, mthpc_rcu_smp_mb_master_internal) ||
+                      !mthpc_srcu_readers_done_internal(
+                          sp, 1, mthpc_rcu_smp_mb_master_internal),
+                  "exit percpu rcu with the active readers");
+    spin_lock_destroy(&sp->lock);
+    free(sp->cpu);
+    sp->cpu = NULL;
+}
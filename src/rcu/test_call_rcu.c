@@ -0,0 +1,79 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+#define NR_READER 32
+#define NR_WRITER 4
+#define NR_UPDATE 100
+
+struct test {
+    int val;
+    struct mthpc_rcu_head rcu;
+};
+
+static struct test *data;
+static atomic_int nr_freed;
+
+static void free_test(struct mthpc_rcu_head *head)
+{
+    struct test *tmp = container_of(head, struct test, rcu);
+
+    /* Poison it, so the reader will catch the use-after-free. */
+    tmp->val = -1;
+    free(tmp);
+    atomic_fetch_add_explicit(&nr_freed, 1, memory_order_relaxed);
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    struct test *tmp;
+
+    for (int i = 0; i < NR_UPDATE; i++) {
+        mthpc_rcu_read_lock();
+        tmp = mthpc_rcu_dereference(data);
+        MTHPC_BUG_ON(tmp->val < 0, "read the freed object");
+        mthpc_rcu_read_unlock();
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    struct test *old, *tmp;
+
+    for (int i = 0; i < NR_UPDATE; i++) {
+        tmp = malloc(sizeof(struct test));
+        MTHPC_BUG_ON(!tmp, "malloc");
+        tmp->val = i;
+        old = mthpc_rcu_replace_pointer(data, tmp);
+        mthpc_call_rcu(&old->rcu, free_test);
+    }
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, NR_WRITER, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+
+    data = malloc(sizeof(struct test));
+    MTHPC_BUG_ON(!data, "allocation failed");
+    data->val = 0;
+
+    mthpc_thread_run(&threads);
+
+    /* The callbacks are asynchronous, wait for the gp thread. */
+    mthpc_rcu_barrier();
+    MTHPC_BUG_ON(atomic_load_explicit(&nr_freed, memory_order_relaxed) !=
+                     NR_WRITER * NR_UPDATE,
+                 "rcu barrier returned before the callbacks");
+
+    free(data);
+
+    return 0;
+}
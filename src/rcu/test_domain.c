@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+#define NR_READER 16
+#define NR_UPDATE 50
+
+struct test {
+    int val;
+};
+
+static struct mthpc_rcu_data *domain_a, *domain_b;
+static struct test *data_a, *data_b;
+static atomic_int blocker_in, blocker_out;
+
+static void domain_read(struct mthpc_rcu_data *domain, struct test **p)
+{
+    struct test *tmp;
+
+    mthpc_rcu_domain_read_lock(domain);
+    tmp = mthpc_rcu_dereference(*p);
+    MTHPC_BUG_ON(tmp->val < 0, "read the freed data");
+    mthpc_rcu_domain_read_unlock(domain);
+}
+
+static void domain_update(struct mthpc_rcu_data *domain, struct test **p,
+                          int val)
+{
+    struct test *old, *new;
+
+    new = malloc(sizeof(struct test));
+    MTHPC_BUG_ON(!new, "allocation failed");
+    new->val = val;
+    old = mthpc_rcu_replace_pointer(*p, new);
+    mthpc_synchronize_rcu_domain(domain);
+    old->val = -1;
+    free(old);
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    for (int i = 0; i < NR_UPDATE; i++) {
+        domain_read(domain_a, &data_a);
+        /* Nested in the other domain. */
+        mthpc_rcu_domain_read_lock(domain_b);
+        domain_read(domain_a, &data_a);
+        mthpc_rcu_domain_read_unlock(domain_b);
+        domain_read(domain_b, &data_b);
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    for (int i = 0; i < NR_UPDATE; i++) {
+        domain_update(domain_a, &data_a, i + 1);
+        domain_update(domain_b, &data_b, i + 1);
+    }
+}
+
+/* Stay in the critical section of domain a until the main thread is done. */
+void block_func(struct mthpc_thread_group *unused)
+{
+    mthpc_rcu_domain_read_lock(domain_a);
+    atomic_store(&blocker_in, 1);
+    while (!atomic_load(&blocker_out))
+        ;
+    mthpc_rcu_domain_read_unlock(domain_a);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(blocker, 1, NULL, block_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+
+    domain_a = mthpc_rcu_domain_create();
+    domain_b = mthpc_rcu_domain_create();
+    data_a = malloc(sizeof(struct test));
+    data_b = malloc(sizeof(struct test));
+    MTHPC_BUG_ON(!domain_a || !domain_b || !data_a || !data_b,
+                 "allocation failed");
+    data_a->val = 0;
+    data_b->val = 0;
+
+    mthpc_thread_run(&threads);
+    mthpc_synchronize_rcu_all();
+
+    /* The long reader of domain a doesn't delay domain b. */
+    mthpc_thread_async_run(&blocker);
+    while (!atomic_load(&blocker_in))
+        ;
+    domain_update(domain_b, &data_b, 0);
+    atomic_store(&blocker_out, 1);
+    mthpc_thread_async_wait(&blocker);
+
+    mthpc_rcu_domain_destroy(domain_b);
+    mthpc_synchronize_rcu_all();
+    mthpc_rcu_domain_destroy(domain_a);
+    free(data_a);
+    free(data_b);
+
+    return 0;
+}
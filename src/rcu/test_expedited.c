@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/print.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+/*
+ * Without any reader in the critical section, the expedited grace period
+ * returns without running the normal one, so the cookie taken before it
+ * stays pending. With the reader in the critical section, it falls back to
+ * the normal grace period and waits for the reader. At last, the writer
+ * frees the data after the expedited grace periods under the readers.
+ */
+
+#define NR_READER 8
+#define NR_WRITE 100
+
+static int *data;
+static atomic_int done;
+
+/* The reader which main puts in and out of the critical section. */
+
+static atomic_int reader_state;
+
+enum { READER_IDLE, READER_IN, READER_LEAVE, READER_EXIT };
+
+static void wait_state(int state)
+{
+    while (atomic_load(&reader_state) != state)
+        sched_yield();
+}
+
+static void *hold_thread(void *unused)
+{
+    int state;
+
+    /* Register to rcu first, the fast path still has to skip us. */
+    mthpc_rcu_read_lock();
+    mthpc_rcu_read_unlock();
+    atomic_store(&reader_state, READER_IDLE);
+
+    for (;;) {
+        while ((state = atomic_load(&reader_state)) == READER_IDLE)
+            sched_yield();
+        if (state == READER_EXIT)
+            break;
+        mthpc_rcu_read_lock();
+        /* Tell main we're in, then hold until it asks us to leave. */
+        atomic_store(&reader_state, READER_IDLE);
+        wait_state(READER_LEAVE);
+        mthpc_rcu_read_unlock();
+        atomic_store(&reader_state, READER_IDLE);
+    }
+    return NULL;
+}
+
+static atomic_int expedited_done;
+
+static void *expedited_thread(void *unused)
+{
+    mthpc_synchronize_rcu_expedited();
+    atomic_store(&expedited_done, 1);
+    return NULL;
+}
+
+static void sleep_1ms(void)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+    while (nanosleep(&ts, &ts))
+        ;
+}
+
+static void test_fast_path(void)
+{
+    unsigned long cookie;
+
+    cookie = mthpc_get_state_synchronize_rcu();
+    mthpc_synchronize_rcu_expedited();
+    MTHPC_BUG_ON(mthpc_poll_state_synchronize_rcu(cookie),
+                 "expedited ran the normal grace period without reader");
+}
+
+static void test_fallback(void)
+{
+    pthread_t thread;
+    unsigned long cookie;
+
+    atomic_store(&reader_state, READER_IN);
+    wait_state(READER_IDLE);
+
+    cookie = mthpc_get_state_synchronize_rcu();
+    MTHPC_BUG_ON(pthread_create(&thread, NULL, expedited_thread, NULL),
+                 "create thread failed");
+    for (int i = 0; i < 10; i++) {
+        sleep_1ms();
+        MTHPC_BUG_ON(atomic_load(&expedited_done),
+                     "expedited returned with the reader in the critical "
+                     "section");
+    }
+
+    atomic_store(&reader_state, READER_LEAVE);
+    wait_state(READER_IDLE);
+    pthread_join(thread, NULL);
+    MTHPC_BUG_ON(!mthpc_poll_state_synchronize_rcu(cookie),
+                 "expedited didn't fall back to the normal grace period");
+}
+
+/* The stress part */
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    int *tmp;
+
+    while (!atomic_load(&done)) {
+        mthpc_rcu_read_lock();
+        tmp = mthpc_rcu_dereference(data);
+        MTHPC_BUG_ON(*tmp < 0, "read the freed data");
+        mthpc_rcu_read_unlock();
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    int *old, *tmp;
+
+    for (int i = 0; i < NR_WRITE; i++) {
+        tmp = malloc(sizeof(int));
+        MTHPC_BUG_ON(!tmp, "allocation failed");
+        *tmp = i + 1;
+        old = mthpc_rcu_replace_pointer(data, tmp);
+        mthpc_synchronize_rcu_expedited();
+        *old = -1;
+        free(old);
+    }
+    atomic_store(&done, 1);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+    pthread_t hold;
+
+    atomic_store(&reader_state, READER_IN);
+    MTHPC_BUG_ON(pthread_create(&hold, NULL, hold_thread, NULL),
+                 "create thread failed");
+    wait_state(READER_IDLE);
+
+    test_fast_path();
+    test_fallback();
+
+    atomic_store(&reader_state, READER_EXIT);
+    pthread_join(hold, NULL);
+
+    data = malloc(sizeof(int));
+    MTHPC_BUG_ON(!data, "allocation failed");
+    *data = 0;
+
+    mthpc_thread_run(&threads);
+
+    free(data);
+    mthpc_print("rcu expedited test: PASS\n");
+
+    return 0;
+}
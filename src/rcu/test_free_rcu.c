@@ -0,0 +1,86 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+#define NR_READER 8
+#define NR_WRITER 2
+/* More than one block, so both the full and the partial block are freed. */
+#define NR_UPDATE 1500
+
+/*
+ * The allocator reuses the first words of the freed object, so the reader
+ * will see the broken pair if the object is freed too early.
+ */
+struct test {
+    long val;
+    long check;
+    struct mthpc_rcu_head rcu;
+};
+
+static struct test *data;
+static atomic_int nr_writer_done;
+
+static struct test *test_alloc(long val)
+{
+    struct test *t = malloc(sizeof(struct test));
+
+    MTHPC_BUG_ON(!t, "allocation failed");
+    t->val = val;
+    t->check = ~val;
+    return t;
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    struct test *t;
+
+    while (atomic_load_explicit(&nr_writer_done, memory_order_relaxed) !=
+           NR_WRITER) {
+        mthpc_rcu_read_lock();
+        t = mthpc_rcu_dereference(data);
+        MTHPC_BUG_ON(t->val != ~t->check, "read the freed data");
+        mthpc_rcu_read_unlock();
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    struct test *old;
+
+    for (long i = 0; i < NR_UPDATE; i++) {
+        old = mthpc_rcu_replace_pointer(data, test_alloc(i));
+        mthpc_free_rcu(old, rcu);
+    }
+    atomic_fetch_add(&nr_writer_done, 1);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, NR_WRITER, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+    struct test *old;
+
+    data = test_alloc(-1);
+
+    mthpc_thread_run(&threads);
+
+    /* The partial block is drained by the gp thread after it's idle. */
+    old = mthpc_rcu_replace_pointer(data, test_alloc(-1));
+    mthpc_free_rcu(old, rcu);
+    usleep(100 * 1000);
+
+    /* And the barrier waits for the rest. */
+    old = mthpc_rcu_replace_pointer(data, NULL);
+    mthpc_free_rcu(old, rcu);
+    mthpc_rcu_barrier();
+
+    return 0;
+}
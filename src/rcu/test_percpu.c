@@ -0,0 +1,95 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+#include <mthpc/rcu_percpu.h>
+
+/* The readers are short-lived, create them in waves. */
+#define NR_WAVE 64
+#define NR_READER 8
+#define NR_READ 1000
+
+struct test {
+    long val;
+    long check;
+};
+
+static struct test *data;
+static atomic_int stop;
+
+static struct test *test_alloc(long val)
+{
+    struct test *t = malloc(sizeof(struct test));
+
+    MTHPC_BUG_ON(!t, "allocation failed");
+    t->val = val;
+    t->check = ~val;
+    return t;
+}
+
+static void test_free(struct test *t)
+{
+    t->check = t->val;
+    free(t);
+}
+
+static void *read_func(void *unused)
+{
+    struct test *t;
+
+    for (int i = 0; i < NR_READ; i++) {
+        mthpc_rcu_percpu_read_lock();
+        t = mthpc_rcu_dereference(data);
+        MTHPC_BUG_ON(t->val != ~t->check, "read the freed data");
+        /* Nested critical section only counts once. */
+        mthpc_rcu_percpu_read_lock();
+        MTHPC_BUG_ON(mthpc_rcu_dereference(data)->val < 0, "broken data");
+        mthpc_rcu_percpu_read_unlock();
+        MTHPC_BUG_ON(t->val != ~t->check, "read the freed data");
+        mthpc_rcu_percpu_read_unlock();
+    }
+
+    return NULL;
+}
+
+static void *write_func(void *unused)
+{
+    struct test *old;
+    long i = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        old = mthpc_rcu_replace_pointer(data, test_alloc(i++));
+        mthpc_synchronize_rcu_percpu();
+        test_free(old);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t readers[NR_READER], writer;
+
+    data = test_alloc(0);
+
+    MTHPC_BUG_ON(pthread_create(&writer, NULL, write_func, NULL),
+                 "pthread_create failed");
+    for (int i = 0; i < NR_WAVE; i++) {
+        for (int j = 0; j < NR_READER; j++)
+            MTHPC_BUG_ON(pthread_create(&readers[j], NULL, read_func, NULL),
+                         "pthread_create failed");
+        for (int j = 0; j < NR_READER; j++)
+            pthread_join(readers[j], NULL);
+    }
+    atomic_store(&stop, 1);
+    pthread_join(writer, NULL);
+
+    /* No reader, the grace period should end at once. */
+    mthpc_synchronize_rcu_percpu();
+    test_free(data);
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+
+#include <mthpc/debug.h>
+#include <mthpc/print.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+/*
+ * The reader thread holds the read-side critical section, so the cookie
+ * taken meanwhile can't be done. After it leaves, the cookie is done once
+ * the grace period ends, by mthpc_synchronize_rcu() or by the gp thread for
+ * mthpc_start_poll_synchronize_rcu().
+ */
+
+/* Poll for at most NR_POLL * 1ms. */
+#define NR_POLL 10000
+
+static atomic_int reader_state;
+
+enum { READER_IDLE, READER_IN, READER_LEAVE, READER_EXIT };
+
+static void wait_state(int state)
+{
+    while (atomic_load(&reader_state) != state)
+        sched_yield();
+}
+
+static void *read_thread(void *unused)
+{
+    int state;
+
+    for (;;) {
+        while ((state = atomic_load(&reader_state)) == READER_IDLE)
+            sched_yield();
+        if (state == READER_EXIT)
+            break;
+        mthpc_rcu_read_lock();
+        /* Tell main we're in, then hold until it asks us to leave. */
+        atomic_store(&reader_state, READER_IDLE);
+        wait_state(READER_LEAVE);
+        mthpc_rcu_read_unlock();
+        atomic_store(&reader_state, READER_IDLE);
+    }
+    return NULL;
+}
+
+static void reader_enter(void)
+{
+    atomic_store(&reader_state, READER_IN);
+    wait_state(READER_IDLE);
+}
+
+static void reader_leave(void)
+{
+    atomic_store(&reader_state, READER_LEAVE);
+    wait_state(READER_IDLE);
+}
+
+static void sleep_1ms(void)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+    while (nanosleep(&ts, &ts))
+        ;
+}
+
+static void test_get_state(void)
+{
+    unsigned long cookie;
+
+    cookie = mthpc_get_state_synchronize_rcu();
+    MTHPC_BUG_ON(mthpc_poll_state_synchronize_rcu(cookie),
+                 "cookie done before the grace period");
+    mthpc_synchronize_rcu();
+    MTHPC_BUG_ON(!mthpc_poll_state_synchronize_rcu(cookie),
+                 "cookie not done after synchronize_rcu");
+
+    /* The same with the reader in the critical section. */
+    reader_enter();
+    cookie = mthpc_get_state_synchronize_rcu();
+    sleep_1ms();
+    MTHPC_BUG_ON(mthpc_poll_state_synchronize_rcu(cookie),
+                 "cookie done with the reader in the critical section");
+    reader_leave();
+    mthpc_synchronize_rcu();
+    MTHPC_BUG_ON(!mthpc_poll_state_synchronize_rcu(cookie),
+                 "cookie not done after synchronize_rcu");
+}
+
+static void test_start_poll(void)
+{
+    unsigned long cookie;
+    int i;
+
+    reader_enter();
+    cookie = mthpc_start_poll_synchronize_rcu();
+    /* Give the gp thread the chance to (wrongly) finish it. */
+    for (i = 0; i < 10; i++) {
+        sleep_1ms();
+        MTHPC_BUG_ON(mthpc_poll_state_synchronize_rcu(cookie),
+                     "cookie done with the reader in the critical section");
+    }
+    reader_leave();
+
+    /* No one else runs the grace period, the gp thread should do it. */
+    for (i = 0; i < NR_POLL; i++) {
+        if (mthpc_poll_state_synchronize_rcu(cookie))
+            break;
+        sleep_1ms();
+    }
+    MTHPC_BUG_ON(i == NR_POLL, "gp thread didn't finish the cookie");
+}
+
+static void test_cond(void)
+{
+    unsigned long cookie;
+
+    cookie = mthpc_get_state_synchronize_rcu();
+    mthpc_cond_synchronize_rcu(cookie);
+    MTHPC_BUG_ON(!mthpc_poll_state_synchronize_rcu(cookie),
+                 "cookie not done after cond_synchronize_rcu");
+    /* The done cookie returns at once. */
+    mthpc_cond_synchronize_rcu(cookie);
+}
+
+int main(void)
+{
+    pthread_t reader;
+
+    MTHPC_BUG_ON(pthread_create(&reader, NULL, read_thread, NULL),
+                 "create thread failed");
+
+    test_get_state();
+    test_start_poll();
+    test_cond();
+
+    atomic_store(&reader_state, READER_EXIT);
+    pthread_join(reader, NULL);
+
+    mthpc_print("rcu polled grace period test: PASS\n");
+
+    return 0;
+}
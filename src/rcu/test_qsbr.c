@@ -0,0 +1,73 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#define CONFIG_MTHPC_RCU_QSBR
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+#define NR_READER 32
+#define NR_LOOP 1000
+#define NR_UPDATE 10
+
+static int *data;
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    int *tmp;
+
+    mthpc_rcu_thread_init();
+    for (int i = 0; i < NR_LOOP; i++) {
+        mthpc_rcu_read_lock();
+        tmp = mthpc_rcu_dereference(data);
+        MTHPC_BUG_ON(*tmp < 0, "read the freed object");
+        mthpc_rcu_read_unlock();
+        mthpc_rcu_quiescent_state();
+    }
+    mthpc_rcu_thread_exit();
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    int *old, *tmp;
+
+    for (int i = 0; i < NR_UPDATE; i++) {
+        tmp = malloc(sizeof(int));
+        MTHPC_BUG_ON(!tmp, "malloc");
+        *tmp = i;
+        old = mthpc_rcu_replace_pointer(data, tmp);
+        mthpc_synchronize_rcu();
+        *old = -1;
+        free(old);
+    }
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+
+    data = malloc(sizeof(int));
+    MTHPC_BUG_ON(!data, "allocation failed");
+    *data = 0;
+
+    /* The main thread is online, it should be fine to synchronize. */
+    mthpc_rcu_thread_init();
+    mthpc_synchronize_rcu();
+    mthpc_rcu_thread_offline();
+
+    mthpc_thread_run(&threads);
+
+    /*
+     * Stay online. Both mthpc_synchronize_rcu_all() and the one in the
+     * exit function shouldn't wait for our quiescent state.
+     */
+    mthpc_rcu_thread_online();
+    mthpc_synchronize_rcu_all();
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+#include <mthpc/rculist.h>
+
+#define NR_READER 8
+#define NR_BUCKET 16
+#define NR_NODE 256
+#define NR_UPDATE 200
+#define NR_SPLICE 64
+
+struct test {
+    int key;
+    int val;
+    struct mthpc_hlist_node hnode;
+    struct mthpc_list_head node;
+};
+
+static struct mthpc_hlist_head table[NR_BUCKET];
+static struct mthpc_list_head list_a, list_b;
+static atomic_int stop;
+
+static struct test *test_alloc(int key, int val)
+{
+    struct test *t = malloc(sizeof(struct test));
+
+    MTHPC_BUG_ON(!t, "allocation failed");
+    t->key = key;
+    t->val = val;
+    return t;
+}
+
+static void test_free(struct test *t)
+{
+    t->val = -1;
+    free(t);
+}
+
+static void read_table(void)
+{
+    struct test *t;
+
+    mthpc_rcu_read_lock();
+    for (int i = 0; i < NR_BUCKET; i++) {
+        mthpc_hlist_for_each_entry_rcu_prefetch (t, &table[i], hnode) {
+            MTHPC_BUG_ON(t->val < 0, "read the freed data");
+            MTHPC_BUG_ON(t->key % NR_BUCKET != i, "wrong bucket");
+        }
+    }
+    mthpc_rcu_read_unlock();
+}
+
+/* The traversal should always end at the head even if the list is moved. */
+static void read_list(struct mthpc_list_head *head)
+{
+    struct test *t;
+    int nr = 0;
+
+    mthpc_rcu_read_lock();
+    mthpc_list_for_each_entry_rcu_prefetch (t, head, node) {
+        MTHPC_BUG_ON(t->val < 0, "read the freed data");
+        MTHPC_BUG_ON(++nr > NR_SPLICE * 2, "lost the list head");
+    }
+    mthpc_rcu_read_unlock();
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        read_table();
+        read_list(&list_a);
+        read_list(&list_b);
+    }
+}
+
+static void update_table(int round)
+{
+    struct test *t, *new;
+    int key = round % NR_NODE;
+
+    mthpc_hlist_for_each_entry (t, &table[key % NR_BUCKET], hnode) {
+        if (t->key == key)
+            break;
+    }
+    MTHPC_BUG_ON(!t, "lost the key");
+
+    switch (round % 3) {
+    case 0:
+        new = test_alloc(key, round);
+        mthpc_hlist_replace_rcu(&t->hnode, &new->hnode);
+        break;
+    case 1:
+        new = test_alloc(key, round);
+        mthpc_hlist_add_before_rcu(&new->hnode, &t->hnode);
+        mthpc_hlist_del_rcu(&t->hnode);
+        break;
+    default:
+        new = test_alloc(key, round);
+        mthpc_hlist_add_behind_rcu(&new->hnode, &t->hnode);
+        mthpc_hlist_del_rcu(&t->hnode);
+        break;
+    }
+    mthpc_synchronize_rcu();
+    test_free(t);
+}
+
+static void update_list(int round)
+{
+    struct mthpc_list_head staging;
+    struct test *t, *new;
+
+    /* Build the chain privately, then publish it with one store. */
+    mthpc_list_init(&staging);
+    for (int i = 0; i < NR_SPLICE; i++)
+        mthpc_list_add_tail(&test_alloc(i, round)->node, &staging);
+    mthpc_list_splice_tail_init_rcu(&staging, &list_a, mthpc_synchronize_rcu);
+    MTHPC_BUG_ON(!mthpc_list_empty(&staging), "staging isn't empty");
+
+    t = mthpc_list_entry(list_a.next, struct test, node);
+    new = test_alloc(t->key, round);
+    mthpc_list_replace_rcu(&t->node, &new->node);
+    mthpc_synchronize_rcu();
+    test_free(t);
+
+    /* Move the list under the readers. */
+    mthpc_list_splice_init_rcu(&list_a, &list_b, mthpc_synchronize_rcu);
+    MTHPC_BUG_ON(!mthpc_list_empty(&list_a), "list_a isn't empty");
+
+    while (!mthpc_list_empty(&list_b)) {
+        t = mthpc_list_entry(list_b.next, struct test, node);
+        mthpc_list_del_rcu(&t->node);
+        mthpc_synchronize_rcu();
+        test_free(t);
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    for (int i = 0; i < NR_UPDATE; i++) {
+        update_table(i);
+        if (i % (NR_UPDATE / 4) == 0)
+            update_list(i);
+    }
+    atomic_store(&stop, 1);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+    struct mthpc_hlist_node *tmp;
+    struct test *t;
+    int nr = 0;
+
+    for (int i = 0; i < NR_BUCKET; i++)
+        mthpc_hlist_init(&table[i]);
+    mthpc_list_init(&list_a);
+    mthpc_list_init(&list_b);
+    for (int i = 0; i < NR_NODE; i++) {
+        t = test_alloc(i, 0);
+        mthpc_hlist_add_head_rcu(&t->hnode, &table[i % NR_BUCKET]);
+    }
+
+    mthpc_thread_run(&threads);
+
+    for (int i = 0; i < NR_BUCKET; i++) {
+        while (!mthpc_hlist_empty(&table[i])) {
+            tmp = table[i].first;
+            mthpc_hlist_del(tmp);
+            test_free(mthpc_hlist_entry(tmp, struct test, hnode));
+            nr++;
+        }
+    }
+    MTHPC_BUG_ON(nr != NR_NODE, "wrong number of nodes");
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/print.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+/*
+ * Build the library with rcu_signal=1, otherwise the test runs with the
+ * membarrier flavor.
+ *
+ * The readers keep checking the data while the short-lived threads
+ * register to and unregister from the reader list during the grace
+ * periods.
+ */
+
+#define NR_READER 8
+#define NR_CHURN 4
+#define NR_CHURN_THREAD 64
+#define NR_WRITE 50
+
+static int *data;
+static atomic_int done;
+
+static void read_once(void)
+{
+    int *tmp;
+
+    mthpc_rcu_read_lock();
+    tmp = mthpc_rcu_dereference(data);
+    MTHPC_BUG_ON(*tmp < 0, "read the freed data");
+    mthpc_rcu_read_unlock();
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    while (!atomic_load(&done))
+        read_once();
+}
+
+static void *churn_thread(void *unused)
+{
+    for (int i = 0; i < 16; i++)
+        read_once();
+    return NULL;
+}
+
+void churn_func(struct mthpc_thread_group *unused)
+{
+    pthread_t thread;
+
+    for (int i = 0; i < NR_CHURN_THREAD; i++) {
+        MTHPC_BUG_ON(pthread_create(&thread, NULL, churn_thread, NULL),
+                     "create thread failed");
+        pthread_join(thread, NULL);
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    int *old, *tmp;
+
+    for (int i = 0; i < NR_WRITE; i++) {
+        tmp = malloc(sizeof(int));
+        MTHPC_BUG_ON(!tmp, "allocation failed");
+        *tmp = i + 1;
+        old = mthpc_rcu_replace_pointer(data, tmp);
+        mthpc_synchronize_rcu();
+        *old = -1;
+        free(old);
+    }
+    atomic_store(&done, 1);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(churn, NR_CHURN, NULL, churn_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &churn, &writer);
+
+    data = malloc(sizeof(int));
+    MTHPC_BUG_ON(!data, "allocation failed");
+    *data = 0;
+
+    mthpc_thread_run(&threads);
+
+    free(data);
+    mthpc_print("rcu %s flavor test: PASS\n",
+                mthpc_rcu_reader_cmb_only() ? "compiler barrier" : "smp_mb");
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/print.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+/*
+ * Each wave registers NR_WAVE_THREAD readers at the same time, well over
+ * MTHPC_RCU_SLOT_BASE and the 64-node scan window, and unregisters them
+ * while the writer keeps running grace periods. The first wave grows the
+ * slot chunks, the later waves reuse the freed slots.
+ *
+ * Before that, the threads register and unregister while the grace period
+ * is waiting for the long reader, they shouldn't wait for it.
+ */
+
+#define NR_READER 2
+#define NR_WAVE 8
+#define NR_WAVE_THREAD 200
+#define NR_WAVE_READ 16
+
+static int *data;
+static atomic_int done;
+static pthread_barrier_t wave_barrier;
+static atomic_int hold_in, hold_out, gp_done;
+
+static void read_once(void)
+{
+    int *tmp;
+
+    mthpc_rcu_read_lock();
+    tmp = mthpc_rcu_dereference(data);
+    MTHPC_BUG_ON(*tmp < 0, "read the freed data");
+    mthpc_rcu_read_unlock();
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    while (!atomic_load(&done))
+        read_once();
+}
+
+static void *wave_thread(void *unused)
+{
+    read_once();
+    /* All the threads of the wave hold a slot here. */
+    pthread_barrier_wait(&wave_barrier);
+    for (int i = 0; i < NR_WAVE_READ; i++)
+        read_once();
+    return NULL;
+}
+
+void wave_func(struct mthpc_thread_group *unused)
+{
+    pthread_t threads[NR_WAVE_THREAD];
+
+    for (int i = 0; i < NR_WAVE; i++) {
+        for (int j = 0; j < NR_WAVE_THREAD; j++)
+            MTHPC_BUG_ON(pthread_create(&threads[j], NULL, wave_thread, NULL),
+                         "create thread failed");
+        for (int j = 0; j < NR_WAVE_THREAD; j++)
+            pthread_join(threads[j], NULL);
+    }
+    atomic_store(&done, 1);
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    int *old, *tmp;
+    int i = 0;
+
+    while (!atomic_load(&done)) {
+        tmp = malloc(sizeof(int));
+        MTHPC_BUG_ON(!tmp, "allocation failed");
+        *tmp = ++i;
+        old = mthpc_rcu_replace_pointer(data, tmp);
+        mthpc_synchronize_rcu();
+        *old = -1;
+        free(old);
+    }
+}
+
+static void *hold_thread(void *unused)
+{
+    mthpc_rcu_read_lock();
+    atomic_store(&hold_in, 1);
+    while (!atomic_load(&hold_out))
+        sched_yield();
+    mthpc_rcu_read_unlock();
+    return NULL;
+}
+
+static void *gp_thread(void *unused)
+{
+    mthpc_synchronize_rcu();
+    atomic_store(&gp_done, 1);
+    return NULL;
+}
+
+static void *short_thread(void *unused)
+{
+    read_once();
+    return NULL;
+}
+
+static void register_in_gp(void)
+{
+    struct timespec wait = { .tv_nsec = 10 * 1000000L };
+    pthread_t hold, gp, threads[NR_WAVE_THREAD];
+
+    MTHPC_BUG_ON(pthread_create(&hold, NULL, hold_thread, NULL),
+                 "create thread failed");
+    while (!atomic_load(&hold_in))
+        sched_yield();
+    MTHPC_BUG_ON(pthread_create(&gp, NULL, gp_thread, NULL),
+                 "create thread failed");
+    /* Let the grace period start waiting for the reader. */
+    while (nanosleep(&wait, &wait))
+        ;
+
+    /* Register more than one chunk, so the registry grows as well. */
+    for (int j = 0; j < NR_WAVE_THREAD; j++)
+        MTHPC_BUG_ON(pthread_create(&threads[j], NULL, short_thread, NULL),
+                     "create thread failed");
+    for (int j = 0; j < NR_WAVE_THREAD; j++)
+        pthread_join(threads[j], NULL);
+    MTHPC_BUG_ON(atomic_load(&gp_done), "grace period ended with the reader");
+
+    atomic_store(&hold_out, 1);
+    pthread_join(hold, NULL);
+    pthread_join(gp, NULL);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(wave, 1, NULL, wave_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &wave, &writer);
+
+    data = malloc(sizeof(int));
+    MTHPC_BUG_ON(!data, "allocation failed");
+    *data = 0;
+    MTHPC_BUG_ON(pthread_barrier_init(&wave_barrier, NULL, NR_WAVE_THREAD),
+                 "barrier init failed");
+
+    register_in_gp();
+
+    mthpc_thread_run(&threads);
+
+    pthread_barrier_destroy(&wave_barrier);
+    free(data);
+    mthpc_print("rcu slot test: PASS\n");
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/print.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+
+/*
+ * Build the library with rcu_stats=1, otherwise the test only checks that
+ * the snapshot reports the stats is disabled.
+ */
+
+#define NR_GP 10
+#define HOLD_MS 50
+
+static atomic_int blocker_in, blocker_out;
+static atomic_long blocker_tid;
+
+/* Hold the read-side critical section, so we are the slowest reader. */
+void block_func(struct mthpc_thread_group *unused)
+{
+    struct timespec hold = { .tv_nsec = HOLD_MS * 1000000L };
+
+    mthpc_rcu_read_lock();
+    atomic_store(&blocker_tid, syscall(SYS_gettid));
+    atomic_store(&blocker_in, 1);
+    while (!atomic_load(&blocker_out))
+        ;
+    /* The signal flavor interrupts the sleep, sleep for the rest. */
+    while (nanosleep(&hold, &hold))
+        ;
+    mthpc_rcu_read_unlock();
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(blocker, 1, NULL, block_func, NULL);
+
+int main(void)
+{
+    struct mthpc_rcu_stats stats;
+    unsigned long nr_hist = 0;
+
+    mthpc_rcu_thread_init();
+
+    mthpc_thread_async_run(&blocker);
+    while (!atomic_load(&blocker_in))
+        ;
+    atomic_store(&blocker_out, 1);
+    mthpc_synchronize_rcu();
+    mthpc_thread_async_wait(&blocker);
+
+    for (int i = 0; i < NR_GP; i++)
+        mthpc_synchronize_rcu();
+
+    if (mthpc_rcu_stats_snapshot(NULL, &stats)) {
+        mthpc_print("rcu stats is disabled, skip\n");
+        return 0;
+    }
+
+    for (int i = 0; i < MTHPC_RCU_STATS_NR_HIST; i++)
+        nr_hist += stats.gp_hist[i];
+    MTHPC_BUG_ON(stats.nr_gp < NR_GP + 1, "nr_gp %lu", stats.nr_gp);
+    MTHPC_BUG_ON(nr_hist != stats.nr_gp, "histogram %lu", nr_hist);
+    MTHPC_BUG_ON(stats.gp_max_ns < HOLD_MS * 1000000UL, "gp_max %lu",
+                 stats.gp_max_ns);
+    MTHPC_BUG_ON(!stats.nr_scanned || !stats.nr_blocked, "no reader");
+    MTHPC_BUG_ON(stats.wait_max_ns < HOLD_MS * 1000000UL, "wait_max %lu",
+                 stats.wait_max_ns);
+    MTHPC_BUG_ON(stats.slowest_tid != atomic_load(&blocker_tid),
+                 "slowest tid %ld", stats.slowest_tid);
+
+    mthpc_print("gp %lu avg %lu ns max %lu ns, blocked %lu max %lu ns\n",
+                stats.nr_gp, stats.gp_total_ns / stats.nr_gp,
+                stats.gp_max_ns, stats.nr_blocked, stats.wait_max_ns);
+
+    return 0;
+}
@@ -0,0 +1,472 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <mthpc/rculfhash.h>
+#include <mthpc/rcu.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+
+#include <internal/crc32c.h>
+
+#define MTHPC_LFHT_REMOVED 0x1UL
+/* At most 2^MTHPC_LFHT_MAX_ORDER buckets. */
+#define MTHPC_LFHT_MAX_ORDER 32
+#define MTHPC_LFHT_NR_COUNTER 32
+/* Check the load factor every MTHPC_LFHT_COUNT_CHECK adds on the counter. */
+#define MTHPC_LFHT_COUNT_CHECK 64
+/* The number of the dummy nodes inserted by one add helping the resize. */
+#define MTHPC_LFHT_GROW_CHUNK 256
+
+struct mthpc_lfht_counter {
+    atomic_long count;
+} __mthpc_aligned__;
+
+struct mthpc_lfht {
+    /* The number of the buckets in use, power of two. */
+    atomic_ulong size;
+    /*
+     * The buckets, level 0 has bucket 0, and level k (k > 0) has the
+     * buckets [2^(k-1), 2^k). The levels never move or shrink.
+     */
+    _Atomic(struct mthpc_lfht_node *) level[MTHPC_LFHT_MAX_ORDER + 1];
+    atomic_int resizing;
+    /*
+     * The level in progress has the buckets [grow_end / 2, grow_end). The
+     * adders claim the dummy nodes from grow_next by chunk, and grow_done
+     * counts the inserted ones. Both only go forward, so the next level
+     * continues from grow_end.
+     */
+    atomic_ulong grow_next;
+    atomic_ulong grow_done;
+    atomic_ulong grow_end;
+    /* Split counters, avoid bouncing one cache line on every add/del. */
+    struct mthpc_lfht_counter counter[MTHPC_LFHT_NR_COUNTER];
+};
+
+static atomic_uint mthpc_lfht_nr_thread;
+static __thread unsigned int mthpc_lfht_counter_idx;
+static atomic_int mthpc_lfht_has_crc32c = -1;
+
+/* Hash */
+
+uint64_t mthpc_lfht_hash_u64(uint64_t key)
+{
+    int has_crc32c;
+    uint32_t lo, hi;
+
+    has_crc32c =
+        atomic_load_explicit(&mthpc_lfht_has_crc32c, memory_order_relaxed);
+    if (unlikely(has_crc32c < 0)) {
+        has_crc32c = crc32c_hw_supported();
+        atomic_store_explicit(&mthpc_lfht_has_crc32c, has_crc32c,
+                              memory_order_relaxed);
+    }
+
+    if (has_crc32c) {
+        lo = crc32c_u64(0xffffffffU, key);
+        hi = crc32c_u64(0x9e3779b9U, key);
+    } else {
+        lo = crc32c_u64_sw(0xffffffffU, key);
+        hi = crc32c_u64_sw(0x9e3779b9U, key);
+    }
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t mthpc_lfht_hash(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t hash = len, v;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        memcpy(&v, p, sizeof(uint64_t));
+        hash = mthpc_lfht_hash_u64(hash ^ v);
+        p += sizeof(uint64_t);
+    }
+    if (len) {
+        v = 0;
+        memcpy(&v, p, len);
+        hash = mthpc_lfht_hash_u64(hash ^ v);
+    }
+
+    return hash;
+}
+
+/* Split order */
+
+static __always_inline uint64_t mthpc_lfht_bit_reverse(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    return __builtin_bswap64(v);
+}
+
+/*
+ * The regular node has the lowest bit of the reverse hash set, so it is
+ * after the dummy node of its bucket.
+ */
+static __always_inline uint64_t mthpc_lfht_regular_key(uint64_t hash)
+{
+    return mthpc_lfht_bit_reverse(hash | (1ULL << 63));
+}
+
+static __always_inline uint64_t mthpc_lfht_dummy_key(unsigned long bucket)
+{
+    return mthpc_lfht_bit_reverse(bucket);
+}
+
+static __always_inline struct mthpc_lfht_node *
+mthpc_lfht_ptr(uintptr_t next)
+{
+    return (struct mthpc_lfht_node *)(next & ~MTHPC_LFHT_REMOVED);
+}
+
+static __always_inline struct mthpc_lfht_node *
+mthpc_lfht_bucket(struct mthpc_lfht *ht, unsigned long bucket)
+{
+    unsigned int order;
+    struct mthpc_lfht_node *level;
+
+    if (!bucket)
+        return atomic_load_explicit(&ht->level[0], memory_order_acquire);
+    order = 64 - __builtin_clzll(bucket);
+    level = atomic_load_explicit(&ht->level[order], memory_order_acquire);
+
+    return &level[bucket - (1UL << (order - 1))];
+}
+
+static __always_inline struct mthpc_lfht_node *
+mthpc_lfht_bucket_of(struct mthpc_lfht *ht, uint64_t hash)
+{
+    unsigned long size =
+        atomic_load_explicit(&ht->size, memory_order_acquire);
+
+    return mthpc_lfht_bucket(ht, hash & (size - 1));
+}
+
+/*
+ * Find the link to the first node whose reverse hash is not less than
+ * (or greater than, if past is set) so_key, starting from the dummy node.
+ * The removed nodes on the way are unlinked.
+ */
+static struct mthpc_lfht_node *mthpc_lfht_find(struct mthpc_lfht_node *start,
+                                               uint64_t so_key, bool past,
+                                               atomic_uintptr_t **link)
+{
+    struct mthpc_lfht_node *curr;
+    atomic_uintptr_t *prev;
+    uintptr_t next, expected;
+
+retry:
+    prev = &start->next;
+    curr = mthpc_lfht_ptr(atomic_load_explicit(prev, memory_order_acquire));
+    while (curr) {
+        next = atomic_load_explicit(&curr->next, memory_order_acquire);
+        if (next & MTHPC_LFHT_REMOVED) {
+            expected = (uintptr_t)curr;
+            if (!atomic_compare_exchange_strong_explicit(
+                    prev, &expected, next & ~MTHPC_LFHT_REMOVED,
+                    memory_order_acq_rel, memory_order_relaxed))
+                goto retry;
+            curr = mthpc_lfht_ptr(next);
+            continue;
+        }
+        if (past ? curr->reverse_hash > so_key : curr->reverse_hash >= so_key)
+            break;
+        prev = &curr->next;
+        curr = mthpc_lfht_ptr(next);
+    }
+
+    *link = prev;
+    return curr;
+}
+
+/* Link the node before curr, fail if the link has changed. */
+static __always_inline bool mthpc_lfht_link(atomic_uintptr_t *link,
+                                            struct mthpc_lfht_node *curr,
+                                            struct mthpc_lfht_node *node)
+{
+    uintptr_t expected = (uintptr_t)curr;
+
+    atomic_store_explicit(&node->next, (uintptr_t)curr, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(
+        link, &expected, (uintptr_t)node, memory_order_release,
+        memory_order_relaxed);
+}
+
+/* Resize */
+
+/*
+ * Doubling the table inserts the dummy nodes of the whole new level, so we
+ * don't do it inline in one adder. The adder which finds the table
+ * overloaded only allocates the level, and the later adds insert the dummy
+ * nodes by chunk. Each dummy node is inserted after its parent bucket,
+ * which has the same lower bits. The new buckets are only used after the
+ * last chunk publishes the size, so the readers and the updaters keep going
+ * with the old size meanwhile. If no one adds, the resize waits, and the
+ * table is still correct with the higher load factor.
+ */
+static bool mthpc_lfht_grow_start(struct mthpc_lfht *ht)
+{
+    struct mthpc_lfht_node *level;
+    unsigned long size, i;
+    unsigned int order;
+    int expected = 0;
+
+    if (!atomic_compare_exchange_strong_explicit(&ht->resizing, &expected, 1,
+                                                 memory_order_acquire,
+                                                 memory_order_relaxed))
+        return false;
+
+    size = atomic_load_explicit(&ht->size, memory_order_relaxed);
+    order = __builtin_ctzl(size) + 1;
+    if (order > MTHPC_LFHT_MAX_ORDER)
+        goto out;
+    level = malloc(sizeof(struct mthpc_lfht_node) * size);
+    if (!level)
+        goto out;
+    for (i = 0; i < size; i++)
+        level[i].reverse_hash = mthpc_lfht_dummy_key(size + i);
+    atomic_store_explicit(&ht->level[order], level, memory_order_release);
+    /* Open the level to the helpers. */
+    atomic_store_explicit(&ht->grow_end, size << 1, memory_order_release);
+
+    return true;
+
+out:
+    atomic_store_explicit(&ht->resizing, 0, memory_order_release);
+    return false;
+}
+
+/* Insert one chunk of the level in progress, return false if none left. */
+static bool mthpc_lfht_grow_help(struct mthpc_lfht *ht)
+{
+    struct mthpc_lfht_node *parent, *curr, *node;
+    unsigned long start, stop, end, b;
+    atomic_uintptr_t *link;
+
+    end = atomic_load_explicit(&ht->grow_end, memory_order_acquire);
+    start = atomic_load_explicit(&ht->grow_next, memory_order_relaxed);
+    do {
+        if (start >= end)
+            return false;
+        stop = (end - start < MTHPC_LFHT_GROW_CHUNK) ?
+                   end :
+                   start + MTHPC_LFHT_GROW_CHUNK;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &ht->grow_next, &start, stop, memory_order_relaxed,
+        memory_order_relaxed));
+
+    for (b = start; b < stop; b++) {
+        node = mthpc_lfht_bucket(ht, b);
+        parent = mthpc_lfht_bucket(ht, b - (end >> 1));
+        do {
+            curr = mthpc_lfht_find(parent, node->reverse_hash, false, &link);
+        } while (!mthpc_lfht_link(link, curr, node));
+    }
+
+    /* The last chunk publishes the new size. */
+    if (atomic_fetch_add_explicit(&ht->grow_done, stop - start,
+                                  memory_order_acq_rel) +
+            (stop - start) ==
+        end) {
+        atomic_store_explicit(&ht->size, end, memory_order_release);
+        atomic_store_explicit(&ht->resizing, 0, memory_order_release);
+    }
+
+    return true;
+}
+
+static __always_inline struct mthpc_lfht_counter *
+mthpc_lfht_this_counter(struct mthpc_lfht *ht)
+{
+    if (unlikely(!mthpc_lfht_counter_idx))
+        mthpc_lfht_counter_idx = atomic_fetch_add_explicit(
+                                     &mthpc_lfht_nr_thread, 1,
+                                     memory_order_relaxed) +
+                                 1;
+    return &ht->counter[(mthpc_lfht_counter_idx - 1) % MTHPC_LFHT_NR_COUNTER];
+}
+
+static void mthpc_lfht_count_add(struct mthpc_lfht *ht)
+{
+    unsigned long size;
+    long count;
+
+    count = atomic_fetch_add_explicit(&mthpc_lfht_this_counter(ht)->count, 1,
+                                      memory_order_relaxed) +
+            1;
+    if (unlikely(atomic_load_explicit(&ht->resizing, memory_order_relaxed)))
+        mthpc_lfht_grow_help(ht);
+    if (count & (MTHPC_LFHT_COUNT_CHECK - 1))
+        return;
+
+    /* Keep the load factor under one. */
+    size = atomic_load_explicit(&ht->size, memory_order_relaxed);
+    if (mthpc_lfht_count(ht) > (long)size && mthpc_lfht_grow_start(ht))
+        mthpc_lfht_grow_help(ht);
+}
+
+long mthpc_lfht_count(struct mthpc_lfht *ht)
+{
+    long count = 0;
+
+    for (int i = 0; i < MTHPC_LFHT_NR_COUNTER; i++)
+        count += atomic_load_explicit(&ht->counter[i].count,
+                                      memory_order_relaxed);
+
+    return count;
+}
+
+unsigned long mthpc_lfht_size(struct mthpc_lfht *ht)
+{
+    return atomic_load_explicit(&ht->size, memory_order_relaxed);
+}
+
+/* Operations */
+
+struct mthpc_lfht_node *mthpc_lfht_lookup(struct mthpc_lfht *ht,
+                                          uint64_t hash,
+                                          mthpc_lfht_match_fn match,
+                                          const void *key)
+{
+    uint64_t so_key = mthpc_lfht_regular_key(hash);
+    struct mthpc_lfht_node *node;
+    uintptr_t next;
+
+    node = mthpc_lfht_bucket_of(ht, hash);
+    node = mthpc_lfht_ptr(
+        atomic_load_explicit(&node->next, memory_order_consume));
+    for (; node; node = mthpc_lfht_ptr(next)) {
+        next = atomic_load_explicit(&node->next, memory_order_consume);
+        if (node->reverse_hash > so_key)
+            break;
+        if (node->reverse_hash == so_key && !(next & MTHPC_LFHT_REMOVED) &&
+            match(node, key))
+            return node;
+    }
+
+    return NULL;
+}
+
+struct mthpc_lfht_node *mthpc_lfht_add_unique(struct mthpc_lfht *ht,
+                                              uint64_t hash,
+                                              mthpc_lfht_match_fn match,
+                                              const void *key,
+                                              struct mthpc_lfht_node *node)
+{
+    struct mthpc_lfht_node *bucket, *curr, *iter;
+    atomic_uintptr_t *link;
+    uintptr_t next;
+
+    node->reverse_hash = mthpc_lfht_regular_key(hash);
+    bucket = mthpc_lfht_bucket_of(ht, hash);
+
+    /*
+     * The nodes with the same hash are always added at the front of them,
+     * so the concurrent adds of the same key race on the same link.
+     */
+    do {
+        curr = mthpc_lfht_find(bucket, node->reverse_hash, false, &link);
+        for (iter = curr; iter && iter->reverse_hash == node->reverse_hash;
+             iter = mthpc_lfht_ptr(next)) {
+            next = atomic_load_explicit(&iter->next, memory_order_acquire);
+            if (!(next & MTHPC_LFHT_REMOVED) && match(iter, key))
+                return iter;
+        }
+    } while (!mthpc_lfht_link(link, curr, node));
+
+    mthpc_lfht_count_add(ht);
+
+    return node;
+}
+
+int mthpc_lfht_del(struct mthpc_lfht *ht, struct mthpc_lfht_node *node)
+{
+    atomic_uintptr_t *link;
+    uintptr_t next;
+    uint64_t hash;
+
+    /* Logical removal, the add won't link after it anymore. */
+    next = atomic_load_explicit(&node->next, memory_order_relaxed);
+    do {
+        if (next & MTHPC_LFHT_REMOVED)
+            return -1;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &node->next, &next, next | MTHPC_LFHT_REMOVED, memory_order_acq_rel,
+        memory_order_relaxed));
+
+    /*
+     * Walk past all the nodes with the same hash, so the node is unlinked
+     * before we return and can be freed after the grace period.
+     */
+    hash = mthpc_lfht_bit_reverse(node->reverse_hash);
+    mthpc_lfht_find(mthpc_lfht_bucket_of(ht, hash), node->reverse_hash, true,
+                    &link);
+
+    atomic_fetch_sub_explicit(&mthpc_lfht_this_counter(ht)->count, 1,
+                              memory_order_relaxed);
+
+    return 0;
+}
+
+/* init/exit */
+
+struct mthpc_lfht *mthpc_lfht_create(unsigned long init_size)
+{
+    struct mthpc_lfht *ht;
+    unsigned long size = 1;
+
+    ht = aligned_alloc(MTHPC_COHERENCE_SIZE, sizeof(struct mthpc_lfht));
+    if (!ht)
+        return NULL;
+    ht->level[0] = malloc(sizeof(struct mthpc_lfht_node));
+    if (!ht->level[0]) {
+        free(ht);
+        return NULL;
+    }
+    atomic_init(&ht->level[0]->next, 0);
+    ht->level[0]->reverse_hash = mthpc_lfht_dummy_key(0);
+    for (int i = 1; i <= MTHPC_LFHT_MAX_ORDER; i++)
+        atomic_init(&ht->level[i], NULL);
+    atomic_init(&ht->size, 1);
+    atomic_init(&ht->resizing, 0);
+    atomic_init(&ht->grow_next, 1);
+    atomic_init(&ht->grow_done, 1);
+    atomic_init(&ht->grow_end, 1);
+    for (int i = 0; i < MTHPC_LFHT_NR_COUNTER; i++)
+        atomic_init(&ht->counter[i].count, 0);
+
+    while (size < init_size && size < (1UL << MTHPC_LFHT_MAX_ORDER))
+        size <<= 1;
+    /* No one else uses it yet, build the levels at once. */
+    while (mthpc_lfht_size(ht) < size && mthpc_lfht_grow_start(ht)) {
+        while (mthpc_lfht_grow_help(ht))
+            ;
+    }
+
+    return ht;
+}
+
+void mthpc_lfht_destroy(struct mthpc_lfht *ht)
+{
+    struct mthpc_lfht_node *node;
+    uintptr_t next;
+
+    node = mthpc_lfht_ptr(atomic_load(&ht->level[0]->next));
+    for (; node; node = mthpc_lfht_ptr(next)) {
+        next = atomic_load(&node->next);
+        MTHPC_WARN_ON((node->reverse_hash & 0x1) &&
+                          !(next & MTHPC_LFHT_REMOVED),
+                      "destroy the non-empty hash table");
+    }
+
+    for (int i = 0; i <= MTHPC_LFHT_MAX_ORDER; i++)
+        free(ht->level[i]);
+    free(ht);
+}
@@ -0,0 +1,240 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+#include <mthpc/rculfhash.h>
+
+#define NR_READER 8
+#define NR_WRITER 4
+#define NR_KEY 4096
+#define NR_ROUND 4
+
+/*
+ * The resize test, the readers keep looking up the stable keys while the
+ * writers grow the table with the other keys and the deleter removes some
+ * of them. The stable keys are never removed, so the lookup must always
+ * find them, no matter which size the reader sees.
+ */
+#define NR_STABLE_KEY 256
+#define NR_GROW_WRITER 2
+#define NR_GROW_KEY 16384
+
+struct test {
+    unsigned long key;
+    int poison;
+    struct mthpc_lfht_node node;
+    struct mthpc_rcu_head rcu;
+};
+
+static struct mthpc_lfht *ht;
+static atomic_int nr_dup;
+static atomic_int grow_done;
+static atomic_uint grow_writer_id;
+
+static int match(struct mthpc_lfht_node *node, const void *key)
+{
+    struct test *t = mthpc_lfht_entry(node, struct test, node);
+
+    return t->key == *(const unsigned long *)key;
+}
+
+static void free_test(struct mthpc_rcu_head *head)
+{
+    struct test *t = container_of(head, struct test, rcu);
+
+    t->poison = 1;
+    free(t);
+}
+
+static struct test *add(unsigned long key)
+{
+    struct mthpc_lfht_node *ret;
+    struct test *t;
+
+    t = malloc(sizeof(struct test));
+    MTHPC_BUG_ON(!t, "allocation failed");
+    t->key = key;
+    t->poison = 0;
+
+    mthpc_rcu_read_lock();
+    ret = mthpc_lfht_add_unique(ht, mthpc_lfht_hash_u64(key), match, &key,
+                                &t->node);
+    mthpc_rcu_read_unlock();
+    if (ret != &t->node) {
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    struct mthpc_lfht_node *node;
+    struct test *t;
+
+    for (int r = 0; r < NR_ROUND; r++) {
+        for (unsigned long key = 0; key < NR_KEY; key++) {
+            mthpc_rcu_read_lock();
+            node = mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match, &key);
+            if (node) {
+                t = mthpc_lfht_entry(node, struct test, node);
+                MTHPC_BUG_ON(t->key != key, "wrong key");
+                MTHPC_BUG_ON(t->poison, "read the freed node");
+            }
+            mthpc_rcu_read_unlock();
+        }
+    }
+}
+
+/* All the writers add the same keys, only one of them wins. */
+void write_func(struct mthpc_thread_group *unused)
+{
+    struct test *t;
+
+    for (int r = 0; r < NR_ROUND; r++) {
+        for (unsigned long key = 0; key < NR_KEY; key++) {
+            if (!add(key)) {
+                atomic_fetch_add(&nr_dup, 1);
+                continue;
+            }
+        }
+        for (unsigned long key = r & 1; key < NR_KEY; key += 2) {
+            struct mthpc_lfht_node *node;
+
+            mthpc_rcu_read_lock();
+            node = mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match, &key);
+            if (node && !mthpc_lfht_del(ht, node)) {
+                t = mthpc_lfht_entry(node, struct test, node);
+                mthpc_call_rcu(&t->rcu, free_test);
+            }
+            mthpc_rcu_read_unlock();
+        }
+    }
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, NR_WRITER, NULL, write_func, NULL);
+
+static void del_key(unsigned long key)
+{
+    struct mthpc_lfht_node *node;
+    struct test *t;
+
+    mthpc_rcu_read_lock();
+    node = mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match, &key);
+    if (node && !mthpc_lfht_del(ht, node)) {
+        t = mthpc_lfht_entry(node, struct test, node);
+        mthpc_call_rcu(&t->rcu, free_test);
+    }
+    mthpc_rcu_read_unlock();
+}
+
+void grow_read_func(struct mthpc_thread_group *unused)
+{
+    struct mthpc_lfht_node *node;
+    struct test *t;
+
+    while (atomic_load(&grow_done) < NR_GROW_WRITER) {
+        for (unsigned long key = 0; key < NR_STABLE_KEY; key++) {
+            mthpc_rcu_read_lock();
+            node = mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match, &key);
+            MTHPC_BUG_ON(!node, "missed the key %lu while resizing", key);
+            t = mthpc_lfht_entry(node, struct test, node);
+            MTHPC_BUG_ON(t->key != key, "wrong key");
+            MTHPC_BUG_ON(t->poison, "read the freed node");
+            mthpc_rcu_read_unlock();
+        }
+    }
+}
+
+void grow_write_func(struct mthpc_thread_group *unused)
+{
+    unsigned long base =
+        NR_STABLE_KEY + NR_GROW_KEY * atomic_fetch_add(&grow_writer_id, 1);
+
+    for (unsigned long key = base; key < base + NR_GROW_KEY; key++)
+        MTHPC_BUG_ON(!add(key), "key %lu already exists", key);
+    atomic_fetch_add(&grow_done, 1);
+}
+
+/* Remove a quarter of the growing keys while the table is resizing. */
+void grow_del_func(struct mthpc_thread_group *unused)
+{
+    unsigned long end = NR_STABLE_KEY + NR_GROW_KEY * NR_GROW_WRITER;
+
+    while (atomic_load(&grow_done) < NR_GROW_WRITER) {
+        for (unsigned long key = NR_STABLE_KEY; key < end; key += 4)
+            del_key(key);
+    }
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(grow_reader, NR_READER, NULL, grow_read_func,
+                                  NULL);
+static MTHPC_DECLARE_THREAD_GROUP(grow_writer, NR_GROW_WRITER, NULL,
+                                  grow_write_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(grow_deleter, 1, NULL, grow_del_func, NULL);
+
+static void grow_test(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &grow_reader, &grow_writer,
+                                 &grow_deleter);
+
+    ht = mthpc_lfht_create(1);
+    MTHPC_BUG_ON(!ht, "create hash table failed");
+    for (unsigned long key = 0; key < NR_STABLE_KEY; key++)
+        MTHPC_BUG_ON(!add(key), "key %lu already exists", key);
+
+    mthpc_thread_run(&threads);
+
+    MTHPC_BUG_ON(mthpc_lfht_size(ht) < NR_GROW_KEY, "hash table didn't grow");
+    for (unsigned long key = 0;
+         key < NR_STABLE_KEY + NR_GROW_KEY * NR_GROW_WRITER; key++)
+        del_key(key);
+    MTHPC_BUG_ON(mthpc_lfht_count(ht) != 0, "count %ld",
+                 mthpc_lfht_count(ht));
+
+    mthpc_rcu_barrier();
+    mthpc_lfht_destroy(ht);
+}
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+    struct mthpc_lfht_node *node;
+    struct test *t;
+    long count = 0;
+
+    ht = mthpc_lfht_create(1);
+    MTHPC_BUG_ON(!ht, "create hash table failed");
+
+    mthpc_thread_run(&threads);
+
+    for (unsigned long key = 0; key < NR_KEY; key++) {
+        mthpc_rcu_read_lock();
+        node = mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match, &key);
+        if (node) {
+            count++;
+            MTHPC_BUG_ON(mthpc_lfht_del(ht, node), "delete failed");
+            t = mthpc_lfht_entry(node, struct test, node);
+            mthpc_call_rcu(&t->rcu, free_test);
+        }
+        mthpc_rcu_read_unlock();
+    }
+    MTHPC_BUG_ON(count != NR_KEY / 2, "%ld keys left, expected %d", count,
+                 NR_KEY / 2);
+    MTHPC_BUG_ON(mthpc_lfht_count(ht) != 0, "count %ld",
+                 mthpc_lfht_count(ht));
+    MTHPC_BUG_ON(mthpc_lfht_size(ht) < NR_KEY / 2, "hash table didn't grow");
+
+    mthpc_rcu_barrier();
+    mthpc_lfht_destroy(ht);
+
+    grow_test();
+
+    return 0;
+}
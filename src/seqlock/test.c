@@ -0,0 +1,96 @@
+#include <stdatomic.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/seqlock.h>
+
+#define NR_READER 8
+#define NR_WRITER 2
+#define NR_WRITE 10000
+
+/* The pair should always be read as a whole. */
+struct test {
+    long val;
+    long check;
+};
+
+static MTHPC_DEFINE_SEQLOCK(lock);
+static struct test data;
+
+/* The seqcount doesn't serialize the writers, use our own lock. */
+static mthpc_seqcount_t seqcount = MTHPC_SEQCOUNT_INIT;
+static DEFINE_SPINLOCK(seqcount_lock);
+static struct test count_data;
+
+static atomic_int nr_writer_done;
+
+static void read_pair(struct test *t, long *val, long *check)
+{
+    *val = READ_ONCE(t->val);
+    *check = READ_ONCE(t->check);
+}
+
+static void write_pair(struct test *t, long val)
+{
+    WRITE_ONCE(t->val, val);
+    WRITE_ONCE(t->check, ~val);
+}
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    unsigned int seq;
+    long val, check;
+
+    while (atomic_load_explicit(&nr_writer_done, memory_order_acquire) !=
+           NR_WRITER) {
+        do {
+            seq = mthpc_read_seqbegin(&lock);
+            read_pair(&data, &val, &check);
+        } while (mthpc_read_seqretry(&lock, seq));
+        MTHPC_BUG_ON(val != ~check, "seqlock: read the torn data");
+
+        do {
+            seq = mthpc_read_seqcount_begin(&seqcount);
+            read_pair(&count_data, &val, &check);
+        } while (mthpc_read_seqcount_retry(&seqcount, seq));
+        MTHPC_BUG_ON(val != ~check, "seqcount: read the torn data");
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    for (long i = 1; i <= NR_WRITE; i++) {
+        mthpc_write_seqlock(&lock);
+        write_pair(&data, i);
+        mthpc_write_sequnlock(&lock);
+
+        spin_lock(&seqcount_lock);
+        mthpc_write_seqcount_begin(&seqcount);
+        write_pair(&count_data, i);
+        mthpc_write_seqcount_end(&seqcount);
+        spin_unlock(&seqcount_lock);
+    }
+    atomic_fetch_add_explicit(&nr_writer_done, 1, memory_order_release);
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, NR_WRITER, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+
+    write_pair(&data, 0);
+    write_pair(&count_data, 0);
+
+    mthpc_thread_run(&threads);
+
+    /* Every write section bumps the sequence twice. */
+    MTHPC_BUG_ON(lock.seqcount.sequence != NR_WRITER * NR_WRITE * 2,
+                 "wrong seqlock sequence");
+    MTHPC_BUG_ON(seqcount.sequence != NR_WRITER * NR_WRITE * 2,
+                 "wrong seqcount sequence");
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mthpc/srcu.h>
+#include <mthpc/spinlock.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+
+#include <internal/srcu.h>
+
+static __always_inline struct mthpc_srcu_cpu *
+mthpc_srcu_this_cpu(struct mthpc_srcu_struct *sp)
+{
+    int cpu = sched_getcpu();
+
+    /*
+     * We might migrate after this, but the counters are atomic and the
+     * updater only cares about the sum of them.
+     */
+    return &sp->cpu[(cpu < 0) ? 0 : (unsigned int)cpu % sp->nr_cpu];
+}
+
+int mthpc_srcu_read_lock(struct mthpc_srcu_struct *sp)
+{
+    int idx;
+
+    idx = atomic_load_explicit(&sp->idx, memory_order_relaxed) & 0x1;
+    /* Full barrier, order the counter before the critical section. */
+    atomic_fetch_add_explicit(&mthpc_srcu_this_cpu(sp)->lock_count[idx], 1,
+                              memory_order_seq_cst);
+
+    return idx;
+}
+
+void mthpc_srcu_read_unlock(struct mthpc_srcu_struct *sp, int idx)
+{
+    /* Full barrier, order the critical section before the counter. */
+    atomic_fetch_add_explicit(&mthpc_srcu_this_cpu(sp)->unlock_count[idx], 1,
+                              memory_order_seq_cst);
+}
+
+/*
+ * TSan doesn't understand the fences around the counters, so acquire the
+ * unlock counters to let it see the reader has left before the updater
+ * frees the data. The read side should release them in the debug build.
+ */
+#ifdef CONFIG_DEBUG
+#define MTHPC_SRCU_SCAN_ORDER memory_order_acquire
+#else
+#define MTHPC_SRCU_SCAN_ORDER memory_order_relaxed
+#endif
+
+/*
+ * Sum the unlock counters first. So if a reader migrates and the unlock is
+ * counted, its lock must be counted too.
+ */
+bool mthpc_srcu_readers_done_internal(struct mthpc_srcu_struct *sp, int idx,
+                                      void (*mb)(void))
+{
+    unsigned long locks = 0, unlocks = 0;
+
+    for (unsigned int i = 0; i < sp->nr_cpu; i++)
+        unlocks += atomic_load_explicit(&sp->cpu[i].unlock_count[idx],
+                                        MTHPC_SRCU_SCAN_ORDER);
+    mb();
+    for (unsigned int i = 0; i < sp->nr_cpu; i++)
+        locks += atomic_load_explicit(&sp->cpu[i].lock_count[idx],
+                                      memory_order_relaxed);
+    if (locks != unlocks)
+        return false;
+    mb();
+
+    return true;
+}
+
+#define MTHPC_SRCU_WAIT_SPIN 100
+#define MTHPC_SRCU_MAX_BACKOFF_NS 1000000L
+
+/*
+ * The readers might sleep or be preempted for a long time, so we back off
+ * to sleep instead of spinning on them.
+ */
+static void mthpc_srcu_wait_for_readers(struct mthpc_srcu_struct *sp, int idx,
+                                        void (*mb)(void))
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000 };
+    unsigned int attempts = 0;
+
+    while (!mthpc_srcu_readers_done_internal(sp, idx, mb)) {
+        if (attempts < MTHPC_SRCU_WAIT_SPIN) {
+            attempts++;
+            mthpc_cmb();
+            continue;
+        }
+        nanosleep(&ts, NULL);
+        if (ts.tv_nsec < MTHPC_SRCU_MAX_BACKOFF_NS)
+            ts.tv_nsec <<= 1;
+    }
+}
+
+void mthpc_synchronize_srcu_internal(struct mthpc_srcu_struct *sp,
+                                     void (*mb)(void))
+{
+    unsigned long snap, idx;
+
+    mb();
+
+    /* The gp_seq_nr after which a full grace period has elapsed. */
+    snap = (atomic_load_explicit(&sp->gp_seq_nr, memory_order_acquire) + 3) &
+           ~0x1UL;
+
+    spin_lock(&sp->lock);
+    if ((long)(atomic_load_explicit(&sp->gp_seq_nr, memory_order_acquire) -
+               snap) >= 0)
+        goto unlock;
+
+    atomic_fetch_add_explicit(&sp->gp_seq_nr, 1, memory_order_seq_cst);
+
+    idx = atomic_load_explicit(&sp->idx, memory_order_relaxed);
+    /*
+     * The reader might pick the index before the last flip and increase
+     * the counter after it. Wait for it first.
+     */
+    mthpc_srcu_wait_for_readers(sp, (idx & 0x1) ^ 0x1, mb);
+    atomic_store_explicit(&sp->idx, idx + 1, memory_order_seq_cst);
+    mb();
+    mthpc_srcu_wait_for_readers(sp, idx & 0x1, mb);
+
+    atomic_fetch_add_explicit(&sp->gp_seq_nr, 1, memory_order_seq_cst);
+
+unlock:
+    spin_unlock(&sp->lock);
+
+    smp_mb();
+}
+
+static void mthpc_srcu_mb(void)
+{
+    smp_mb();
+}
+
+void mthpc_synchronize_srcu(struct mthpc_srcu_struct *sp)
+{
+    mthpc_synchronize_srcu_internal(sp, mthpc_srcu_mb);
+}
+
+void mthpc_srcu_init_internal(struct mthpc_srcu_struct *sp, unsigned int nr)
+{
+    sp->nr_cpu = nr;
+    sp->cpu = aligned_alloc(MTHPC_COHERENCE_SIZE,
+                            sizeof(struct mthpc_srcu_cpu) * sp->nr_cpu);
+    MTHPC_BUG_ON(!sp->cpu, "allocation failed");
+    for (unsigned int i = 0; i < sp->nr_cpu; i++) {
+        for (int j = 0; j < 2; j++) {
+            atomic_init(&sp->cpu[i].lock_count[j], 0);
+            atomic_init(&sp->cpu[i].unlock_count[j], 0);
+        }
+    }
+    atomic_init(&sp->idx, 0);
+    atomic_init(&sp->gp_seq_nr, 0);
+    spin_lock_init(&sp->lock);
+}
+
+void mthpc_srcu_init(struct mthpc_srcu_struct *sp)
+{
+    long nr_cpu;
+
+    nr_cpu = sysconf(_SC_NPROCESSORS_CONF);
+    mthpc_srcu_init_internal(sp, (nr_cpu < 1) ? 1 : nr_cpu);
+}
+
+void mthpc_srcu_cleanup(struct mthpc_srcu_struct *sp)
+{
+    MTHPC_WARN_ON(!mthpc_srcu_readers_done_internal(sp, 0, mthpc_srcu_mb) ||
+                      !mthpc_srcu_readers_done_internal(sp, 1, mthpc_srcu_mb),
+                  "cleanup srcu with the active readers");
+    spin_lock_destroy(&sp->lock);
+    free(sp->cpu);
+    sp->cpu = NULL;
+}
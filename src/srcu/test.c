@@ -0,0 +1,80 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mthpc/thread.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+#include <mthpc/rcu.h>
+#include <mthpc/srcu.h>
+
+#define NR_READER 16
+#define NR_WRITE 5
+
+struct test {
+    int val;
+};
+
+static struct mthpc_srcu_struct srcu;
+static struct mthpc_srcu_struct other_srcu;
+static struct test *data;
+
+void read_func(struct mthpc_thread_group *unused)
+{
+    struct test *tmp;
+    int idx;
+
+    for (int i = 0; i < NR_WRITE; i++) {
+        idx = mthpc_srcu_read_lock(&srcu);
+        tmp = mthpc_rcu_dereference(data);
+        /* The reader can sleep in the critical section. */
+        usleep(100);
+        MTHPC_BUG_ON(tmp->val < 0, "read the freed data");
+        mthpc_srcu_read_unlock(&srcu, idx);
+    }
+}
+
+void write_func(struct mthpc_thread_group *unused)
+{
+    struct test *old, *new;
+
+    for (int i = 0; i < NR_WRITE; i++) {
+        new = malloc(sizeof(struct test));
+        MTHPC_BUG_ON(!new, "allocation failed");
+        new->val = i + 1;
+        old = mthpc_rcu_replace_pointer(data, new);
+        mthpc_synchronize_srcu(&srcu);
+        old->val = -1;
+        free(old);
+    }
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(reader, NR_READER, NULL, read_func, NULL);
+static MTHPC_DECLARE_THREAD_GROUP(writer, 1, NULL, write_func, NULL);
+
+int main(void)
+{
+    MTHPC_DECLARE_THREAD_CLUSTER(threads, &reader, &writer);
+    int idx;
+
+    mthpc_srcu_init(&srcu);
+    mthpc_srcu_init(&other_srcu);
+
+    data = malloc(sizeof(struct test));
+    MTHPC_BUG_ON(!data, "allocation failed");
+    data->val = 0;
+
+    mthpc_thread_run(&threads);
+
+    /* The grace period of the other domain doesn't wait for us. */
+    idx = mthpc_srcu_read_lock(&srcu);
+    mthpc_synchronize_srcu(&other_srcu);
+    mthpc_srcu_read_unlock(&srcu, idx);
+    mthpc_synchronize_srcu(&srcu);
+
+    free(data);
+    mthpc_srcu_cleanup(&other_srcu);
+    mthpc_srcu_cleanup(&srcu);
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <errno.h>
 
 #include <mthpc/taskflow.h>
 #include <mthpc/list.h>
@@ -14,9 +15,6 @@
 #undef _MTHPC_FEATURE
 #define _MTHPC_FEATURE taskflow
 
-#define MTHPC_TASKFLOW_CPU 0x0004
-#define MTHPC_TASKFLOW_CPU_MASK (MTHPC_TASKFLOW_CPU - 1)
-
 struct mthpc_task {
     struct mthpc_work work;
     unsigned long __is_sub_task_parent;
@@ -222,11 +220,6 @@ static __allow_unused void mthpc_dump_taskflow(struct mthpc_taskflow *tf)
 }
 #endif /* CONFIG_DEBUG */
 
-static __always_inline int mthpc_taskflow_get_cpu(unsigned long seed)
-{
-    return (int)seed & MTHPC_TASKFLOW_CPU_MASK;
-}
-
 /* user API */
 
 void __mthpc_taskflow_precede(struct mthpc_task *task, struct mthpc_task **news,
@@ -411,24 +404,39 @@ int mthpc_taskflow_await(struct mthpc_taskflow *tf)
     mthpc_list_for_each_entry (current, &tf->list_head, list_node) {
         struct mthpc_task *sub_task_current = NULL;
         unsigned long nr_completed_sub_task = 0;
+        struct mthpc_work **works;
+        int nr_works = 1;
+
+        mthpc_list_for_each_entry (sub_task_current,
+                                   &current->sub_task_list_head,
+                                   sub_task_list_head)
+            nr_works++;
+
+        works = malloc(sizeof(struct mthpc_work *) * nr_works);
+        if (!works) {
+            MTHPC_WARN_ON(1, "allocate works failed");
+            return -ENOMEM;
+        }
 
         mthpc_completion_init(&tf->completion, current->nr_sub_task);
 
-        mthpc_schedule_taskflow_work_on(
-            mthpc_taskflow_get_cpu(nr_completed_sub_task), &current->work);
-        nr_completed_sub_task++;
+        works[nr_completed_sub_task++] = &current->work;
 
         /*
          * Before we go to the next main task, complete the sub task list first.
          */
         mthpc_list_for_each_entry (sub_task_current,
                                    &current->sub_task_list_head,
-                                   sub_task_list_head) {
-            mthpc_schedule_taskflow_work_on(
-                mthpc_taskflow_get_cpu(nr_completed_sub_task),
-                &sub_task_current->work);
-            nr_completed_sub_task++;
+                                   sub_task_list_head)
+            works[nr_completed_sub_task++] = &sub_task_current->work;
+
+        /* Queue them at once, the idle workers will steal them. */
+        if (mthpc_queue_taskflow_work_batch(works, nr_works)) {
+            MTHPC_WARN_ON(1, "queue taskflow works failed");
+            free(works);
+            return -ENOMEM;
         }
+        free(works);
 
         mthpc_wait_for_completion(&tf->completion);
 
@@ -1,13 +1,27 @@
+#define _GNU_SOURCE
 #include <mthpc/workqueue.h>
+#include <mthpc/thread.h>
 #include <mthpc/rcu.h>
 #include <mthpc/debug.h>
 #include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
 
 static void dump_work(struct mthpc_work *work);
 static MTHPC_DECLARE_WORK(test_work, dump_work, NULL);
 
 static int cnt = 0;
 
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static void dump_work(struct mthpc_work *work)
 {
     mthpc_dump_work(work);
@@ -18,10 +32,244 @@ static void dump_work(struct mthpc_work *work)
     mthpc_schedule_work_on(cnt, work);
 }
 
+/*
+ * The parent queues the children on its own worker, the idle workers steal
+ * them from it.
+ */
+#define NR_CHILD 4096
+
+static struct mthpc_work children[NR_CHILD];
+static atomic_int nr_child_done;
+
+static void child_work(struct mthpc_work *work)
+{
+    atomic_fetch_add_explicit(&nr_child_done, 1, memory_order_relaxed);
+}
+
+static void parent_work(struct mthpc_work *work)
+{
+    for (int i = 0; i < NR_CHILD; i++) {
+        MTHPC_INIT_WORK(&children[i], "child", child_work, NULL);
+        MTHPC_BUG_ON(mthpc_queue_work(&children[i]), "queue child failed");
+    }
+}
+static MTHPC_DECLARE_WORK(fanout_work, parent_work, NULL);
+
+/* The pinned batch runs in the queued order. */
+#define NR_BATCH 64
+
+static struct mthpc_work batch[NR_BATCH];
+static struct mthpc_work *batch_ptr[NR_BATCH];
+static atomic_int nr_batch_done;
+
+static void batch_work(struct mthpc_work *work)
+{
+    int nr = atomic_load_explicit(&nr_batch_done, memory_order_relaxed);
+
+    MTHPC_BUG_ON(work != &batch[nr], "batch out of order");
+    atomic_store_explicit(&nr_batch_done, nr + 1, memory_order_release);
+}
+
+/*
+ * The works from the external producer start in the queued order. The
+ * first one holds the worker until all of them are queued, so they pile
+ * up in the inbox. The thieves take from the top as well, so each worker
+ * sees the increasing order.
+ */
+#define NR_ORDER 512
+
+static struct mthpc_work order[NR_ORDER];
+static atomic_int order_queued;
+static atomic_int nr_order_done;
+static __thread int order_last = -1;
+
+static void order_work(struct mthpc_work *work)
+{
+    int nr = work - order;
+
+    if (!nr) {
+        while (!atomic_load(&order_queued))
+            sched_yield();
+    }
+    MTHPC_BUG_ON(nr <= order_last, "work %d ran after %d", nr, order_last);
+    order_last = nr;
+    atomic_fetch_add_explicit(&nr_order_done, 1, memory_order_relaxed);
+}
+
+/*
+ * The work pinned to the cpu over the old 4-cpu mask runs on that cpu if
+ * it's in the affinity mask, otherwise it wraps around the workers.
+ */
+static const int pinned_cpu[] = { 4,   5,    7,    8,   31,  63,
+                                  64,  127,  1023, 1024, 4099 };
+#define NR_PINNED (sizeof(pinned_cpu) / sizeof(pinned_cpu[0]))
+
+static struct mthpc_work pinned[NR_PINNED];
+static int pinned_expected[NR_PINNED];
+static atomic_int nr_pinned_done;
+
+static void pinned_work(struct mthpc_work *work)
+{
+    int nr = work - pinned;
+
+    MTHPC_BUG_ON(sched_getcpu() != pinned_expected[nr],
+                 "work on cpu %d ran on %d, expected %d", pinned_cpu[nr],
+                 sched_getcpu(), pinned_expected[nr]);
+    atomic_fetch_add_explicit(&nr_pinned_done, 1, memory_order_relaxed);
+}
+
+static void pinned_init(cpu_set_t *mask)
+{
+    int cpus[CPU_SETSIZE], nr = 0;
+
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, mask))
+            cpus[nr++] = i;
+    }
+    for (unsigned int i = 0; i < NR_PINNED; i++) {
+        int cpu = pinned_cpu[i];
+
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, mask))
+            pinned_expected[i] = cpu;
+        else
+            pinned_expected[i] = cpus[cpu % nr];
+        MTHPC_INIT_WORK(&pinned[i], "pinned", pinned_work, NULL);
+    }
+}
+
+/*
+ * Many producers hammer the same queue. Each of them queues a burst and
+ * waits for it, so the worker keeps going to sleep and being woken up.
+ * A lost wakeup leaves the burst unfinished.
+ */
+#define NR_PRODUCER 8
+#define NR_PRODUCE_ROUND 256
+#define NR_BURST 8
+/* Wait for at most 10 seconds per burst. */
+#define BURST_TIMEOUT_NS 10000000000ULL
+
+static int producer_cpu;
+static atomic_uint producer_id;
+static struct mthpc_work produce[NR_PRODUCER][NR_BURST];
+static atomic_int nr_produce_done[NR_PRODUCER];
+
+static void produce_work(struct mthpc_work *work)
+{
+    atomic_fetch_add_explicit((atomic_int *)work->private, 1,
+                              memory_order_release);
+}
+
+void producer_func(struct mthpc_thread_group *unused)
+{
+    unsigned int id = atomic_fetch_add(&producer_id, 1);
+    atomic_int *done = &nr_produce_done[id];
+    unsigned long long deadline;
+
+    for (int i = 0; i < NR_BURST; i++)
+        MTHPC_INIT_WORK(&produce[id][i], "produce", produce_work, done);
+
+    for (int r = 0; r < NR_PRODUCE_ROUND; r++) {
+        atomic_store(done, 0);
+        for (int i = 0; i < NR_BURST; i++)
+            MTHPC_BUG_ON(mthpc_schedule_work_on(producer_cpu, &produce[id][i]),
+                         "queue work failed");
+        deadline = now_ns() + BURST_TIMEOUT_NS;
+        while (atomic_load_explicit(done, memory_order_acquire) != NR_BURST) {
+            MTHPC_BUG_ON(now_ns() > deadline, "lost wakeup, %d/%d done",
+                         atomic_load(done), NR_BURST);
+            sched_yield();
+        }
+    }
+}
+
+static MTHPC_DECLARE_THREAD_GROUP(producer, NR_PRODUCER, NULL, producer_func,
+                                  NULL);
+
+/* The delayed works fire no earlier than their delays, over the levels. */
+#define NR_DELAYED 256
+#define DELAYED_STEP_NS 1000000UL
+
+static struct mthpc_delayed_work delayed[NR_DELAYED];
+static unsigned long long delayed_deadline[NR_DELAYED];
+static atomic_int nr_delayed_done;
+static atomic_int canceled_ran;
+
+static void delayed_work(struct mthpc_work *work)
+{
+    struct mthpc_delayed_work *dwork = mthpc_to_delayed_work(work);
+
+    MTHPC_BUG_ON(now_ns() < delayed_deadline[dwork - delayed],
+                 "delayed work fired early");
+    atomic_fetch_add_explicit(&nr_delayed_done, 1, memory_order_relaxed);
+}
+
+static void canceled_work(struct mthpc_work *work)
+{
+    atomic_store(&canceled_ran, 1);
+}
+static MTHPC_DECLARE_DELAYED_WORK(canceled, canceled_work, NULL);
+
 int main(void)
 {
+    cpu_set_t mask, old_mask;
+
     //mthpc_rcu_thread_init();
     mthpc_queue_work(&test_work);
 
+    mthpc_queue_work(&fanout_work);
+    while (atomic_load(&nr_child_done) != NR_CHILD)
+        sched_yield();
+
+    for (int i = 0; i < NR_BATCH; i++) {
+        MTHPC_INIT_WORK(&batch[i], "batch", batch_work, NULL);
+        batch_ptr[i] = &batch[i];
+    }
+    MTHPC_BUG_ON(mthpc_schedule_work_batch_on(0, batch_ptr, NR_BATCH),
+                 "queue batch failed");
+    while (atomic_load(&nr_batch_done) != NR_BATCH)
+        sched_yield();
+
+    /* Stay on this CPU, so all the works go to the same worker. */
+    CPU_ZERO(&mask);
+    CPU_SET(sched_getcpu(), &mask);
+    MTHPC_BUG_ON(sched_getaffinity(0, sizeof(old_mask), &old_mask) ||
+                     sched_setaffinity(0, sizeof(mask), &mask),
+                 "set affinity failed");
+    for (int i = 0; i < NR_ORDER; i++) {
+        MTHPC_INIT_WORK(&order[i], "order", order_work, NULL);
+        MTHPC_BUG_ON(mthpc_queue_work(&order[i]), "queue work failed");
+    }
+    atomic_store(&order_queued, 1);
+    MTHPC_BUG_ON(sched_setaffinity(0, sizeof(old_mask), &old_mask),
+                 "restore affinity failed");
+    while (atomic_load(&nr_order_done) != NR_ORDER)
+        sched_yield();
+
+    pinned_init(&old_mask);
+    for (unsigned int i = 0; i < NR_PINNED; i++)
+        MTHPC_BUG_ON(mthpc_schedule_work_on(pinned_cpu[i], &pinned[i]),
+                     "queue pinned work failed");
+    while (atomic_load(&nr_pinned_done) != NR_PINNED)
+        sched_yield();
+
+    producer_cpu = sched_getcpu();
+    mthpc_thread_run(&producer);
+
+    MTHPC_BUG_ON(mthpc_queue_delayed_work(&canceled, 1000000000UL),
+                 "queue delayed work failed");
+    MTHPC_BUG_ON(mthpc_queue_delayed_work(&canceled, 1000000000UL) != -EBUSY,
+                 "queue pending delayed work again");
+    for (int i = 0; i < NR_DELAYED; i++) {
+        MTHPC_INIT_DELAYED_WORK(&delayed[i], "delayed", delayed_work, NULL);
+        delayed_deadline[i] = now_ns() + i * DELAYED_STEP_NS;
+        MTHPC_BUG_ON(mthpc_queue_delayed_work(&delayed[i], i * DELAYED_STEP_NS),
+                     "queue delayed work failed");
+    }
+    MTHPC_BUG_ON(!mthpc_cancel_delayed_work(&canceled), "cancel failed");
+    MTHPC_BUG_ON(mthpc_cancel_delayed_work(&canceled), "cancel twice");
+    while (atomic_load(&nr_delayed_done) != NR_DELAYED)
+        usleep(1000);
+    MTHPC_BUG_ON(atomic_load(&canceled_ran), "canceled work ran");
+
     return 0;
 }
@@ -3,14 +3,18 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdatomic.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include <mthpc/workqueue.h>
 #include <mthpc/spinlock.h>
 #include <mthpc/util.h>
 #include <mthpc/debug.h>
 #include <mthpc/print.h> /* for dump work */
-#include <mthpc/rcu.h> /* queue work will use rcu */
-#include <mthpc/rculist.h>
+#include <mthpc/rcu.h> /* work might use rcu */
 #include <mthpc/futex.h>
 
 #include <internal/workqueue.h> /* provide wq for other features */
@@ -20,76 +24,138 @@
 #undef _MTHPC_FEATURE
 #define _MTHPC_FEATURE workqueue
 
-#define MTHPC_WQ_NR_CPU (4U)
-#define MTHPC_WQ_CPU_MASK (MTHPC_WQ_NR_CPU - 1)
-#define MTHPC_WQ_ACTIVED_FLAG (MTHPC_WQ_NR_CPU)
+/*
+ * The per-CPU workqueues of the pool are sized by the CPUs we can run on, the
+ * affinity mask at init, and indexed directly by the cpu. The workqueue is
+ * created when the first work is queued to it and lives until exit.
+ */
+struct mthpc_wq_cpus {
+    unsigned int nr;
+    /* The cpu id of each workqueue. */
+    int *cpu;
+    /* The workqueue index of the cpu id, -1 if we can't run on it. */
+    int *index;
+    unsigned int nr_index;
+};
+static struct mthpc_wq_cpus mthpc_wq_cpus;
+
+/*
+ * Chase-Lev work-stealing deque, see "Correct and Efficient Work-Stealing for
+ * Weak Memory Models" (PPoPP '13). The worker pushes the works at the
+ * bottom. It takes the works queued by itself at the bottom, LIFO, and the
+ * others at the top, FIFO, where the other workers steal the oldest one.
+ * It doesn't grow. If it's full, the worker keeps its own work in the inbox
+ * or runs the oldest one to make the room.
+ */
+#define MTHPC_WQ_DEQUE_SIZE 1024
+#define MTHPC_WQ_DEQUE_MASK (MTHPC_WQ_DEQUE_SIZE - 1)
+
+struct mthpc_wq_deque {
+    atomic_long top __mthpc_aligned__;
+    atomic_long bottom __mthpc_aligned__;
+    _Atomic(struct mthpc_work *) buf[MTHPC_WQ_DEQUE_SIZE];
+};
 
 struct mthpc_workqueue {
     /* pool uses active to notify the wq should be finished or not. */
-    atomic_uint __actived_cpu;
-    spinlock_t lock;
+    atomic_bool active;
+    /* The index in the pool, see mthpc_wq_cpus. */
+    unsigned int idx;
     pthread_t tid;
     /*
-     * Following futex values represent the of the workqueue:
-     * - 0: empty queue
-     * - 1: non-empty queue
+     * Following futex values represent the state of the worker:
+     * - -1: going to sleep, the producer should wake it up
+     * - 0: running
      */
     int32_t futex;
-    /* the number of work in queue */
-    unsigned int count;
-    /* workqueue (work) linked list */
-    struct mthpc_list_head head;
-    /* workpool linked list */
-    struct mthpc_list_head node;
+    /*
+     * The lock-free stack of the queued works. The producers push onto it
+     * and the worker takes all of them at once, see mthpc_wq_push().
+     */
+    _Atomic(struct mthpc_work *) inbox;
+    /* The stealable works, see mthpc_wq_deque_push(). */
+    struct mthpc_wq_deque deque;
     struct mthpc_workpool *wp;
+} __mthpc_aligned__;
+
+/*
+ * The hierarchical timer wheel of the delayed works, the same design as the
+ * Linux timer wheel. Each level has 64 slots and the granularity of the next
+ * level is 8 times coarser. The timer goes to the level by its delay and
+ * never cascades down, so arming and cancelling are O(1), and the timer
+ * thread only touches the expired slots. The cost is that the timer might
+ * fire up to 1/8 of its delay later.
+ */
+#define MTHPC_WQ_TIMER_TICK_NS 1000000ULL
+#define MTHPC_WQ_LVL_CLK_SHIFT 3
+#define MTHPC_WQ_LVL_CLK_DIV (1UL << MTHPC_WQ_LVL_CLK_SHIFT)
+#define MTHPC_WQ_LVL_CLK_MASK (MTHPC_WQ_LVL_CLK_DIV - 1)
+#define MTHPC_WQ_LVL_SHIFT(n) ((n) * MTHPC_WQ_LVL_CLK_SHIFT)
+#define MTHPC_WQ_LVL_GRAN(n) (1UL << MTHPC_WQ_LVL_SHIFT(n))
+#define MTHPC_WQ_LVL_SIZE 64UL
+#define MTHPC_WQ_LVL_MASK (MTHPC_WQ_LVL_SIZE - 1)
+#define MTHPC_WQ_LVL_DEPTH 9
+/* The delay in tick that goes to level n. */
+#define MTHPC_WQ_LVL_START(n) \
+    ((MTHPC_WQ_LVL_SIZE - 1) << MTHPC_WQ_LVL_SHIFT((n) - 1))
+/* The larger delay is clamped to the capacity, about 12 days. */
+#define MTHPC_WQ_TIMER_CUTOFF MTHPC_WQ_LVL_START(MTHPC_WQ_LVL_DEPTH)
+#define MTHPC_WQ_TIMER_MAX \
+    (MTHPC_WQ_TIMER_CUTOFF - MTHPC_WQ_LVL_GRAN(MTHPC_WQ_LVL_DEPTH - 1))
+/* The expired works are queued in the batch of this size. */
+#define MTHPC_WQ_TIMER_BATCH 64
+
+struct mthpc_wq_timer {
+    spinlock_t lock;
+    pthread_t tid;
+    bool started;
+    bool stopped;
+    /* The timer thread waits on it, increased when it should recheck. */
+    int32_t futex;
+    /* The wheel time in tick, the slots before it have been expired. */
+    unsigned long clk;
+    /* The tick of the earliest pending slot, might be earlier by cancel. */
+    unsigned long next_expiry;
+    unsigned int nr_pending;
+    uint64_t pending_map[MTHPC_WQ_LVL_DEPTH];
+    struct mthpc_hlist_head slots[MTHPC_WQ_LVL_DEPTH * MTHPC_WQ_LVL_SIZE];
 };
 
 struct mthpc_workpool {
     const char *name;
-    struct mthpc_list_head head;
+    /* mthpc_wq_cpus.nr per-CPU workqueues, NULL until it's used. */
+    _Atomic(struct mthpc_workqueue *) *wq;
     /*
-     * The fast path will access count without holding the lock.
-     * So, use atomic ops to access count even it's protected
-     * by lock.
+     * The works queued or running. The work might queue the other works,
+     * so exit waits for it to be zero before stopping the workqueues.
      */
-    atomic_uint count;
-
-    spinlock_t lock;
+    atomic_uint nr_work;
+    /* The number of the created workqueues. */
+    atomic_uint nr_wq;
+    /* The workers going to sleep, the others wake them to steal the work. */
+    atomic_uint nr_idle;
+    struct mthpc_wq_timer timer;
 } __mthpc_aligned__;
 static struct mthpc_workpool mthpc_workpool;
 static struct mthpc_workpool mthpc_thread_wp;
 static struct mthpc_workpool mthpc_taskflow_wp;
 //static struct mthpc_workpool mthpc_rcu_wp;
 
+/* The workqueue of the worker, NULL if we're not the worker. */
+static __thread struct mthpc_workqueue *mthpc_wq_current;
+
 static __always_inline int mthpc_wq_get_cpu(struct mthpc_workqueue *wq)
 {
-#ifdef __linux__
-    return (
-        int)(atomic_load_explicit(&wq->__actived_cpu, memory_order_relaxed) &
-             MTHPC_WQ_CPU_MASK);
-#else
-    return 0;
-#endif
+    return mthpc_wq_cpus.cpu[wq->idx];
 }
 
-static __always_inline void mthpc_wq_set_cpu(struct mthpc_workqueue *wq,
-                                             int cpu)
+/* Map the cpu id to the workqueue, the unknown one wraps around. */
+static __always_inline unsigned int mthpc_wq_cpu_to_idx(int cpu)
 {
-#ifdef __linux__
-    unsigned int old_masked_cpuid, masked_cpuid;
-
-    masked_cpuid =
-        atomic_load_explicit(&wq->__actived_cpu, memory_order_acquire);
-
-    old_masked_cpuid = masked_cpuid;
-    masked_cpuid &= ~MTHPC_WQ_CPU_MASK;
-    masked_cpuid |= (cpu & MTHPC_WQ_CPU_MASK);
-
-    atomic_compare_exchange_strong_explicit(
-        &wq->__actived_cpu, &old_masked_cpuid, masked_cpuid,
-        memory_order_release, memory_order_relaxed);
-#else
-#endif
+    if (cpu >= 0 && (unsigned int)cpu < mthpc_wq_cpus.nr_index &&
+        mthpc_wq_cpus.index[cpu] >= 0)
+        return mthpc_wq_cpus.index[cpu];
+    return (unsigned int)cpu % mthpc_wq_cpus.nr;
 }
 
 static __always_inline void mthpc_wq_run_on_cpu(struct mthpc_workqueue *wq)
@@ -108,107 +174,428 @@ static __always_inline void mthpc_wq_run_on_cpu(struct mthpc_workqueue *wq)
 #endif
 }
 
+/*
+ * The worker checks it after setting the futex to -1, and exit clears it
+ * before the wakeup, so both are seq_cst like the futex.
+ */
 static __always_inline bool mthpc_wq_active(struct mthpc_workqueue *wq)
 {
-    unsigned int masked_active = 0;
-
-    masked_active =
-        atomic_load_explicit(&wq->__actived_cpu, memory_order_acquire);
-
-    return masked_active & MTHPC_WQ_ACTIVED_FLAG;
+    return atomic_load_explicit(&wq->active, memory_order_seq_cst);
 }
 
 static __always_inline void mthpc_wq_mkactive(struct mthpc_workqueue *wq)
 {
-    atomic_fetch_or_explicit(&wq->__actived_cpu, MTHPC_WQ_ACTIVED_FLAG,
-                             memory_order_release);
+    atomic_store_explicit(&wq->active, true, memory_order_release);
 }
 
 static __always_inline void mthpc_wq_clear_active(struct mthpc_workqueue *wq)
 {
-    atomic_fetch_and_explicit(&wq->__actived_cpu, ~MTHPC_WQ_ACTIVED_FLAG,
-                              memory_order_release);
+    atomic_store_explicit(&wq->active, false, memory_order_seq_cst);
 }
 
-static __always_inline void mthpc_wq_futex_wait(struct mthpc_workqueue *wq)
+/*
+ * Same as the call_rcu callbacks, the producers push the works onto the
+ * stack with cmpxchg and the worker takes the whole stack with xchg. The
+ * chain of first...last is pushed at once.
+ */
+static __always_inline void mthpc_wq_push(struct mthpc_workqueue *wq,
+                                          struct mthpc_work *first,
+                                          struct mthpc_work *last)
 {
-    int ret = 0;
+    struct mthpc_work *head =
+        atomic_load_explicit(&wq->inbox, memory_order_relaxed);
 
-    smp_rmb();
-    while (!READ_ONCE(wq->futex)) {
-        ret = futex((int32_t *)&wq->futex, FUTEX_WAIT, 0, NULL, NULL, 0);
-        switch (ret) {
-        case EAGAIN:
-            /* value already changed, someone queue the work */
-            /* we assume that the wq thread will stay in same cpu. */
-            WRITE_ONCE(wq->futex, 0);
-            return;
-        case 0:
-            /* fallthrough */
-        case EINTR:
-            smp_rmb();
-            break;
-        default:
-            MTHPC_BUG_ON(1, "futex(&wq->futex, FUTEX_WAIT, 0)");
-        }
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &wq->inbox, &head, first, memory_order_seq_cst, memory_order_relaxed));
+}
+
+/* Take all the queued works and reverse them to the queued order. */
+static __always_inline struct mthpc_work *
+mthpc_wq_splice(struct mthpc_workqueue *wq)
+{
+    struct mthpc_work *head, *next, *prev = NULL;
+
+    head = atomic_exchange_explicit(&wq->inbox, NULL, memory_order_acquire);
+    while (head) {
+        next = head->next;
+        head->next = prev;
+        prev = head;
+        head = next;
     }
+
+    return prev;
 }
 
-static __always_inline void mthpc_wq_futex_wake(struct mthpc_workqueue *wq)
+/*
+ * The worker sets the futex to -1 and then checks the inbox again before it
+ * sleeps. The producer pushes the work and then checks the futex. Both are
+ * seq_cst, so either the worker sees the work or the producer sees -1 and
+ * wakes it up. The running worker costs the producer no syscall.
+ */
+static __always_inline void mthpc_wq_futex_wait(struct mthpc_workqueue *wq)
 {
-    WRITE_ONCE(wq->futex, 1);
-    atomic_thread_fence(memory_order_release);
+    while (READ_ONCE(wq->futex) == -1) {
+        if (futex((int32_t *)&wq->futex, FUTEX_WAIT, -1, NULL, NULL, 0) &&
+            errno != EAGAIN && errno != EINTR)
+            MTHPC_BUG_ON(1, "futex(&wq->futex, FUTEX_WAIT, -1)");
+    }
+}
+
+/* Return true if we woke it up. */
+static __always_inline bool mthpc_wq_futex_wake(struct mthpc_workqueue *wq)
+{
+    int32_t expected = -1;
+
+    if (atomic_load_explicit((volatile _Atomic int32_t *)&wq->futex,
+                             memory_order_seq_cst) != -1)
+        return false;
+    if (!atomic_compare_exchange_strong_explicit(
+            (volatile _Atomic int32_t *)&wq->futex, &expected, 0,
+            memory_order_seq_cst, memory_order_relaxed))
+        return false;
     futex(&wq->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+    return true;
+}
+
+static void mthpc_wq_deque_init(struct mthpc_wq_deque *dq)
+{
+    atomic_init(&dq->top, 0);
+    atomic_init(&dq->bottom, 0);
+    for (int i = 0; i < MTHPC_WQ_DEQUE_SIZE; i++)
+        atomic_init(&dq->buf[i], NULL);
+}
+
+static __always_inline long mthpc_wq_deque_size(struct mthpc_wq_deque *dq)
+{
+    return atomic_load_explicit(&dq->bottom, memory_order_seq_cst) -
+           atomic_load_explicit(&dq->top, memory_order_seq_cst);
+}
+
+/*
+ * Only the worker of the deque can push and take. The bottom store publishes
+ * the work to the thieves, and it's seq_cst to pair with the nr_idle check,
+ * see mthpc_wq_wake_sibling(). Return false if it's full.
+ */
+static __always_inline bool mthpc_wq_deque_push(struct mthpc_wq_deque *dq,
+                                                struct mthpc_work *work)
+{
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+
+    if (b - t >= MTHPC_WQ_DEQUE_SIZE)
+        return false;
+    atomic_store_explicit(&dq->buf[b & MTHPC_WQ_DEQUE_MASK], work,
+                          memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_seq_cst);
+
+    return true;
+}
+
+static __always_inline struct mthpc_work *
+mthpc_wq_deque_take(struct mthpc_wq_deque *dq)
+{
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    long t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+    struct mthpc_work *work = NULL;
+
+    /* The top only grows, so it's empty without racing with the thieves. */
+    if (t > b)
+        return NULL;
+
+    /* Reserve the bottom one before reading the top the thieves race on. */
+    atomic_store_explicit(&dq->bottom, b, memory_order_seq_cst);
+    t = atomic_load_explicit(&dq->top, memory_order_seq_cst);
+    if (t <= b) {
+        work = atomic_load_explicit(&dq->buf[b & MTHPC_WQ_DEQUE_MASK],
+                                    memory_order_relaxed);
+        if (t == b) {
+            /* The last one, the thief might take it. */
+            if (!atomic_compare_exchange_strong_explicit(
+                    &dq->top, &t, t + 1, memory_order_seq_cst,
+                    memory_order_relaxed))
+                work = NULL;
+            atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        }
+    } else
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+
+    return work;
+}
+
+/* Return NULL if it's empty or we lost the race. */
+static __always_inline struct mthpc_work *
+mthpc_wq_deque_steal(struct mthpc_wq_deque *dq)
+{
+    long t = atomic_load_explicit(&dq->top, memory_order_seq_cst);
+    long b = atomic_load_explicit(&dq->bottom, memory_order_seq_cst);
+    struct mthpc_work *work;
+
+    if (t >= b)
+        return NULL;
+    work = atomic_load_explicit(&dq->buf[t & MTHPC_WQ_DEQUE_MASK],
+                                memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+
+    return work;
+}
+
+/*
+ * The worker takes the oldest one from the top as the thieves do, retry if
+ * the thief wins the race.
+ */
+static __always_inline struct mthpc_work *
+mthpc_wq_deque_take_first(struct mthpc_wq_deque *dq)
+{
+    struct mthpc_work *work;
+
+    do {
+        work = mthpc_wq_deque_steal(dq);
+    } while (!work && mthpc_wq_deque_size(dq) > 0);
+
+    return work;
 }
 
 static struct mthpc_workqueue *mthpc_alloc_workqueue(void)
 {
-    struct mthpc_workqueue *wq = malloc(sizeof(struct mthpc_workqueue));
+    struct mthpc_workqueue *wq =
+        aligned_alloc(MTHPC_COHERENCE_SIZE, sizeof(struct mthpc_workqueue));
     if (!wq)
         return NULL;
 
-    wq->count = 0;
     wq->futex = 0;
-    spin_lock_init(&wq->lock);
-    mthpc_list_init(&wq->head);
-    mthpc_list_init(&wq->node);
+    atomic_init(&wq->inbox, NULL);
+    mthpc_wq_deque_init(&wq->deque);
     mthpc_wq_mkactive(wq);
     /* we set the wq to its cpu when running the thread. */
 
     return wq;
 }
 
+static struct mthpc_workqueue *
+mthpc_get_workqueue_idx(struct mthpc_workpool *wp, unsigned int idx);
+
+/*
+ * The idle worker increases nr_idle before it checks the deques for the last
+ * time, and we check nr_idle after pushing the stealable work. Both are
+ * seq_cst, so either the idle worker sees the work or we wake it up. If no
+ * one is idle and the deque is backlogged, create the missing sibling.
+ */
+static void mthpc_wq_wake_sibling(struct mthpc_workqueue *wq)
+{
+    struct mthpc_workpool *wp = wq->wp;
+    struct mthpc_workqueue *sibling;
+    unsigned int idx;
+
+    if (atomic_load_explicit(&wp->nr_idle, memory_order_seq_cst)) {
+        for (unsigned int i = 1; i < mthpc_wq_cpus.nr; i++) {
+            idx = (wq->idx + i) % mthpc_wq_cpus.nr;
+            sibling = atomic_load_explicit(&wp->wq[idx], memory_order_acquire);
+            if (sibling && mthpc_wq_futex_wake(sibling))
+                return;
+        }
+        return;
+    }
+
+    if (atomic_load_explicit(&wp->nr_wq, memory_order_relaxed) ==
+            mthpc_wq_cpus.nr ||
+        mthpc_wq_deque_size(&wq->deque) <= 1)
+        return;
+    for (unsigned int i = 1; i < mthpc_wq_cpus.nr; i++) {
+        idx = (wq->idx + i) % mthpc_wq_cpus.nr;
+        if (!atomic_load_explicit(&wp->wq[idx], memory_order_acquire)) {
+            mthpc_get_workqueue_idx(wp, idx);
+            return;
+        }
+    }
+}
+
+/* Steal from the siblings, start from the next one. */
+static struct mthpc_work *mthpc_wq_steal(struct mthpc_workqueue *wq)
+{
+    struct mthpc_workpool *wp = wq->wp;
+    struct mthpc_workqueue *victim;
+    struct mthpc_work *work;
+
+    for (unsigned int i = 1; i < mthpc_wq_cpus.nr; i++) {
+        victim = atomic_load_explicit(&wp->wq[(wq->idx + i) % mthpc_wq_cpus.nr],
+                                      memory_order_acquire);
+        if (!victim)
+            continue;
+        work = mthpc_wq_deque_steal(&victim->deque);
+        if (work) {
+            /* Pass it on if the victim still has the backlog. */
+            mthpc_wq_wake_sibling(victim);
+            return work;
+        }
+    }
+
+    return NULL;
+}
+
+static bool mthpc_wq_has_stealable(struct mthpc_workqueue *wq)
+{
+    struct mthpc_workpool *wp = wq->wp;
+    struct mthpc_workqueue *sibling;
+
+    for (unsigned int i = 0; i < mthpc_wq_cpus.nr; i++) {
+        sibling = atomic_load_explicit(&wp->wq[i], memory_order_acquire);
+        if (sibling && sibling != wq &&
+            mthpc_wq_deque_size(&sibling->deque) > 0)
+            return true;
+    }
+
+    return false;
+}
+
+static __always_inline void mthpc_wq_run(struct mthpc_workqueue *wq,
+                                         struct mthpc_work *work)
+{
+    /* The stolen work runs on us. */
+    work->wq = wq;
+    // TODO: provide the container option?
+    work->func(work);
+}
+
+/* Run the works in the deque from the oldest one. */
+static unsigned int mthpc_wq_drain_first(struct mthpc_workqueue *wq)
+{
+    struct mthpc_work *work;
+    unsigned int nr = 0;
+
+    while ((work = mthpc_wq_deque_take_first(&wq->deque))) {
+        mthpc_wq_run(wq, work);
+        nr++;
+    }
+
+    return nr;
+}
+
+/*
+ * Move the unpinned works to the deque so the idle workers can steal them.
+ * The deque is taken from the top for the works from the inbox, so they
+ * start in the queued order. The pinned work runs here, after the works
+ * queued before it. Return the number of the works we ran.
+ */
+static unsigned int mthpc_wq_dispatch(struct mthpc_workqueue *wq,
+                                      struct mthpc_work *work)
+{
+    struct mthpc_work *next, *first;
+    unsigned int nr = 0;
+    bool pushed = false;
+
+    for (; work; work = next) {
+        /* The work might be queued again by its func. */
+        next = work->next;
+        if (!work->pinned) {
+            /*
+             * Full, run the oldest one to make the room. The push might see
+             * the stale top, and the thieves might have taken them all, so
+             * just retry if there is nothing left.
+             */
+            while (!mthpc_wq_deque_push(&wq->deque, work)) {
+                first = mthpc_wq_deque_take_first(&wq->deque);
+                if (!first)
+                    continue;
+                mthpc_wq_run(wq, first);
+                nr++;
+            }
+            pushed = true;
+            continue;
+        }
+        nr += mthpc_wq_drain_first(wq);
+        mthpc_wq_run(wq, work);
+        nr++;
+    }
+    if (pushed)
+        mthpc_wq_wake_sibling(wq);
+
+    return nr;
+}
+
+/*
+ * Announce that we're going to sleep, then check the inbox and the siblings
+ * again. Return true if the workpool is exiting.
+ */
+static bool mthpc_wq_idle(struct mthpc_workqueue *wq)
+{
+    struct mthpc_workpool *wp = wq->wp;
+    bool exit = false;
+
+    atomic_fetch_add_explicit(&wp->nr_idle, 1, memory_order_seq_cst);
+    atomic_store_explicit((volatile _Atomic int32_t *)&wq->futex, -1,
+                          memory_order_seq_cst);
+    if (atomic_load_explicit(&wq->inbox, memory_order_seq_cst) ||
+        mthpc_wq_has_stealable(wq)) {
+        WRITE_ONCE(wq->futex, 0);
+    } else if (!mthpc_wq_active(wq)) {
+        /* Exit clears active after all the works are done. */
+        WRITE_ONCE(wq->futex, 0);
+        exit = true;
+    } else
+        mthpc_wq_futex_wait(wq);
+    atomic_fetch_sub_explicit(&wp->nr_idle, 1, memory_order_relaxed);
+
+    return exit;
+}
+
 static void *mthpc_worker_run(void *arg)
 {
     struct mthpc_workqueue *wq = arg;
+    struct mthpc_workpool *wp = wq->wp;
     struct mthpc_work *work;
+    unsigned int nr_done = 0;
+    /* The works above it are queued by the works we ran, see below. */
+    long base = 0;
 
     // Sometime, when we do the rcu init in rcu_read_lock() will let
     // mthpc_rcu_node_ptr become NULL but aleady add to rcu list?
     mthpc_rcu_thread_init();
     mthpc_wq_run_on_cpu(wq);
+    mthpc_wq_current = wq;
 
     while (1) {
-        if (!mthpc_wq_active(wq))
-            break;
-        spin_lock(&wq->lock);
-        if (mthpc_list_empty(&wq->head)) {
-            MTHPC_WARN_ON(wq->count > 0, "list is empty but count=%u\n",
-                          wq->count);
-            spin_unlock(&wq->lock);
-            mthpc_wq_futex_wait(wq);
-        } else {
-            work = container_of(wq->head.next, struct mthpc_work, node);
-            mthpc_list_del(&work->node);
-            wq->count--;
-            spin_unlock(&wq->lock);
-
-            /* We shouldn't hold the lock when running work. */
-            // TODO: provide the container option?
-            work->func(work);
+        if (atomic_load_explicit(&wq->inbox, memory_order_relaxed)) {
+            nr_done += mthpc_wq_dispatch(wq, mthpc_wq_splice(wq));
+            base = atomic_load_explicit(&wq->deque.bottom,
+                                        memory_order_relaxed);
+            continue;
         }
+
+        /*
+         * The works queued by the running work are taken LIFO from the
+         * bottom while they're hot, the others FIFO from the top.
+         */
+        work = NULL;
+        if (atomic_load_explicit(&wq->deque.bottom, memory_order_relaxed) >
+            base)
+            work = mthpc_wq_deque_take(&wq->deque);
+        if (!work)
+            work = mthpc_wq_deque_take_first(&wq->deque);
+        if (!work)
+            work = mthpc_wq_steal(wq);
+        if (work) {
+            mthpc_wq_run(wq, work);
+            nr_done++;
+            continue;
+        }
+
+        /* Let exit see the finished works before we sleep. */
+        if (nr_done) {
+            atomic_fetch_sub_explicit(&wp->nr_work, nr_done,
+                                      memory_order_release);
+            nr_done = 0;
+        }
+        if (mthpc_wq_idle(wq))
+            break;
     }
 
+    mthpc_wq_current = NULL;
     mthpc_rcu_thread_exit();
 
     pthread_exit(NULL);
@@ -216,108 +603,386 @@ static void *mthpc_worker_run(void *arg)
 
 static __always_inline void mthpc_works_handler(struct mthpc_workqueue *wq)
 {
-    pthread_create(&wq->tid, NULL, mthpc_worker_run, wq);
+    MTHPC_BUG_ON(pthread_create(&wq->tid, NULL, mthpc_worker_run, wq),
+                 "create worker failed");
 }
 
-static void inline mthpc_workqueue_add_locked(struct mthpc_workqueue *wq,
-                                              struct mthpc_work *work)
+/* Get the workqueue of the index, create it if it's the first time. */
+static struct mthpc_workqueue *
+mthpc_get_workqueue_idx(struct mthpc_workpool *wp, unsigned int idx)
 {
-    /* Prevent mthpc_workqueues_join() to delete the wq. */
-    mthpc_list_add_tail_rcu(&work->node, &wq->head);
-    wq->count++;
-    MTHPC_WARN_ON(!mthpc_wq_active(wq), "Add work to inactive wq");
-    work->wq = wq;
-}
+    struct mthpc_workqueue *wq, *expected = NULL;
 
-/* get global workqueue */
-static struct mthpc_workqueue *
-mthpc_get_workqueue(struct mthpc_workpool *wp, int cpu, struct mthpc_work *work)
-{
-    struct mthpc_workqueue *wq = NULL, *prealloc = NULL;
-    struct mthpc_workqueue *curr;
-    struct mthpc_list_head *pos;
-
-    /* fast path - find the existed first. */
-    mthpc_rcu_read_lock();
-    mthpc_list_for_each_entry_rcu (curr, &wp->head, node) {
-        if (cpu == -1 || (cpu & MTHPC_WQ_CPU_MASK) == mthpc_wq_get_cpu(curr)) {
-            wq = curr;
-            spin_lock(&wq->lock);
-            mthpc_workqueue_add_locked(wq, work);
-            spin_unlock(&wq->lock);
-            break;
-        }
-    }
-    mthpc_rcu_read_unlock();
-    if (wq)
-        goto out;
+    /* fast path - the workqueue of the cpu exists. */
+    wq = atomic_load_explicit(&wp->wq[idx], memory_order_acquire);
+    if (likely(wq))
+        return wq;
 
-    /* Slow path, step 1 - allocate workqueue */
-    prealloc = mthpc_alloc_workqueue();
-    if (!prealloc)
+    /* Slow path - create it, the loser of the race uses the winner's one. */
+    wq = mthpc_alloc_workqueue();
+    if (!wq)
         return NULL;
+    wq->idx = idx;
+    wq->wp = wp;
+    if (!atomic_compare_exchange_strong_explicit(&wp->wq[idx], &expected, wq,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        free(wq);
+        return expected;
+    }
+    atomic_fetch_add_explicit(&wp->nr_wq, 1, memory_order_relaxed);
+    mthpc_works_handler(wq);
+
+    return wq;
+}
+
+/* If cpu is -1, pick the next cpu of the current one. */
+static struct mthpc_workqueue *mthpc_get_workqueue(struct mthpc_workpool *wp,
+                                                   int cpu)
+{
+    unsigned int idx;
+
     if (cpu == -1)
 #ifdef __linux__
-        cpu = (sched_getcpu() + 1) & MTHPC_WQ_CPU_MASK;
+        idx = (mthpc_wq_cpu_to_idx(sched_getcpu()) + 1) % mthpc_wq_cpus.nr;
 #else
-        cpu = atomic_load_explicit(&wp->count, memory_order_consume) &
-              MTHPC_WQ_CPU_MASK;
+        idx = atomic_load_explicit(&wp->nr_work, memory_order_relaxed) %
+              mthpc_wq_cpus.nr;
 #endif
-    mthpc_wq_set_cpu(prealloc, cpu);
-    prealloc->wp = wp;
-
-    /* We can safely add the work before we add wq to the pool. */
-    mthpc_workqueue_add_locked(prealloc, work);
-
-    /* Slow path, step 2 - add to the pool */
-    spin_lock(&wp->lock);
-    /* Does anyone already create it? Check again */
-    mthpc_list_for_each (pos, &wp->head) {
-        struct mthpc_workqueue *tmp =
-            container_of(pos, struct mthpc_workqueue, node);
-        if (cpu == mthpc_wq_get_cpu(tmp)) {
-            wq = tmp;
-            spin_lock(&wq->lock);
-            mthpc_workqueue_add_locked(wq, work);
-            spin_unlock(&wq->lock);
-            goto unlock;
-        }
-    }
-    /* No one created it, we can safely add to the pool.*/
-    mthpc_list_add_tail_rcu(&prealloc->node, &wp->head);
-    atomic_fetch_add_explicit(&wp->count, 1, memory_order_relaxed);
-    wq = prealloc;
-    prealloc = NULL;
-unlock:
-    spin_unlock(&wp->lock);
-    /*
-     * If we clear the prealloc, this means that we are going to create new wq.
-     */
-    if (!prealloc)
-        mthpc_works_handler(wq);
+    else
+        idx = mthpc_wq_cpu_to_idx(cpu);
 
-out:
-    if (prealloc)
-        free(prealloc);
-
-    return wq;
+    return mthpc_get_workqueue_idx(wp, idx);
 }
 
-static int __mthpc_schedule_work_on(struct mthpc_workpool *wp, int cpu,
-                                    struct mthpc_work *work)
+/*
+ * Queue the works to the same workqueue. They're linked into the inbox with
+ * one cmpxchg and the worker is woken up at most once.
+ */
+static int __mthpc_schedule_work_batch_on(struct mthpc_workpool *wp, int cpu,
+                                          struct mthpc_work **works, int n)
 {
     struct mthpc_workqueue *wq;
+    bool pinned = (cpu != -1), pushed = false;
 
-    mthpc_list_init(&work->node);
-    wq = mthpc_get_workqueue(wp, cpu, work);
-    if (!wq)
+    if (n <= 0)
+        return n ? -EINVAL : 0;
+
+    /* Count it before queuing, so exit won't miss the work queued by work. */
+    atomic_fetch_add_explicit(&wp->nr_work, n, memory_order_relaxed);
+
+    /*
+     * Fast path - the worker queues the work to itself. Take it LIFO from
+     * the deque, the running worker doesn't need the wakeup.
+     */
+    wq = mthpc_wq_current;
+    if (!pinned && wq && wq->wp == wp) {
+        for (int i = 0; i < n; i++) {
+            works[i]->pinned = false;
+            works[i]->wq = wq;
+            if (mthpc_wq_deque_push(&wq->deque, works[i]))
+                pushed = true;
+            else
+                mthpc_wq_push(wq, works[i], works[i]);
+        }
+        if (pushed)
+            mthpc_wq_wake_sibling(wq);
+        return 0;
+    }
+
+    wq = mthpc_get_workqueue(wp, cpu);
+    if (!wq) {
+        atomic_fetch_sub_explicit(&wp->nr_work, n, memory_order_relaxed);
         return -ENOMEM;
+    }
 
+    MTHPC_WARN_ON(!mthpc_wq_active(wq), "Add work to inactive wq");
+    /* Link them newest first, the worker reverses the inbox to FIFO. */
+    for (int i = 0; i < n; i++) {
+        works[i]->pinned = pinned;
+        works[i]->wq = wq;
+        works[i]->next = i ? works[i - 1] : NULL;
+    }
+    mthpc_wq_push(wq, works[n - 1], works[0]);
     mthpc_wq_futex_wake(wq);
 
     return 0;
 }
 
+static __always_inline int
+__mthpc_schedule_work_on(struct mthpc_workpool *wp, int cpu,
+                         struct mthpc_work *work)
+{
+    return __mthpc_schedule_work_batch_on(wp, cpu, &work, 1);
+}
+
+/* Delayed work */
+
+static __always_inline bool mthpc_wq_time_before(unsigned long a,
+                                                 unsigned long b)
+{
+    return (long)(a - b) < 0;
+}
+
+static __always_inline unsigned long long mthpc_wq_timer_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Round it up, the truncation of the outer level shouldn't fire it early. */
+static __always_inline unsigned int
+mthpc_wq_timer_calc_index(unsigned long expires, unsigned int lvl,
+                          unsigned long *bucket_expiry)
+{
+    expires = (expires >> MTHPC_WQ_LVL_SHIFT(lvl)) + 1;
+    *bucket_expiry = expires << MTHPC_WQ_LVL_SHIFT(lvl);
+
+    return lvl * MTHPC_WQ_LVL_SIZE + (expires & MTHPC_WQ_LVL_MASK);
+}
+
+static unsigned int mthpc_wq_timer_wheel_index(unsigned long expires,
+                                               unsigned long clk,
+                                               unsigned long *bucket_expiry)
+{
+    unsigned long delta = expires - clk;
+    unsigned int lvl;
+
+    /* Already expired, fire it at the next run. */
+    if ((long)delta < 0) {
+        *bucket_expiry = clk;
+        return clk & MTHPC_WQ_LVL_MASK;
+    }
+
+    if (delta >= MTHPC_WQ_TIMER_CUTOFF)
+        expires = clk + MTHPC_WQ_TIMER_MAX;
+    for (lvl = 0; lvl < MTHPC_WQ_LVL_DEPTH - 1; lvl++) {
+        if (delta < MTHPC_WQ_LVL_START(lvl + 1))
+            break;
+    }
+
+    return mthpc_wq_timer_calc_index(expires, lvl, bucket_expiry);
+}
+
+/* Return the distance from start to the next pending slot, or -1. */
+static __always_inline int mthpc_wq_timer_next_pending(uint64_t map,
+                                                       unsigned int start)
+{
+    if (start)
+        map = (map >> start) | (map << (MTHPC_WQ_LVL_SIZE - start));
+
+    return map ? __builtin_ctzll(map) : -1;
+}
+
+/* Find the tick of the earliest pending slot, the timer lock is held. */
+static unsigned long mthpc_wq_timer_next_expiry(struct mthpc_wq_timer *timer)
+{
+    unsigned long clk = timer->clk, next = clk + MTHPC_WQ_TIMER_MAX;
+    unsigned long lvl_clk, tmp;
+    int pos;
+
+    for (unsigned int lvl = 0; lvl < MTHPC_WQ_LVL_DEPTH; lvl++) {
+        pos = mthpc_wq_timer_next_pending(timer->pending_map[lvl],
+                                          clk & MTHPC_WQ_LVL_MASK);
+        lvl_clk = clk & MTHPC_WQ_LVL_CLK_MASK;
+        if (pos >= 0) {
+            tmp = (clk + pos) << MTHPC_WQ_LVL_SHIFT(lvl);
+            if (mthpc_wq_time_before(tmp, next))
+                next = tmp;
+            /* It expires before we reach the next level. */
+            if (pos <=
+                ((MTHPC_WQ_LVL_CLK_DIV - lvl_clk) & MTHPC_WQ_LVL_CLK_MASK))
+                break;
+        }
+        /*
+         * The clock of the next level. If the lower bits aren't zero, the
+         * current slot of the next level has been passed, so the next one
+         * is the earliest.
+         */
+        clk = (clk >> MTHPC_WQ_LVL_CLK_SHIFT) + (lvl_clk ? 1 : 0);
+    }
+
+    return next;
+}
+
+/*
+ * Queue the works of the expired slots at clk. The upper level is only
+ * checked when the lower level wraps around.
+ */
+static void mthpc_wq_timer_expire(struct mthpc_workpool *wp, unsigned long clk)
+{
+    struct mthpc_wq_timer *timer = &wp->timer;
+    struct mthpc_work *works[MTHPC_WQ_TIMER_BATCH];
+    struct mthpc_delayed_work *dwork;
+    struct mthpc_hlist_head *slot;
+    unsigned int idx;
+    int nr = 0;
+
+    for (unsigned int lvl = 0; lvl < MTHPC_WQ_LVL_DEPTH; lvl++) {
+        idx = clk & MTHPC_WQ_LVL_MASK;
+        if (timer->pending_map[lvl] & (1ULL << idx)) {
+            timer->pending_map[lvl] &= ~(1ULL << idx);
+            slot = &timer->slots[lvl * MTHPC_WQ_LVL_SIZE + idx];
+            while (!mthpc_hlist_empty(slot)) {
+                dwork = mthpc_hlist_entry(slot->first,
+                                          struct mthpc_delayed_work, node);
+                mthpc_hlist_del(&dwork->node);
+                timer->nr_pending--;
+                works[nr++] = &dwork->work;
+                if (nr == MTHPC_WQ_TIMER_BATCH) {
+                    MTHPC_WARN_ON(
+                        __mthpc_schedule_work_batch_on(wp, -1, works, nr),
+                        "queue delayed works failed");
+                    nr = 0;
+                }
+            }
+        }
+        if (clk & MTHPC_WQ_LVL_CLK_MASK)
+            break;
+        clk >>= MTHPC_WQ_LVL_CLK_SHIFT;
+    }
+    if (nr)
+        MTHPC_WARN_ON(__mthpc_schedule_work_batch_on(wp, -1, works, nr),
+                      "queue delayed works failed");
+}
+
+/*
+ * Sleep until the earliest pending slot, and jump the wheel to it. So the
+ * empty ticks cost nothing.
+ */
+static void *mthpc_wq_timer_run(void *arg)
+{
+    struct mthpc_workpool *wp = arg;
+    struct mthpc_wq_timer *timer = &wp->timer;
+    unsigned long long now_ns, timeout_ns;
+    unsigned long now, next;
+    unsigned int nr_pending;
+    struct timespec ts;
+    int32_t seq;
+
+    spin_lock(&timer->lock);
+    while (!timer->stopped) {
+        now_ns = mthpc_wq_timer_now_ns();
+        now = now_ns / MTHPC_WQ_TIMER_TICK_NS;
+        while (timer->nr_pending &&
+               !mthpc_wq_time_before(now, timer->next_expiry)) {
+            timer->clk = timer->next_expiry;
+            mthpc_wq_timer_expire(wp, timer->clk);
+            timer->clk++;
+            timer->next_expiry = mthpc_wq_timer_next_expiry(timer);
+        }
+        nr_pending = timer->nr_pending;
+        next = timer->next_expiry;
+        seq = READ_ONCE(timer->futex);
+        spin_unlock(&timer->lock);
+
+        if (nr_pending) {
+            timeout_ns = next * MTHPC_WQ_TIMER_TICK_NS - now_ns;
+            ts.tv_sec = timeout_ns / 1000000000ULL;
+            ts.tv_nsec = timeout_ns % 1000000000ULL;
+        }
+        if (futex(&timer->futex, FUTEX_WAIT, seq, nr_pending ? &ts : NULL,
+                  NULL, 0) &&
+            errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR)
+            MTHPC_BUG_ON(1, "futex(&timer->futex, FUTEX_WAIT, seq)");
+
+        spin_lock(&timer->lock);
+    }
+    spin_unlock(&timer->lock);
+
+    return NULL;
+}
+
+static __always_inline void mthpc_wq_timer_kick(struct mthpc_wq_timer *timer)
+{
+    WRITE_ONCE(timer->futex, timer->futex + 1);
+}
+
+static int __mthpc_queue_delayed_work(struct mthpc_workpool *wp,
+                                      struct mthpc_delayed_work *dwork,
+                                      unsigned long delay_ns)
+{
+    struct mthpc_wq_timer *timer = &wp->timer;
+    unsigned long now, expires, bucket_expiry;
+    unsigned int idx;
+    bool wake = false;
+    int ret = 0;
+
+    if (!delay_ns)
+        return __mthpc_schedule_work_on(wp, -1, &dwork->work);
+
+    now = mthpc_wq_timer_now_ns() / MTHPC_WQ_TIMER_TICK_NS;
+    expires = now + (delay_ns + MTHPC_WQ_TIMER_TICK_NS - 1) /
+                        MTHPC_WQ_TIMER_TICK_NS;
+
+    spin_lock(&timer->lock);
+    if (unlikely(timer->stopped)) {
+        ret = -ESHUTDOWN;
+        goto unlock;
+    }
+    if (!mthpc_hlist_unhashed(&dwork->node)) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+    if (unlikely(!timer->started)) {
+        MTHPC_BUG_ON(pthread_create(&timer->tid, NULL, mthpc_wq_timer_run, wp),
+                     "create timer thread failed");
+        timer->started = true;
+    }
+
+    /* Nothing expires before next_expiry, forward the wheel to now. */
+    if (!timer->nr_pending)
+        timer->clk = now;
+    else if (mthpc_wq_time_before(timer->clk, now))
+        timer->clk = mthpc_wq_time_before(timer->next_expiry, now) ?
+                         timer->next_expiry :
+                         now;
+
+    idx = mthpc_wq_timer_wheel_index(expires, timer->clk, &bucket_expiry);
+    mthpc_hlist_add_head(&dwork->node, &timer->slots[idx]);
+    timer->pending_map[idx / MTHPC_WQ_LVL_SIZE] |= 1ULL
+                                                   << (idx & MTHPC_WQ_LVL_MASK);
+    dwork->idx = idx;
+
+    /* The timer thread might sleep for the later one, wake it up. */
+    if (!timer->nr_pending++ ||
+        mthpc_wq_time_before(bucket_expiry, timer->next_expiry)) {
+        timer->next_expiry = bucket_expiry;
+        mthpc_wq_timer_kick(timer);
+        wake = true;
+    }
+
+unlock:
+    spin_unlock(&timer->lock);
+    if (wake)
+        futex(&timer->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+    return ret;
+}
+
+static bool __mthpc_cancel_delayed_work(struct mthpc_workpool *wp,
+                                        struct mthpc_delayed_work *dwork)
+{
+    struct mthpc_wq_timer *timer = &wp->timer;
+    bool pending;
+
+    spin_lock(&timer->lock);
+    pending = !mthpc_hlist_unhashed(&dwork->node);
+    if (pending) {
+        mthpc_hlist_del(&dwork->node);
+        if (mthpc_hlist_empty(&timer->slots[dwork->idx]))
+            timer->pending_map[dwork->idx / MTHPC_WQ_LVL_SIZE] &=
+                ~(1ULL << (dwork->idx & MTHPC_WQ_LVL_MASK));
+        /* The timer thread will find nothing to do if it's the earliest. */
+        timer->nr_pending--;
+    }
+    spin_unlock(&timer->lock);
+
+    return pending;
+}
+
 /* internal API */
 
 int mthpc_queue_thread_work(struct mthpc_work *work)
@@ -325,9 +990,9 @@ int mthpc_queue_thread_work(struct mthpc_work *work)
     return __mthpc_schedule_work_on(&mthpc_thread_wp, -1, work);
 }
 
-int mthpc_schedule_taskflow_work_on(int cpu, struct mthpc_work *work)
+int mthpc_queue_taskflow_work_batch(struct mthpc_work **works, int n)
 {
-    return __mthpc_schedule_work_on(&mthpc_taskflow_wp, cpu, work);
+    return __mthpc_schedule_work_batch_on(&mthpc_taskflow_wp, -1, works, n);
 }
 
 /* user API */
@@ -342,6 +1007,27 @@ int mthpc_queue_work(struct mthpc_work *work)
     return mthpc_schedule_work_on(-1, work);
 }
 
+int mthpc_schedule_work_batch_on(int cpu, struct mthpc_work **works, int n)
+{
+    return __mthpc_schedule_work_batch_on(&mthpc_workpool, cpu, works, n);
+}
+
+int mthpc_queue_work_batch(struct mthpc_work **works, int n)
+{
+    return mthpc_schedule_work_batch_on(-1, works, n);
+}
+
+int mthpc_queue_delayed_work(struct mthpc_delayed_work *dwork,
+                             unsigned long delay_ns)
+{
+    return __mthpc_queue_delayed_work(&mthpc_workpool, dwork, delay_ns);
+}
+
+bool mthpc_cancel_delayed_work(struct mthpc_delayed_work *dwork)
+{
+    return __mthpc_cancel_delayed_work(&mthpc_workpool, dwork);
+}
+
 void mthpc_dump_work(struct mthpc_work *work)
 {
     struct mthpc_workqueue *wq = work->wq;
@@ -356,91 +1042,146 @@ void mthpc_dump_work(struct mthpc_work *work)
 
 /* init/exit function */
 
-static void mthpc_workqueues_join(struct mthpc_workpool *wp)
+static void mthpc_wq_cpus_init(void)
 {
-    struct mthpc_list_head *curr, *n;
-    struct mthpc_list_head free_list;
-    unsigned int progress = 0;
+    int nr = 0, max_cpu = -1;
+#ifdef __linux__
+    cpu_set_t cpuset;
 
-    while (1) {
-        if (!atomic_load_explicit(&wp->count, memory_order_relaxed))
-            break;
-        if (progress >= 32) {
-            progress = 0;
-            sched_yield();
-            continue;
+    CPU_ZERO(&cpuset);
+    if (!sched_getaffinity(0, sizeof(cpuset), &cpuset)) {
+        nr = CPU_COUNT(&cpuset);
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &cpuset))
+                max_cpu = i;
         }
+    }
+#endif
+    if (nr <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
 
-        mthpc_list_init(&free_list);
-
-        spin_lock(&wp->lock);
-        mthpc_list_for_each_safe (curr, n, &wp->head) {
-            struct mthpc_workqueue *wq =
-                container_of(curr, struct mthpc_workqueue, node);
-
-            spin_lock(&wq->lock);
-            /* We should waiting for the works in wq. */
-            if (!wq->count) {
-                mthpc_list_del_rcu(&wq->node);
-                // TODO: Could we avoid synchronize with hoding two locks?
-                mthpc_synchronize_rcu();
-                mthpc_list_add(&wq->node, &free_list);
-                mthpc_wq_clear_active(wq);
-            }
-            spin_unlock(&wq->lock);
+        nr = (online < 1) ? 1 : online;
+        max_cpu = nr - 1;
+#ifdef __linux__
+        CPU_ZERO(&cpuset);
+        for (int i = 0; i < nr && i < CPU_SETSIZE; i++)
+            CPU_SET(i, &cpuset);
+#endif
+    }
+
+    mthpc_wq_cpus.nr = nr;
+    mthpc_wq_cpus.nr_index = max_cpu + 1;
+    mthpc_wq_cpus.cpu = malloc(sizeof(int) * mthpc_wq_cpus.nr);
+    mthpc_wq_cpus.index = malloc(sizeof(int) * mthpc_wq_cpus.nr_index);
+    MTHPC_BUG_ON(!mthpc_wq_cpus.cpu || !mthpc_wq_cpus.index,
+                 "allocation failed");
+
+    for (int i = 0, idx = 0; i <= max_cpu; i++) {
+#ifdef __linux__
+        if (!CPU_ISSET(i, &cpuset)) {
+            mthpc_wq_cpus.index[i] = -1;
+            continue;
         }
-        spin_unlock(&wp->lock);
-
-        if (!mthpc_list_empty(&free_list)) {
-            mthpc_list_for_each_safe (curr, n, &free_list) {
-                struct mthpc_workqueue *wq =
-                    container_of(curr, struct mthpc_workqueue, node);
-
-                pthread_join(wq->tid, NULL);
-                /*
-                 * We don't have to hold lock anymore, however we
-                 * should still make sure the read access is atomic ops.
-                 * It's fine if the value is unstable.
-                 */
-                MTHPC_WARN_ON(
-                    atomic_load_explicit(
-                        (volatile _Atomic __typeof__(wq->count) *)&wq->count,
-                        memory_order_relaxed) > 0,
-                    "freeing wq but still holding work(s)");
-                spin_lock_destroy(&wq->lock);
-                free(wq);
-                atomic_fetch_add_explicit(&wp->count, -1, memory_order_relaxed);
-            }
-        } else
-            progress += 7;
-        progress++;
+#endif
+        mthpc_wq_cpus.cpu[idx] = i;
+        mthpc_wq_cpus.index[i] = idx++;
+    }
+}
+
+static void mthpc_wq_cpus_exit(void)
+{
+    free(mthpc_wq_cpus.cpu);
+    free(mthpc_wq_cpus.index);
+}
+
+static void mthpc_wq_timer_init(struct mthpc_wq_timer *timer)
+{
+    spin_lock_init(&timer->lock);
+    timer->started = false;
+    timer->stopped = false;
+    timer->futex = 0;
+    timer->clk = mthpc_wq_timer_now_ns() / MTHPC_WQ_TIMER_TICK_NS;
+    timer->next_expiry = timer->clk;
+    timer->nr_pending = 0;
+    for (unsigned int i = 0; i < MTHPC_WQ_LVL_DEPTH; i++)
+        timer->pending_map[i] = 0;
+    for (unsigned int i = 0; i < MTHPC_WQ_LVL_DEPTH * MTHPC_WQ_LVL_SIZE; i++)
+        mthpc_hlist_init(&timer->slots[i]);
+}
+
+/*
+ * Stop the timer thread, the pending delayed works are dropped. Arming it
+ * after this returns -ESHUTDOWN.
+ */
+static void mthpc_wq_timer_stop(struct mthpc_wq_timer *timer)
+{
+    bool started;
+
+    spin_lock(&timer->lock);
+    timer->stopped = true;
+    started = timer->started;
+    mthpc_wq_timer_kick(timer);
+    spin_unlock(&timer->lock);
+
+    if (started) {
+        futex(&timer->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+        pthread_join(timer->tid, NULL);
     }
 }
 
 static void mthpc_workpool_init(struct mthpc_workpool *wp, const char *name)
 {
     wp->name = name;
-    spin_lock_init(&wp->lock);
-    mthpc_list_init(&wp->head);
-    atomic_init(&wp->count, 0);
+    wp->wq = malloc(sizeof(*wp->wq) * mthpc_wq_cpus.nr);
+    MTHPC_BUG_ON(!wp->wq, "allocation failed");
+    for (unsigned int i = 0; i < mthpc_wq_cpus.nr; i++)
+        atomic_init(&wp->wq[i], NULL);
+    atomic_init(&wp->nr_work, 0);
+    atomic_init(&wp->nr_wq, 0);
+    atomic_init(&wp->nr_idle, 0);
+    mthpc_wq_timer_init(&wp->timer);
 }
 
 static void mthpc_workpool_exit(struct mthpc_workpool *wp)
 {
-    unsigned int count;
+    struct mthpc_workqueue *wq;
+
+    mthpc_wq_timer_stop(&wp->timer);
 
-    mthpc_synchronize_rcu();
-    mthpc_workqueues_join(wp);
-    spin_lock_destroy(&wp->lock);
-    count = atomic_load(&wp->count);
-    MTHPC_WARN_ON(count != 0, "%s workpool might still has workqueue(s)=%u",
-                  wp->name, count);
+    /* Wait for the works, including the ones queued by the running work. */
+    while (atomic_load_explicit(&wp->nr_work, memory_order_acquire))
+        sched_yield();
+
+    for (unsigned int i = 0; i < mthpc_wq_cpus.nr; i++) {
+        wq = atomic_load_explicit(&wp->wq[i], memory_order_acquire);
+        if (!wq)
+            continue;
+        mthpc_wq_clear_active(wq);
+        mthpc_wq_futex_wake(wq);
+        pthread_join(wq->tid, NULL);
+    }
+
+    /* The workers scan the siblings, free them after all are stopped. */
+    for (unsigned int i = 0; i < mthpc_wq_cpus.nr; i++) {
+        wq = atomic_load_explicit(&wp->wq[i], memory_order_acquire);
+        if (!wq)
+            continue;
+        MTHPC_WARN_ON(atomic_load_explicit(&wq->inbox, memory_order_relaxed) ||
+                          mthpc_wq_deque_size(&wq->deque),
+                      "freeing wq but still holding work(s)");
+        free(wq);
+    }
+    free(wp->wq);
+    wp->wq = NULL;
+    /* The running work might arm the delayed work until here. */
+    spin_lock_destroy(&wp->timer.lock);
 }
 
 // create one thread handle join
 static void __mthpc_init mthpc_workqueue_init(void)
 {
     mthpc_init_feature();
+    mthpc_wq_cpus_init();
     mthpc_workpool_init(&mthpc_workpool, "global");
     mthpc_workpool_init(&mthpc_thread_wp, "thread");
     mthpc_workpool_init(&mthpc_taskflow_wp, "taskflow");
@@ -457,5 +1198,6 @@ static void __mthpc_exit mthpc_workqueue_exit(void)
     mthpc_workpool_exit(&mthpc_taskflow_wp);
     //mthpc_workpool_exit(&mthpc_rcu_wp);
     /* Add new pool here. */
+    mthpc_wq_cpus_exit();
     mthpc_exit_ok();
 }
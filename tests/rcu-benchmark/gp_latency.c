@@ -0,0 +1,116 @@
+/*
+ * Grace-period latency benchmark.
+ *
+ * Start the readers looping on the short read-side critical section, then
+ * measure the latency of mthpc_synchronize_rcu() from one updater. Build the
+ * library with or without rcu_tree=1 to compare the flat and tree mode, see
+ * the Makefile.
+ *
+ * usage: ./gp_latency [nr_reader] [nr_gp]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <mthpc/rcu.h>
+#include <mthpc/debug.h>
+
+#define DEFAULT_NR_READER 8
+#define DEFAULT_NR_GP 1000
+#define READ_SPIN 16
+
+static atomic_int nr_ready;
+static atomic_int stop;
+static int *shared;
+
+static void *reader(void *unused)
+{
+    unsigned long loops = 0;
+    int *p;
+
+    mthpc_rcu_thread_init();
+    atomic_fetch_add(&nr_ready, 1);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        mthpc_rcu_read_lock();
+        p = mthpc_rcu_dereference(shared);
+        for (int i = 0; i < READ_SPIN; i++)
+            mthpc_cmb();
+        MTHPC_BUG_ON(*p < 0, "read the freed data");
+        mthpc_rcu_read_unlock();
+        /* Let the updater run if we share the CPU. */
+        if ((++loops & 0xff) == 0)
+            sched_yield();
+    }
+
+    mthpc_rcu_thread_exit();
+
+    return NULL;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long start, delta, sum = 0, min = ~0ULL, max = 0;
+    int nr_reader = DEFAULT_NR_READER, nr_gp = DEFAULT_NR_GP;
+    pthread_t *tids;
+    int *new, *old;
+
+    if (argc > 1)
+        nr_reader = atoi(argv[1]);
+    if (argc > 2)
+        nr_gp = atoi(argv[2]);
+    MTHPC_BUG_ON(nr_reader < 0 || nr_gp <= 0, "invalid argument");
+
+    tids = malloc(sizeof(pthread_t) * nr_reader);
+    shared = malloc(sizeof(int));
+    MTHPC_BUG_ON(!tids || !shared, "allocation failed");
+    *shared = 0;
+
+    for (int i = 0; i < nr_reader; i++)
+        MTHPC_BUG_ON(pthread_create(&tids[i], NULL, reader, NULL),
+                     "pthread_create failed");
+    while (atomic_load(&nr_ready) != nr_reader)
+        sched_yield();
+
+    for (int i = 0; i < nr_gp; i++) {
+        new = malloc(sizeof(int));
+        MTHPC_BUG_ON(!new, "allocation failed");
+        *new = i + 1;
+        old = mthpc_rcu_replace_pointer(shared, new);
+
+        start = now_ns();
+        mthpc_synchronize_rcu();
+        delta = now_ns() - start;
+
+        *old = -1;
+        free(old);
+        sum += delta;
+        min = (delta < min) ? delta : min;
+        max = (delta > max) ? delta : max;
+    }
+
+    atomic_store(&stop, 1);
+    for (int i = 0; i < nr_reader; i++)
+        pthread_join(tids[i], NULL);
+
+    printf("readers %4d  gp %6d  avg %10.1f us  min %10.1f us  max %10.1f us\n",
+           nr_reader, nr_gp, (double)sum / nr_gp / 1000.0, min / 1000.0,
+           max / 1000.0);
+
+    free(shared);
+    free(tids);
+
+    return 0;
+}
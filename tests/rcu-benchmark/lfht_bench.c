@@ -0,0 +1,189 @@
+/*
+ * Lock-free hash table throughput benchmark.
+ *
+ * Every thread runs the random lookup, add and del on a shared key range for
+ * the given time. The update ratio is in percent, the half of the updates is
+ * the add and the other half is the del. So 2 is the read-mostly mix and 100
+ * is the 50/50 add/del mix.
+ *
+ * usage: ./lfht_bench [nr_thread] [update_percent] [seconds]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <mthpc/rculfhash.h>
+#include <mthpc/rcu.h>
+#include <mthpc/debug.h>
+
+#define DEFAULT_NR_THREAD 8
+#define DEFAULT_UPDATE 2
+#define DEFAULT_SECONDS 2
+#define NR_KEY 65536
+
+struct bench_node {
+    unsigned long key;
+    struct mthpc_lfht_node node;
+    struct mthpc_rcu_head rcu;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    unsigned long seed;
+    unsigned long nr_lookup;
+    unsigned long nr_add;
+    unsigned long nr_del;
+} __mthpc_aligned__;
+
+static struct mthpc_lfht *ht;
+static int update_percent = DEFAULT_UPDATE;
+static atomic_int stop;
+
+static int match_key(struct mthpc_lfht_node *node, const void *key)
+{
+    struct bench_node *b = mthpc_lfht_entry(node, struct bench_node, node);
+
+    return b->key == *(const unsigned long *)key;
+}
+
+static void free_node(struct mthpc_rcu_head *head)
+{
+    free(container_of(head, struct bench_node, rcu));
+}
+
+static inline unsigned long xorshift(unsigned long *seed)
+{
+    unsigned long x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+    return x;
+}
+
+static void bench_add(unsigned long key)
+{
+    struct mthpc_lfht_node *ret;
+    struct bench_node *b;
+
+    b = malloc(sizeof(struct bench_node));
+    MTHPC_BUG_ON(!b, "allocation failed");
+    b->key = key;
+
+    ret = mthpc_lfht_add_unique(ht, mthpc_lfht_hash_u64(key), match_key, &key,
+                                &b->node);
+    if (ret != &b->node)
+        free(b);
+}
+
+static void bench_del(unsigned long key)
+{
+    struct mthpc_lfht_node *node;
+    struct bench_node *b;
+
+    node = mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match_key, &key);
+    if (node && !mthpc_lfht_del(ht, node)) {
+        b = mthpc_lfht_entry(node, struct bench_node, node);
+        mthpc_call_rcu(&b->rcu, free_node);
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct bench_thread *t = arg;
+    unsigned long r, key;
+
+    mthpc_rcu_thread_init();
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        r = xorshift(&t->seed);
+        key = (r >> 17) % NR_KEY;
+
+        mthpc_rcu_read_lock();
+        if ((r & 0xffff) % 100 >= update_percent) {
+            mthpc_lfht_lookup(ht, mthpc_lfht_hash_u64(key), match_key, &key);
+            t->nr_lookup++;
+        } else if (r & 0x10000) {
+            bench_add(key);
+            t->nr_add++;
+        } else {
+            bench_del(key);
+            t->nr_del++;
+        }
+        mthpc_rcu_read_unlock();
+    }
+
+    mthpc_rcu_thread_exit();
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long nr_lookup = 0, nr_update = 0;
+    int nr_thread = DEFAULT_NR_THREAD, seconds = DEFAULT_SECONDS;
+    struct bench_thread *threads;
+
+    if (argc > 1)
+        nr_thread = atoi(argv[1]);
+    if (argc > 2)
+        update_percent = atoi(argv[2]);
+    if (argc > 3)
+        seconds = atoi(argv[3]);
+    MTHPC_BUG_ON(nr_thread <= 0 || update_percent < 0 ||
+                     update_percent > 100 || seconds <= 0,
+                 "invalid argument");
+
+    threads = aligned_alloc(sizeof(struct bench_thread),
+                            sizeof(struct bench_thread) * nr_thread);
+    ht = mthpc_lfht_create(1);
+    MTHPC_BUG_ON(!threads || !ht, "allocation failed");
+
+    /* Fill the half of the key range. */
+    mthpc_rcu_thread_init();
+    mthpc_rcu_read_lock();
+    for (unsigned long key = 0; key < NR_KEY; key += 2)
+        bench_add(key);
+    mthpc_rcu_read_unlock();
+
+    for (int i = 0; i < nr_thread; i++) {
+        threads[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+        threads[i].nr_lookup = 0;
+        threads[i].nr_add = 0;
+        threads[i].nr_del = 0;
+        MTHPC_BUG_ON(pthread_create(&threads[i].tid, NULL, worker, &threads[i]),
+                     "pthread_create failed");
+    }
+
+    sleep(seconds);
+    atomic_store(&stop, 1);
+
+    for (int i = 0; i < nr_thread; i++) {
+        pthread_join(threads[i].tid, NULL);
+        nr_lookup += threads[i].nr_lookup;
+        nr_update += threads[i].nr_add + threads[i].nr_del;
+    }
+
+    printf("threads %4d  update %3d%%  %12.0f ops/s  (lookup %lu update %lu)"
+           "  buckets %lu\n",
+           nr_thread, update_percent,
+           (double)(nr_lookup + nr_update) / seconds, nr_lookup, nr_update,
+           mthpc_lfht_size(ht));
+
+    /* Empty the table before destroying it. */
+    mthpc_rcu_read_lock();
+    for (unsigned long key = 0; key < NR_KEY; key++)
+        bench_del(key);
+    mthpc_rcu_read_unlock();
+    mthpc_rcu_barrier();
+    mthpc_rcu_thread_exit();
+
+    mthpc_lfht_destroy(ht);
+    free(threads);
+
+    return 0;
+}
@@ -0,0 +1,463 @@
+/*
+ * Native rcu benchmark, doesn't need liburcu.
+ *
+ * Sweep the number of readers and writers. For each pair, the readers loop
+ * on the short read-side critical section and the writers replace the
+ * shared pointer and wait for the grace period, for the given time. Report
+ * the read-side cost in cycles, the grace-period latency percentiles and
+ * the update throughput. The time is measured with the TSC on x86-64 and
+ * converted to ns with the calibrated rate, CLOCK_MONOTONIC elsewhere.
+ *
+ * usage: ./rcu_bench [-f rcu|percpu|srcu] [-r readers] [-w writers]
+ *                    [-d duration_ms] [-o csv|json] [-O file]
+ *   readers and writers are the comma-separated lists, e.g. -r 1,2,4,8.
+ *
+ * The result goes to the file, or stdout mixed with the feature messages of
+ * the library. See `make bench` in the top-level Makefile.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include <mthpc/rcu.h>
+#include <mthpc/rcu_percpu.h>
+#include <mthpc/srcu.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+
+#define MAX_SWEEP 32
+#define READ_BATCH 256
+#define MAX_SAMPLE 65536
+
+/* Flavor */
+
+struct flavor {
+    const char *name;
+    void (*thread_init)(void);
+    void (*thread_exit)(void);
+    int (*read_lock)(void);
+    void (*read_unlock)(int idx);
+    void (*synchronize)(void);
+};
+
+static struct mthpc_srcu_struct srcu;
+
+static void nop(void)
+{
+}
+
+static int rcu_lock(void)
+{
+    mthpc_rcu_read_lock();
+    return 0;
+}
+
+static void rcu_unlock(int unused)
+{
+    mthpc_rcu_read_unlock();
+}
+
+static int percpu_lock(void)
+{
+    mthpc_rcu_percpu_read_lock();
+    return 0;
+}
+
+static void percpu_unlock(int unused)
+{
+    mthpc_rcu_percpu_read_unlock();
+}
+
+static int srcu_lock(void)
+{
+    return mthpc_srcu_read_lock(&srcu);
+}
+
+static void srcu_unlock(int idx)
+{
+    mthpc_srcu_read_unlock(&srcu, idx);
+}
+
+static void srcu_sync(void)
+{
+    mthpc_synchronize_srcu(&srcu);
+}
+
+static const struct flavor flavors[] = {
+    { "rcu", mthpc_rcu_thread_init, mthpc_rcu_thread_exit, rcu_lock,
+      rcu_unlock, mthpc_synchronize_rcu },
+    { "percpu", nop, nop, percpu_lock, percpu_unlock,
+      mthpc_synchronize_rcu_percpu },
+    { "srcu", nop, nop, srcu_lock, srcu_unlock, srcu_sync },
+};
+
+static const struct flavor *flavor = &flavors[0];
+
+/* Timing */
+
+static double tsc_per_ns = 1.0;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __always_inline unsigned long long read_tsc(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void tsc_calibrate(void)
+{
+#ifdef HAVE_TSC
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 50 * 1000000L };
+    unsigned long long ns, tsc;
+
+    ns = now_ns();
+    tsc = read_tsc();
+    nanosleep(&ts, NULL);
+    tsc = read_tsc() - tsc;
+    ns = now_ns() - ns;
+    tsc_per_ns = (double)tsc / ns;
+#endif
+}
+
+/* Threads */
+
+struct reader {
+    pthread_t tid;
+    unsigned long nr_read;
+    unsigned long long cycles;
+} __mthpc_aligned__;
+
+struct writer {
+    pthread_t tid;
+    unsigned long nr_update;
+    unsigned long nr_sample;
+    unsigned long long *sample;
+} __mthpc_aligned__;
+
+static atomic_int nr_ready;
+static atomic_int start;
+static atomic_int stop;
+static int *shared;
+
+static void wait_for_start(void)
+{
+    atomic_fetch_add(&nr_ready, 1);
+    while (!atomic_load_explicit(&start, memory_order_acquire))
+        sched_yield();
+}
+
+static void *read_func(void *arg)
+{
+    struct reader *r = arg;
+    unsigned long long t;
+    int idx, *p;
+
+    flavor->thread_init();
+    wait_for_start();
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        t = read_tsc();
+        for (int i = 0; i < READ_BATCH; i++) {
+            idx = flavor->read_lock();
+            p = mthpc_rcu_dereference(shared);
+            MTHPC_BUG_ON(*p < 0, "read the freed data");
+            flavor->read_unlock(idx);
+        }
+        r->cycles += read_tsc() - t;
+        r->nr_read += READ_BATCH;
+        /* Let the writers run if we share the CPU. */
+        sched_yield();
+    }
+
+    flavor->thread_exit();
+
+    return NULL;
+}
+
+static void *write_func(void *arg)
+{
+    struct writer *w = arg;
+    unsigned long long t;
+    int *new, *old;
+
+    flavor->thread_init();
+    wait_for_start();
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        new = malloc(sizeof(int));
+        MTHPC_BUG_ON(!new, "allocation failed");
+        *new = w->nr_update;
+        old = mthpc_rcu_replace_pointer(shared, new);
+
+        t = read_tsc();
+        flavor->synchronize();
+        t = read_tsc() - t;
+
+        *old = -1;
+        free(old);
+        if (w->nr_sample < MAX_SAMPLE)
+            w->sample[w->nr_sample++] = t;
+        w->nr_update++;
+    }
+
+    flavor->thread_exit();
+
+    return NULL;
+}
+
+/* Result */
+
+struct result {
+    int nr_reader;
+    int nr_writer;
+    unsigned long nr_read;
+    double read_cycles;
+    unsigned long nr_update;
+    double update_per_sec;
+    /* The grace-period latency in ns. */
+    double p50, p90, p99, p999, max;
+};
+
+static int cmp_sample(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(unsigned long long *sample, unsigned long nr,
+                         double p)
+{
+    if (!nr)
+        return 0;
+    return sample[(unsigned long)(p * (nr - 1))] / tsc_per_ns;
+}
+
+static void run_one(int nr_reader, int nr_writer, int duration_ms,
+                    struct result *res)
+{
+    struct timespec ts = { .tv_sec = duration_ms / 1000,
+                           .tv_nsec = (duration_ms % 1000) * 1000000L };
+    struct reader *readers;
+    struct writer *writers;
+    unsigned long long read_cycles = 0, *all;
+    unsigned long nr_sample = 0;
+
+    readers = aligned_alloc(sizeof(struct reader),
+                            sizeof(struct reader) * (nr_reader + 1));
+    writers = aligned_alloc(sizeof(struct writer),
+                            sizeof(struct writer) * (nr_writer + 1));
+    MTHPC_BUG_ON(!readers || !writers, "allocation failed");
+    memset(readers, 0, sizeof(struct reader) * nr_reader);
+    memset(writers, 0, sizeof(struct writer) * nr_writer);
+
+    atomic_store(&nr_ready, 0);
+    atomic_store(&start, 0);
+    atomic_store(&stop, 0);
+
+    for (int i = 0; i < nr_reader; i++)
+        MTHPC_BUG_ON(pthread_create(&readers[i].tid, NULL, read_func,
+                                    &readers[i]),
+                     "pthread_create failed");
+    for (int i = 0; i < nr_writer; i++) {
+        writers[i].sample = malloc(sizeof(unsigned long long) * MAX_SAMPLE);
+        MTHPC_BUG_ON(!writers[i].sample, "allocation failed");
+        MTHPC_BUG_ON(pthread_create(&writers[i].tid, NULL, write_func,
+                                    &writers[i]),
+                     "pthread_create failed");
+    }
+    while (atomic_load(&nr_ready) != nr_reader + nr_writer)
+        sched_yield();
+
+    atomic_store_explicit(&start, 1, memory_order_release);
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, 1);
+
+    memset(res, 0, sizeof(struct result));
+    res->nr_reader = nr_reader;
+    res->nr_writer = nr_writer;
+    for (int i = 0; i < nr_reader; i++) {
+        pthread_join(readers[i].tid, NULL);
+        res->nr_read += readers[i].nr_read;
+        read_cycles += readers[i].cycles;
+    }
+    for (int i = 0; i < nr_writer; i++) {
+        pthread_join(writers[i].tid, NULL);
+        res->nr_update += writers[i].nr_update;
+        nr_sample += writers[i].nr_sample;
+    }
+    if (res->nr_read)
+        res->read_cycles = (double)read_cycles / res->nr_read;
+    res->update_per_sec = res->nr_update * 1000.0 / duration_ms;
+
+    all = malloc(sizeof(unsigned long long) * (nr_sample + 1));
+    MTHPC_BUG_ON(!all, "allocation failed");
+    nr_sample = 0;
+    for (int i = 0; i < nr_writer; i++) {
+        memcpy(&all[nr_sample], writers[i].sample,
+               sizeof(unsigned long long) * writers[i].nr_sample);
+        nr_sample += writers[i].nr_sample;
+        free(writers[i].sample);
+    }
+    qsort(all, nr_sample, sizeof(unsigned long long), cmp_sample);
+    res->p50 = percentile(all, nr_sample, 0.5);
+    res->p90 = percentile(all, nr_sample, 0.9);
+    res->p99 = percentile(all, nr_sample, 0.99);
+    res->p999 = percentile(all, nr_sample, 0.999);
+    res->max = percentile(all, nr_sample, 1.0);
+
+    free(all);
+    free(writers);
+    free(readers);
+}
+
+static void print_csv(FILE *out, struct result *res, int nr,
+                      int duration_ms)
+{
+    fprintf(out, "flavor,readers,writers,duration_ms,reads,read_cycles,"
+                 "updates,updates_per_sec,gp_p50_ns,gp_p90_ns,gp_p99_ns,"
+                 "gp_p999_ns,gp_max_ns\n");
+    for (int i = 0; i < nr; i++)
+        fprintf(out, "%s,%d,%d,%d,%lu,%.2f,%lu,%.1f,%.0f,%.0f,%.0f,%.0f,"
+                     "%.0f\n",
+                flavor->name, res[i].nr_reader, res[i].nr_writer,
+                duration_ms, res[i].nr_read, res[i].read_cycles,
+                res[i].nr_update, res[i].update_per_sec, res[i].p50,
+                res[i].p90, res[i].p99, res[i].p999, res[i].max);
+}
+
+static void print_json(FILE *out, struct result *res, int nr,
+                       int duration_ms)
+{
+    fprintf(out, "{\n  \"flavor\": \"%s\",\n  \"duration_ms\": %d,\n"
+                 "  \"tsc_per_ns\": %.4f,\n  \"results\": [\n",
+            flavor->name, duration_ms, tsc_per_ns);
+    for (int i = 0; i < nr; i++)
+        fprintf(out, "    { \"readers\": %d, \"writers\": %d, "
+                     "\"reads\": %lu, \"read_cycles\": %.2f, "
+                     "\"updates\": %lu, \"updates_per_sec\": %.1f, "
+                     "\"gp_p50_ns\": %.0f, \"gp_p90_ns\": %.0f, "
+                     "\"gp_p99_ns\": %.0f, \"gp_p999_ns\": %.0f, "
+                     "\"gp_max_ns\": %.0f }%s\n",
+                res[i].nr_reader, res[i].nr_writer, res[i].nr_read,
+                res[i].read_cycles, res[i].nr_update, res[i].update_per_sec,
+                res[i].p50, res[i].p90, res[i].p99, res[i].p999, res[i].max,
+                (i == nr - 1) ? "" : ",");
+    fprintf(out, "  ]\n}\n");
+}
+
+/* Parse the comma-separated list, return the number of entries. */
+static int parse_list(const char *str, int *list)
+{
+    char *end;
+    int nr = 0;
+
+    while (*str && nr < MAX_SWEEP) {
+        list[nr] = strtol(str, &end, 10);
+        MTHPC_BUG_ON(end == str || list[nr] < 0, "invalid list %s", str);
+        nr++;
+        str = (*end == ',') ? end + 1 : end;
+    }
+
+    return nr;
+}
+
+int main(int argc, char *argv[])
+{
+    int readers[MAX_SWEEP] = { 1, 2, 4, 8 }, writers[MAX_SWEEP] = { 1 };
+    int nr_readers = 4, nr_writers = 1, duration_ms = 1000, json = 0;
+    struct result *res;
+    FILE *out = stdout;
+    int opt, nr = 0;
+
+    while ((opt = getopt(argc, argv, "f:r:w:d:o:O:")) != -1) {
+        switch (opt) {
+        case 'f':
+            flavor = NULL;
+            for (unsigned int i = 0; i < sizeof(flavors) / sizeof(flavors[0]);
+                 i++) {
+                if (!strcmp(optarg, flavors[i].name))
+                    flavor = &flavors[i];
+            }
+            MTHPC_BUG_ON(!flavor, "unknown flavor %s", optarg);
+            break;
+        case 'r':
+            nr_readers = parse_list(optarg, readers);
+            break;
+        case 'w':
+            nr_writers = parse_list(optarg, writers);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'o':
+            MTHPC_BUG_ON(strcmp(optarg, "csv") && strcmp(optarg, "json"),
+                         "unknown output %s", optarg);
+            json = !strcmp(optarg, "json");
+            break;
+        case 'O':
+            out = fopen(optarg, "w");
+            MTHPC_BUG_ON(!out, "open %s failed", optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-f rcu|percpu|srcu] [-r readers] "
+                    "[-w writers] [-d duration_ms] [-o csv|json] "
+                    "[-O file]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    MTHPC_BUG_ON(!nr_readers || !nr_writers || duration_ms <= 0,
+                 "invalid argument");
+
+    res = malloc(sizeof(struct result) * nr_readers * nr_writers);
+    shared = malloc(sizeof(int));
+    MTHPC_BUG_ON(!res || !shared, "allocation failed");
+    *shared = 0;
+    mthpc_srcu_init(&srcu);
+    tsc_calibrate();
+
+    for (int i = 0; i < nr_writers; i++) {
+        for (int j = 0; j < nr_readers; j++) {
+            fprintf(stderr, "%s: readers %d writers %d\n", flavor->name,
+                    readers[j], writers[i]);
+            run_one(readers[j], writers[i], duration_ms, &res[nr++]);
+        }
+    }
+
+    if (json)
+        print_json(out, res, nr, duration_ms);
+    else
+        print_csv(out, res, nr, duration_ms);
+    if (out != stdout)
+        fclose(out);
+
+    mthpc_srcu_cleanup(&srcu);
+    free(shared);
+    free(res);
+
+    return 0;
+}
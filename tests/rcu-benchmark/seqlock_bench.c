@@ -0,0 +1,163 @@
+/*
+ * Sequence lock reader scaling benchmark.
+ *
+ * The readers read the pair of the counters for the given time while one
+ * writer updates it every interval. The same run is repeated with the
+ * pthread rwlock for the comparison. The seqlock reader doesn't write the
+ * shared memory, so its throughput should grow with the readers, and the
+ * rwlock reader bounces the lock cache line between the CPUs.
+ *
+ * usage: ./seqlock_bench [nr_reader] [seconds] [write_interval_us]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <mthpc/seqlock.h>
+#include <mthpc/debug.h>
+#include <mthpc/util.h>
+
+#define DEFAULT_NR_READER 8
+#define DEFAULT_SECONDS 2
+#define DEFAULT_WRITE_INTERVAL_US 100
+
+enum bench_type {
+    BENCH_SEQLOCK,
+    BENCH_RWLOCK,
+};
+
+struct bench_data {
+    unsigned long val;
+    unsigned long check;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    unsigned long nr_read;
+    unsigned long nr_retry;
+} __mthpc_aligned__;
+
+static MTHPC_DEFINE_SEQLOCK(seqlock);
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static struct bench_data data __mthpc_aligned__;
+static enum bench_type type;
+static int write_interval_us = DEFAULT_WRITE_INTERVAL_US;
+static atomic_int stop;
+
+static void *reader(void *arg)
+{
+    struct bench_thread *t = arg;
+    unsigned long val, check;
+    unsigned int seq;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (type == BENCH_SEQLOCK) {
+            for (;;) {
+                seq = mthpc_read_seqbegin(&seqlock);
+                val = READ_ONCE(data.val);
+                check = READ_ONCE(data.check);
+                if (!mthpc_read_seqretry(&seqlock, seq))
+                    break;
+                t->nr_retry++;
+            }
+        } else {
+            pthread_rwlock_rdlock(&rwlock);
+            val = data.val;
+            check = data.check;
+            pthread_rwlock_unlock(&rwlock);
+        }
+        MTHPC_BUG_ON(val != ~check, "read the torn data");
+        t->nr_read++;
+    }
+
+    return NULL;
+}
+
+static void *writer(void *unused)
+{
+    unsigned long i = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        i++;
+        if (type == BENCH_SEQLOCK) {
+            mthpc_write_seqlock(&seqlock);
+            WRITE_ONCE(data.val, i);
+            WRITE_ONCE(data.check, ~i);
+            mthpc_write_sequnlock(&seqlock);
+        } else {
+            pthread_rwlock_wrlock(&rwlock);
+            data.val = i;
+            data.check = ~i;
+            pthread_rwlock_unlock(&rwlock);
+        }
+        usleep(write_interval_us);
+    }
+
+    return NULL;
+}
+
+static void run(struct bench_thread *threads, int nr_reader, int seconds)
+{
+    unsigned long nr_read = 0, nr_retry = 0;
+    pthread_t wtid;
+
+    atomic_store(&stop, 0);
+    data.val = 0;
+    data.check = ~0UL;
+
+    for (int i = 0; i < nr_reader; i++) {
+        threads[i].nr_read = 0;
+        threads[i].nr_retry = 0;
+        MTHPC_BUG_ON(pthread_create(&threads[i].tid, NULL, reader, &threads[i]),
+                     "pthread_create failed");
+    }
+    MTHPC_BUG_ON(pthread_create(&wtid, NULL, writer, NULL),
+                 "pthread_create failed");
+
+    sleep(seconds);
+    atomic_store(&stop, 1);
+
+    pthread_join(wtid, NULL);
+    for (int i = 0; i < nr_reader; i++) {
+        pthread_join(threads[i].tid, NULL);
+        nr_read += threads[i].nr_read;
+        nr_retry += threads[i].nr_retry;
+    }
+
+    printf("%-7s readers %4d  %14.0f reads/s  %12.0f reads/s/reader"
+           "  (retry %lu)\n",
+           (type == BENCH_SEQLOCK) ? "seqlock" : "rwlock", nr_reader,
+           (double)nr_read / seconds, (double)nr_read / seconds / nr_reader,
+           nr_retry);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_reader = DEFAULT_NR_READER, seconds = DEFAULT_SECONDS;
+    struct bench_thread *threads;
+
+    if (argc > 1)
+        nr_reader = atoi(argv[1]);
+    if (argc > 2)
+        seconds = atoi(argv[2]);
+    if (argc > 3)
+        write_interval_us = atoi(argv[3]);
+    MTHPC_BUG_ON(nr_reader <= 0 || seconds <= 0 || write_interval_us < 0,
+                 "invalid argument");
+
+    threads = aligned_alloc(sizeof(struct bench_thread),
+                            sizeof(struct bench_thread) * nr_reader);
+    MTHPC_BUG_ON(!threads, "allocation failed");
+
+    type = BENCH_SEQLOCK;
+    run(threads, nr_reader, seconds);
+    type = BENCH_RWLOCK;
+    run(threads, nr_reader, seconds);
+
+    free(threads);
+
+    return 0;
+}